@@ -0,0 +1,45 @@
+// Times image_perlin against image_simplex for 1 to 8 octaves, on one thread unless a thread count is given.
+// usage: noise_benchmark [size] [nr_of_threads]
+
+#include "image.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <chrono>
+
+namespace
+  {
+  // the fastest of a few runs, in milliseconds
+  double time_noise(image_noise_generator generator, int32_t size, int32_t octaves, int32_t nr_of_threads)
+    {
+    double best = 1e30;
+    for (int32_t run = 0; run < 3; ++run)
+      {
+      const auto start = std::chrono::steady_clock::now();
+      std::unique_ptr<image> im = generator == image_noise_generator::perlin ?
+        image_perlin(default_perlin_context(), size, size, 1, octaves, 0.5f, 0, image_perlin_mode::norm, 1.f, 1.f, 0xff000000, 0xffffffff, image_format::gray16, nr_of_threads) :
+        image_simplex(default_perlin_context(), size, size, 1, octaves, 0.5f, 0, image_perlin_mode::norm, 1.f, 1.f, 0xff000000, 0xffffffff, image_format::gray16, nr_of_threads);
+      const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count());
+      }
+    return best;
+    }
+  }
+
+int main(int argc, char** argv)
+  {
+  const int32_t size = argc > 1 ? atoi(argv[1]) : 2048;
+  const int32_t nr_of_threads = argc > 2 ? atoi(argv[2]) : 1;
+  image_init();
+  printf("%d x %d gray16, %d thread(s)\n", size, size, nr_of_threads);
+  printf("octaves  perlin ms  simplex ms  perlin Mpixel/s  simplex Mpixel/s\n");
+  const double mpixels = (double)size * size / 1e6;
+  for (int32_t octaves = 1; octaves <= 8; ++octaves)
+    {
+    const double perlin = time_noise(image_noise_generator::perlin, size, octaves, nr_of_threads);
+    const double simplex = time_noise(image_noise_generator::simplex, size, octaves, nr_of_threads);
+    printf("%7d  %9.1f  %10.1f  %15.1f  %16.1f\n", octaves, perlin, simplex, mpixels * 1000.0 / perlin, mpixels * 1000.0 / simplex);
+    }
+  return 0;
+  }
@@ -0,0 +1,626 @@
+#include "deflate.h"
+
+#include <string.h>
+#include <algorithm>
+
+namespace
+  {
+  const int64_t window_size = 32768;
+  const int32_t min_match = 3;
+  const int32_t max_match = 258;
+  const int32_t hash_bits = 15;
+  const int32_t literal_codes = 286;
+  const int32_t distance_codes = 30;
+  const int32_t code_length_codes = 19;
+  // A block ends after this many symbols or bytes. The bytes are kept for the stored block that incompressible data gets.
+  const size_t max_block_symbols = 1 << 14;
+  const int64_t max_block_bytes = 1 << 18;
+  // length 3 matches that are further away cost more than 3 literals
+  const int32_t too_far = 4096;
+
+  const uint8_t code_length_order[code_length_codes] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+  struct code_tables
+    {
+    uint16_t length_code[max_match + 1];
+    uint8_t length_extra[literal_codes];
+    uint8_t distance_code[512]; // by distance_index
+    uint8_t distance_extra[distance_codes];
+
+    code_tables()
+      {
+      memset(length_extra, 0, sizeof(length_extra));
+      for (int32_t length = min_match; length <= max_match; ++length)
+        {
+        const int32_t l = length - min_match;
+        int32_t code = 257 + l;
+        if (l == 255)
+          code = 285;
+        else if (l >= 8)
+          {
+          int32_t b = 3;
+          while ((l >> (b + 1)) != 0)
+            ++b;
+          code = 257 + 4 * (b - 1) + ((l >> (b - 2)) & 3);
+          length_extra[code] = (uint8_t)(b - 2);
+          }
+        length_code[length] = (uint16_t)code;
+        }
+      for (int32_t code = 0; code < distance_codes; ++code)
+        distance_extra[code] = (uint8_t)(code < 4 ? 0 : code / 2 - 1);
+      for (int32_t index = 0; index < 512; ++index)
+        {
+        const int32_t d = index < 256 ? index : (index - 256) << 7;
+        int32_t code = d;
+        if (d >= 4)
+          {
+          int32_t b = 2;
+          while ((d >> (b + 1)) != 0)
+            ++b;
+          code = 2 * b + ((d >> (b - 1)) & 1);
+          }
+        distance_code[index] = (uint8_t)code;
+        }
+      }
+    };
+
+  const code_tables& get_code_tables()
+    {
+    static const code_tables tables;
+    return tables;
+    }
+
+  inline int32_t distance_index(int32_t distance)
+    {
+    const int32_t d = distance - 1;
+    return d < 256 ? d : 256 + (d >> 7);
+    }
+
+  // The extra bits of a length or distance are its offset from the first value of its code
+  inline uint32_t extra_value(int32_t value, int32_t extra_bits)
+    {
+    return (uint32_t)value & ((1u << extra_bits) - 1);
+    }
+
+  // Huffman code lengths of at most max_bits for the frequencies. Codes that are too long are avoided by flattening
+  // the frequencies and building the tree again, which costs next to nothing for the rare blocks that need it.
+  void build_lengths(const uint32_t* frequencies, int32_t n, int32_t max_bits, uint8_t* lengths)
+    {
+    std::vector<uint32_t> f(frequencies, frequencies + n);
+    std::vector<int32_t> leaves;
+    std::vector<uint64_t> weights;
+    std::vector<int32_t> parents, depths;
+    memset(lengths, 0, (size_t)n);
+    for (;;)
+      {
+      leaves.clear();
+      for (int32_t i = 0; i < n; ++i)
+        if (f[i] != 0)
+          leaves.push_back(i);
+      if (leaves.size() < 2)
+        {
+        if (leaves.size() == 1)
+          lengths[leaves[0]] = 1;
+        return;
+        }
+      std::stable_sort(leaves.begin(), leaves.end(), [&](int32_t a, int32_t b) { return f[a] < f[b]; });
+      // two queue construction: leaves 0..m-1 sorted by weight, internal nodes m..2m-2 in the order they are made
+      const int32_t m = (int32_t)leaves.size();
+      weights.assign((size_t)(2 * m - 1), 0);
+      parents.assign((size_t)(2 * m - 1), 0);
+      for (int32_t i = 0; i < m; ++i)
+        weights[i] = f[leaves[i]];
+      int32_t next_leaf = 0, next_node = m;
+      for (int32_t node = m; node < 2 * m - 1; ++node)
+        {
+        for (int32_t k = 0; k < 2; ++k)
+          {
+          int32_t child;
+          if (next_leaf < m && (next_node >= node || weights[next_leaf] <= weights[next_node]))
+            child = next_leaf++;
+          else
+            child = next_node++;
+          weights[node] += weights[child];
+          parents[child] = node;
+          }
+        }
+      depths.assign((size_t)(2 * m - 1), 0);
+      int32_t max_depth = 0;
+      for (int32_t i = 2 * m - 3; i >= 0; --i)
+        {
+        depths[i] = depths[parents[i]] + 1;
+        max_depth = std::max(max_depth, depths[i]);
+        }
+      if (max_depth <= max_bits)
+        {
+        for (int32_t i = 0; i < m; ++i)
+          lengths[leaves[i]] = (uint8_t)depths[i];
+        return;
+        }
+      for (auto& v : f)
+        if (v != 0)
+          v = (v >> 1) | 1;
+      }
+    }
+
+  // Canonical codes for the lengths, bit reversed as deflate writes them from the least significant bit
+  void build_codes(const uint8_t* lengths, int32_t n, uint16_t* codes)
+    {
+    uint32_t count[16] = { 0 };
+    for (int32_t i = 0; i < n; ++i)
+      ++count[lengths[i]];
+    count[0] = 0;
+    uint32_t next[16] = { 0 };
+    uint32_t code = 0;
+    for (int32_t bits = 1; bits < 16; ++bits)
+      {
+      code = (code + count[bits - 1]) << 1;
+      next[bits] = code;
+      }
+    for (int32_t i = 0; i < n; ++i)
+      {
+      const int32_t len = lengths[i];
+      if (len == 0)
+        continue;
+      uint32_t c = next[len]++;
+      uint32_t reversed = 0;
+      for (int32_t b = 0; b < len; ++b, c >>= 1)
+        reversed = (reversed << 1) | (c & 1);
+      codes[i] = (uint16_t)reversed;
+      }
+    }
+
+  inline int32_t match_length(const uint8_t* s, const uint8_t* c, int32_t max_length)
+    {
+    int32_t n = 0;
+    while (n + 8 <= max_length)
+      {
+      uint64_t a, b;
+      memcpy(&a, s + n, 8);
+      memcpy(&b, c + n, 8);
+      if (a != b)
+        {
+        while (s[n] == c[n])
+          ++n;
+        return n;
+        }
+      n += 8;
+      }
+    while (n < max_length && s[n] == c[n])
+      ++n;
+    return n;
+    }
+  }
+
+deflate_stream::deflate_stream(int32_t level) : _buffer_start(0), _position(0), _hashed(0), _block_start(0),
+  _head((size_t)1 << hash_bits, -1), _previous((size_t)window_size, -1), _literal_frequencies(literal_codes, 0),
+  _distance_frequencies(distance_codes, 0), _bits(0), _bit_count(0)
+  {
+  // As the configuration table of zlib: the hash chain length, the match length at which the search for a longer match at
+  // the next byte uses a quarter of the chain, the longest match for which that search is done at all, and the match length
+  // that ends a search. The chains are much shorter than zlib's: the filtered rows of heightmaps have few distinct bytes,
+  // which gives long chains that rarely hold longer matches. Level 8, the png default of stb_image_write, looks at as many
+  // candidates as stb_image_write does.
+  static const int32_t chains[10] = { 4, 4, 6, 8, 8, 12, 16, 16, 16, 64 };
+  static const int32_t good_lengths[10] = { 4, 4, 4, 4, 4, 8, 8, 16, 32, 32 };
+  static const int32_t lazy_lengths[10] = { 0, 0, 0, 0, 16, 32, 64, 128, 258, 258 };
+  static const int32_t nice_lengths[10] = { 16, 16, 32, 64, 64, 128, 128, 258, 258, 258 };
+  level = std::min(std::max(level, 1), 9);
+  _max_chain = chains[level];
+  _good_length = good_lengths[level];
+  _lazy_length = lazy_lengths[level];
+  _nice_length = nice_lengths[level];
+  _symbols.reserve(max_block_symbols);
+  get_code_tables();
+  }
+
+void deflate_stream::set_dictionary(const uint8_t* data, size_t size)
+  {
+  if ((int64_t)size > window_size)
+    {
+    data += size - window_size;
+    size = (size_t)window_size;
+    }
+  _buffer.assign(data, data + size);
+  _buffer_start = 0;
+  _hashed = 0;
+  _position = _block_start = (int64_t)size;
+  }
+
+void deflate_stream::write(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+  {
+  // in pieces, so that the buffer stays small whatever the size of the write
+  const size_t piece = 1 << 18;
+  for (size_t offset = 0; offset < size; offset += piece)
+    {
+    const size_t n = std::min(piece, size - offset);
+    _buffer.insert(_buffer.end(), data + offset, data + offset + n);
+    _compress(false, out);
+    }
+  }
+
+void deflate_stream::flush(std::vector<uint8_t>& out)
+  {
+  _compress(true, out);
+  if (!_symbols.empty())
+    _write_block(false, out);
+  _write_bits(0, 3, out); // a stored block without data
+  _align(out);
+  const uint8_t empty[4] = { 0, 0, 0xff, 0xff };
+  out.insert(out.end(), empty, empty + 4);
+  }
+
+void deflate_stream::finish(std::vector<uint8_t>& out)
+  {
+  _compress(true, out);
+  _write_block(true, out);
+  _align(out);
+  }
+
+void deflate_stream::_insert_until(int64_t position)
+  {
+  const int64_t end = _buffer_start + (int64_t)_buffer.size();
+  while (_hashed < position && _hashed + min_match <= end)
+    {
+    const int32_t index = (int32_t)(_hashed - _buffer_start);
+    const uint8_t* p = _buffer.data() + index;
+    const uint32_t v = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16);
+    const uint32_t h = (v * 2654435761u) >> (32 - hash_bits);
+    _previous[index & (window_size - 1)] = _head[h];
+    _head[h] = index;
+    ++_hashed;
+    }
+  }
+
+int32_t deflate_stream::_find_match(int64_t position, int32_t max_chain, int32_t& distance) const
+  {
+  const int64_t end = _buffer_start + (int64_t)_buffer.size();
+  const int32_t max_length = (int32_t)std::min<int64_t>(max_match, end - position);
+  if (max_length < min_match)
+    return 0;
+  const uint8_t* s = _buffer.data() + (position - _buffer_start);
+  const uint32_t v = (uint32_t)s[0] | ((uint32_t)s[1] << 8) | ((uint32_t)s[2] << 16);
+  int32_t candidate = _head[(v * 2654435761u) >> (32 - hash_bits)];
+  const int32_t lowest = (int32_t)(std::max(position - window_size, _buffer_start) - _buffer_start);
+  const int32_t index = (int32_t)(position - _buffer_start);
+  int32_t best = min_match - 1;
+  for (int32_t chain = max_chain; candidate >= lowest && chain > 0; --chain)
+    {
+    const uint8_t* c = _buffer.data() + candidate;
+    // only candidates that can be longer than the best match so far, by its last two bytes, are compared
+    if (c[best] == s[best] && c[best - 1] == s[best - 1] && c[0] == s[0] && c[1] == s[1])
+      {
+      const int32_t length = match_length(s, c, max_length);
+      if (length > best)
+        {
+        best = length;
+        distance = index - candidate;
+        if (length >= _nice_length || length == max_length)
+          break;
+        }
+      }
+    candidate = _previous[candidate & (window_size - 1)];
+    }
+  if (best < min_match || (best == min_match && distance > too_far))
+    return 0;
+  return best;
+  }
+
+void deflate_stream::_add_literal(uint8_t literal)
+  {
+  _symbols.push_back(symbol{ literal, 0 });
+  ++_literal_frequencies[literal];
+  }
+
+void deflate_stream::_add_match(int32_t length, int32_t distance)
+  {
+  const code_tables& tables = get_code_tables();
+  _symbols.push_back(symbol{ (uint16_t)length, (uint16_t)distance });
+  ++_literal_frequencies[tables.length_code[length]];
+  ++_distance_frequencies[tables.distance_code[distance_index(distance)]];
+  }
+
+void deflate_stream::_compress(bool all, std::vector<uint8_t>& out)
+  {
+  const int64_t end = _buffer_start + (int64_t)_buffer.size();
+  // without all, max_match bytes are kept back so that every match can be as long as possible
+  const int64_t limit = all ? end : end - max_match;
+  bool have_next = false;
+  int32_t next_length = 0, next_distance = 0;
+  while (_position < limit)
+    {
+    int32_t length, distance = 0;
+    if (have_next)
+      {
+      length = next_length;
+      distance = next_distance;
+      have_next = false;
+      }
+    else
+      {
+      _insert_until(_position);
+      length = _find_match(_position, _max_chain, distance);
+      }
+    if (length != 0 && length < _lazy_length && _position + 1 < limit)
+      {
+      // a longer match at the next byte wins over this one
+      _insert_until(_position + 1);
+      next_length = _find_match(_position + 1, length >= _good_length ? _max_chain >> 2 : _max_chain, next_distance);
+      have_next = true;
+      if (next_length > length)
+        length = 0;
+      else
+        have_next = false;
+      }
+    if (length != 0)
+      {
+      _add_match(length, distance);
+      _position += length;
+      }
+    else
+      {
+      _add_literal(_buffer[(size_t)(_position - _buffer_start)]);
+      ++_position;
+      }
+    if (_symbols.size() >= max_block_symbols || _position - _block_start >= max_block_bytes)
+      _write_block(false, out);
+    }
+  _discard_history();
+  }
+
+void deflate_stream::_discard_history()
+  {
+  const int64_t keep = std::min(std::min(_position - window_size, _block_start), _hashed);
+  // whole windows, so that the chain entries of the buffer indices that remain stay where they are
+  const int32_t discard = (int32_t)((keep - _buffer_start) / window_size * window_size);
+  if (discard <= 0)
+    return;
+  _buffer.erase(_buffer.begin(), _buffer.begin() + discard);
+  _buffer_start += discard;
+  for (auto& index : _head)
+    index = index >= discard ? index - discard : -1;
+  for (auto& index : _previous)
+    index = index >= discard ? index - discard : -1;
+  }
+
+void deflate_stream::_write_bits(uint32_t bits, int32_t count, std::vector<uint8_t>& out)
+  {
+  _bits |= (uint64_t)bits << _bit_count;
+  _bit_count += count;
+  if (_bit_count >= 32)
+    {
+    const uint8_t bytes[4] = { (uint8_t)_bits, (uint8_t)(_bits >> 8), (uint8_t)(_bits >> 16), (uint8_t)(_bits >> 24) };
+    out.insert(out.end(), bytes, bytes + 4);
+    _bits >>= 32;
+    _bit_count -= 32;
+    }
+  }
+
+void deflate_stream::_align(std::vector<uint8_t>& out)
+  {
+  while (_bit_count > 0)
+    {
+    out.push_back((uint8_t)_bits);
+    _bits >>= 8;
+    _bit_count -= 8;
+    }
+  _bits = 0;
+  _bit_count = 0;
+  }
+
+void deflate_stream::_write_block(bool final, std::vector<uint8_t>& out)
+  {
+  const code_tables& tables = get_code_tables();
+  _literal_frequencies[256] = 1; // end of block
+
+  // dynamic codes. Both codes get at least two symbols, as some decoders reject a code with a single one.
+  std::vector<uint32_t> literal_frequencies = _literal_frequencies;
+  std::vector<uint32_t> distance_frequencies = _distance_frequencies;
+  if (std::count_if(literal_frequencies.begin(), literal_frequencies.end(), [](uint32_t f) { return f != 0; }) < 2)
+    literal_frequencies[0] = std::max(literal_frequencies[0], 1u);
+  for (int32_t i = 0; std::count_if(distance_frequencies.begin(), distance_frequencies.end(), [](uint32_t f) { return f != 0; }) < 2; ++i)
+    distance_frequencies[i] = std::max(distance_frequencies[i], 1u);
+  // the fixed code has two more literal codes, which change the canonical codes of the 9 bit literals
+  uint8_t literal_lengths[literal_codes + 2] = { 0 }, distance_lengths[distance_codes];
+  build_lengths(literal_frequencies.data(), literal_codes, 15, literal_lengths);
+  build_lengths(distance_frequencies.data(), distance_codes, 15, distance_lengths);
+  int32_t hlit = literal_codes, hdist = distance_codes;
+  while (hlit > 257 && literal_lengths[hlit - 1] == 0)
+    --hlit;
+  while (hdist > 1 && distance_lengths[hdist - 1] == 0)
+    --hdist;
+
+  // the code lengths of both codes, run length encoded with the codes 16 (repeat the previous length), 17 and 18 (zeros)
+  uint8_t all_lengths[literal_codes + distance_codes];
+  memcpy(all_lengths, literal_lengths, (size_t)hlit);
+  memcpy(all_lengths + hlit, distance_lengths, (size_t)hdist);
+  const int32_t total = hlit + hdist;
+  std::vector<uint16_t> runs; // code | extra value << 5
+  uint32_t code_length_frequencies[code_length_codes] = { 0 };
+  for (int32_t i = 0; i < total;)
+    {
+    const uint8_t len = all_lengths[i];
+    int32_t run = 1;
+    while (i + run < total && all_lengths[i + run] == len)
+      ++run;
+    if (len == 0 && run >= 3)
+      {
+      run = std::min(run, 138);
+      const uint16_t code = run >= 11 ? 18 : 17;
+      runs.push_back((uint16_t)(code | ((run - (code == 18 ? 11 : 3)) << 5)));
+      ++code_length_frequencies[code];
+      }
+    else if (len != 0 && run >= 4)
+      {
+      run = std::min(run, 7);
+      runs.push_back(len);
+      runs.push_back((uint16_t)(16 | ((run - 4) << 5)));
+      ++code_length_frequencies[len];
+      ++code_length_frequencies[16];
+      }
+    else
+      {
+      run = 1;
+      runs.push_back(len);
+      ++code_length_frequencies[len];
+      }
+    i += run;
+    }
+  uint8_t code_length_lengths[code_length_codes];
+  build_lengths(code_length_frequencies, code_length_codes, 7, code_length_lengths);
+  int32_t hclen = code_length_codes;
+  while (hclen > 4 && code_length_lengths[code_length_order[hclen - 1]] == 0)
+    --hclen;
+
+  // the cheapest of a dynamic, fixed or stored block
+  uint64_t extra_bits = 0, dynamic_bits = 3 + 14 + 3 * (uint64_t)hclen, fixed_bits = 3;
+  for (int32_t i = 0; i < literal_codes; ++i)
+    {
+    const uint64_t f = _literal_frequencies[i];
+    extra_bits += f * tables.length_extra[i];
+    dynamic_bits += f * literal_lengths[i];
+    fixed_bits += f * (i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+    }
+  for (int32_t i = 0; i < distance_codes; ++i)
+    {
+    const uint64_t f = _distance_frequencies[i];
+    extra_bits += f * tables.distance_extra[i];
+    dynamic_bits += f * distance_lengths[i];
+    fixed_bits += f * 5;
+    }
+  for (const uint16_t r : runs)
+    {
+    const int32_t code = r & 31;
+    dynamic_bits += code_length_lengths[code] + (code == 16 ? 2 : code == 17 ? 3 : code == 18 ? 7 : 0);
+    }
+  dynamic_bits += extra_bits;
+  fixed_bits += extra_bits;
+  const int64_t raw_bytes = _position - _block_start;
+  const uint64_t stored_bits = ((uint64_t)raw_bytes / 65535 + 1) * 40 + 8 * (uint64_t)raw_bytes + 7;
+
+  if (stored_bits < std::min(dynamic_bits, fixed_bits))
+    {
+    const uint8_t* data = _buffer.data() + (_block_start - _buffer_start);
+    int64_t left = raw_bytes;
+    do
+      {
+      const uint32_t n = (uint32_t)std::min<int64_t>(left, 65535);
+      left -= n;
+      _write_bits((final && left == 0) ? 1 : 0, 3, out);
+      _align(out);
+      const uint8_t header[4] = { (uint8_t)n, (uint8_t)(n >> 8), (uint8_t)~n, (uint8_t)(~n >> 8) };
+      out.insert(out.end(), header, header + 4);
+      out.insert(out.end(), data, data + n);
+      data += n;
+      } while (left > 0);
+    }
+  else
+    {
+    uint16_t literal_codes_bits[literal_codes + 2] = { 0 }, distance_codes_bits[distance_codes] = { 0 };
+    int32_t literal_count = literal_codes;
+    if (dynamic_bits < fixed_bits)
+      {
+      _write_bits(final ? 1 : 0, 1, out);
+      _write_bits(2, 2, out);
+      _write_bits((uint32_t)(hlit - 257), 5, out);
+      _write_bits((uint32_t)(hdist - 1), 5, out);
+      _write_bits((uint32_t)(hclen - 4), 4, out);
+      for (int32_t i = 0; i < hclen; ++i)
+        _write_bits(code_length_lengths[code_length_order[i]], 3, out);
+      uint16_t code_length_bits[code_length_codes] = { 0 };
+      build_codes(code_length_lengths, code_length_codes, code_length_bits);
+      for (const uint16_t r : runs)
+        {
+        const int32_t code = r & 31;
+        _write_bits(code_length_bits[code], code_length_lengths[code], out);
+        if (code >= 16)
+          _write_bits(r >> 5, code == 16 ? 2 : code == 17 ? 3 : 7, out);
+        }
+      }
+    else
+      {
+      _write_bits(final ? 1 : 0, 1, out);
+      _write_bits(1, 2, out);
+      literal_count = literal_codes + 2;
+      for (int32_t i = 0; i < literal_count; ++i)
+        literal_lengths[i] = (uint8_t)(i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8);
+      for (int32_t i = 0; i < distance_codes; ++i)
+        distance_lengths[i] = 5;
+      }
+    build_codes(literal_lengths, literal_count, literal_codes_bits);
+    build_codes(distance_lengths, distance_codes, distance_codes_bits);
+    for (const symbol& s : _symbols)
+      {
+      if (s.distance == 0)
+        {
+        _write_bits(literal_codes_bits[s.length], literal_lengths[s.length], out);
+        continue;
+        }
+      const int32_t lc = tables.length_code[s.length];
+      _write_bits(literal_codes_bits[lc], literal_lengths[lc], out);
+      if (tables.length_extra[lc] != 0)
+        _write_bits(extra_value(s.length - min_match, tables.length_extra[lc]), tables.length_extra[lc], out);
+      const int32_t dc = tables.distance_code[distance_index(s.distance)];
+      _write_bits(distance_codes_bits[dc], distance_lengths[dc], out);
+      if (tables.distance_extra[dc] != 0)
+        _write_bits(extra_value(s.distance - 1, tables.distance_extra[dc]), tables.distance_extra[dc], out);
+      }
+    _write_bits(literal_codes_bits[256], literal_lengths[256], out);
+    }
+
+  _symbols.clear();
+  std::fill(_literal_frequencies.begin(), _literal_frequencies.end(), 0);
+  std::fill(_distance_frequencies.begin(), _distance_frequencies.end(), 0);
+  _block_start = _position;
+  }
+
+uint32_t adler32_update(uint32_t adler, const uint8_t* data, size_t size)
+  {
+  uint32_t a = adler & 0xffff, b = adler >> 16;
+  while (size > 0)
+    {
+    // 5552 bytes is the most that b can take before the modulo
+    const size_t n = std::min<size_t>(size, 5552);
+    for (size_t i = 0; i < n; ++i)
+      {
+      a += data[i];
+      b += a;
+      }
+    a %= 65521;
+    b %= 65521;
+    data += n;
+    size -= n;
+    }
+  return (b << 16) | a;
+  }
+
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2)
+  {
+  // the sums of the second piece continue from the first: a = a1 + a2 - 1, b = b1 + b2 + size2 * (a1 - 1)
+  const uint64_t base = 65521;
+  const uint64_t a1 = adler1 & 0xffff, b1 = adler1 >> 16, a2 = adler2 & 0xffff, b2 = adler2 >> 16;
+  const uint64_t n = size2 % base;
+  const uint64_t a = (a1 + a2 + base - 1) % base;
+  const uint64_t b = (b1 + b2 + n * a1 + base - n) % base;
+  return (uint32_t)((b << 16) | a);
+  }
+
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size)
+  {
+  static const std::vector<uint32_t> table = []
+    {
+    std::vector<uint32_t> t(256);
+    for (uint32_t i = 0; i < 256; ++i)
+      {
+      uint32_t c = i;
+      for (int k = 0; k < 8; ++k)
+        c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+      t[i] = c;
+      }
+    return t;
+    }();
+  crc = ~crc;
+  for (size_t i = 0; i < size; ++i)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+  }
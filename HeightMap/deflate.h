@@ -0,0 +1,70 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+A deflate (rfc 1951) compressor for streams that do not fit in memory at once.
+Data is compressed as it is written, with lz77 over a 32 kB window and dynamic huffman blocks,
+so the memory used is a few hundred kB whatever the size of the stream.
+*/
+
+class deflate_stream
+  {
+  public:
+    // level goes from 1 (fast) to 9 (small), as for zlib
+    explicit deflate_stream(int32_t level);
+
+    // Primes the window with data that precedes the stream, so that the first bytes can refer to it.
+    // Only before the first write, like zlib's deflateSetDictionary.
+    void set_dictionary(const uint8_t* data, size_t size);
+
+    // Compresses size bytes and appends the output to out. Up to a few hundred kB can be kept back until flush or finish.
+    void write(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+    // Appends all data that is kept back and an empty stored block, so that out ends on a byte boundary (zlib's sync flush).
+    void flush(std::vector<uint8_t>& out);
+
+    // Appends all data that is kept back and ends the stream.
+    void finish(std::vector<uint8_t>& out);
+
+  private:
+    struct symbol
+      {
+      uint16_t length; // the literal byte if distance is 0
+      uint16_t distance;
+      };
+
+    void _compress(bool all, std::vector<uint8_t>& out);
+    void _insert_until(int64_t position);
+    int32_t _find_match(int64_t position, int32_t max_chain, int32_t& distance) const;
+    void _add_literal(uint8_t literal);
+    void _add_match(int32_t length, int32_t distance);
+    void _write_block(bool final, std::vector<uint8_t>& out);
+    void _write_bits(uint32_t bits, int32_t count, std::vector<uint8_t>& out);
+    void _align(std::vector<uint8_t>& out);
+    void _discard_history();
+
+  private:
+    int32_t _max_chain;
+    int32_t _good_length;
+    int32_t _lazy_length;
+    int32_t _nice_length;
+    std::vector<uint8_t> _buffer; // the window followed by the data that is not compressed yet
+    int64_t _buffer_start; // stream position of _buffer[0]
+    int64_t _position; // stream position of the next byte to compress
+    int64_t _hashed; // stream positions before this one are in the hash chains
+    int64_t _block_start; // stream position of the first byte of the pending block
+    std::vector<int32_t> _head; // last _buffer index per hash, -1 if none
+    std::vector<int32_t> _previous; // previous _buffer index with the same hash, per index modulo the window size
+    std::vector<symbol> _symbols; // of the pending block
+    std::vector<uint32_t> _literal_frequencies;
+    std::vector<uint32_t> _distance_frequencies;
+    uint64_t _bits;
+    int32_t _bit_count;
+  };
+
+uint32_t adler32_update(uint32_t adler, const uint8_t* data, size_t size); // start with 1
+uint32_t adler32_combine(uint32_t adler1, uint32_t adler2, size_t size2); // the adler32 of two pieces from their own ones, size2 being the size of the second
+uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size); // start with 0
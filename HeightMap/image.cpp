@@ -2,6 +2,29 @@
 #include <string.h>
 #include <string>
 #include <cmath>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <new>
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <type_traits>
+
+#include "deflate.h"
+#include "qoi.h"
+#include "simd.h"
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb/stb_image.h"
@@ -32,13 +55,23 @@ namespace
       return 0x7fff;
     }
 
-  float perlin_random[256][2];
-  uint8_t perlin_permute[512];
+  template <class T>
+  inline T clamp(T a, T minimum, T maximum)
+    {
+    return a < minimum ? minimum : a > maximum ? maximum : a;
+    }
 
+  inline float value_7fff_to_float(int32_t v)
+    {
+    return v / 32767.0f;
+    }
 
-  static uint32_t random_seed = 0x74382381;
+  inline uint16_t float_to_value_7fff(float v)
+    {
+    return (uint16_t)range7fff((int32_t)(v * 32767.0f + 0.5f));
+    }
 
-  uint32_t get_random()
+  uint32_t get_random(uint32_t& random_seed)
     {
     uint32_t eax = random_seed;
     eax = eax * 0x343fd + 0x269ec3;
@@ -50,64 +83,26 @@ namespace
     return eax | ebx;
     }
 
-  uint32_t get_random(uint32_t maximum)
+  uint32_t get_random(uint32_t& random_seed, uint32_t maximum)
     {
-    return get_random() % maximum;
+    return get_random(random_seed) % maximum;
     }
 
-  float get_random_float()
+  float get_random_float(uint32_t& random_seed)
     {
-    return ((get_random() & 0x3fffffff) * 1.0f) / 0x40000000;
+    return ((get_random(random_seed) & 0x3fffffff) * 1.0f) / 0x40000000;
     }
 
-  void set_random_seed(uint32_t seed)
+  void set_random_seed(uint32_t& random_seed, uint32_t seed)
     {
     random_seed = seed + seed * 17 + seed * 121 + (seed * 121 / 17);
-    get_random();
+    get_random(random_seed);
     random_seed ^= seed + seed * 17 + seed * 121 + (seed * 121 / 17);
-    get_random();
+    get_random(random_seed);
     random_seed ^= seed + seed * 17 + seed * 121 + (seed * 121 / 17);
-    get_random();
+    get_random(random_seed);
     random_seed ^= seed + seed * 17 + seed * 121 + (seed * 121 / 17);
-    get_random();
-    }
-
-  void init_perlin()
-    {
-    set_random_seed(1);
-
-    for (int i = 0; i < 256; ++i)
-      {
-      perlin_random[i][0] = get_random(0x10000);
-      perlin_permute[i] = i;
-      }
-
-    for (int i = 0; i < 255; ++i)
-      {
-      for (int j = i + 1; j < 256; ++j)
-        {
-        if (perlin_random[i][0] > perlin_random[j][0])
-          {
-          std::swap(perlin_random[i][0], perlin_random[j][0]);
-          std::swap(perlin_permute[i], perlin_permute[j]);
-          }
-        }
-      }
-
-    memcpy(perlin_permute + 256, perlin_permute, 256);
-
-    for (int i = 0; i < 256;)
-      {
-      int32_t x = get_random(0x10000) - 0x8000;
-      int32_t y = get_random(0x10000) - 0x8000;
-      if (x * x + y * y < 0x8000 * 0x8000)
-        {
-        perlin_random[i][0] = x / 32768.0f;
-        perlin_random[i][1] = y / 32768.0f;
-        ++i;
-        }
-      }
-
+    get_random(random_seed);
     }
 
   int32_t mul_shift(int32_t a, int32_t b)
@@ -128,7 +123,7 @@ namespace
     return int32_t((int64_t(a) << 16) / b);
     }
 
-  int32_t get_gamma(int32_t value, int32_t* gamma_table)
+  int32_t get_gamma(int32_t value, const int32_t* gamma_table)
     {
     int32_t vi = value >> 5;
     return gamma_table[vi] + (((gamma_table[vi + 1] - gamma_table[vi]) * (value & 31)) >> 5);
@@ -161,16 +156,25 @@ namespace
 #endif
     }
 
-  void set_mem_8(uint64_t* destination, uint64_t value, int count)
+  // fade_64 for a single channel, with the same rounding as fade_64
+  uint16_t fade_16(uint16_t c0, uint16_t c1, int32_t fade)
     {
-    while (count--)
-      *destination++ = value;
+#ifdef _WIN32
+    int16_t diff = (int16_t)(c1 - c0);
+    int16_t diffm = (int16_t)(((int32_t)diff * (int32_t)(int16_t)(-(fade >> 1))) >> 16);
+    int16_t diffms = (int16_t)(diffm << 1);
+    return (uint16_t)clamp<int32_t>((int32_t)(int16_t)c0 - diffms, -32768, 32767);
+#else
+    int64_t f1 = fade;
+    int64_t f0 = 0x10000 - fade;
+    return (uint16_t)((((c0 * f0) >> 16) + ((c1 * f1) >> 16)) & 0xffff);
+#endif
     }
 
-  template <class T>
-  inline T clamp(T a, T minimum, T maximum)
+  void set_mem_8(uint64_t* destination, uint64_t value, int64_t count)
     {
-    return a < minimum ? minimum : a > maximum ? maximum : a;
+    while (count--)
+      *destination++ = value;
     }
 
   uint32_t get_power_2(uint32_t val)
@@ -183,23 +187,11 @@ namespace
 
   uint32_t positive_modulo(int32_t value, uint32_t m)
     {
-    int32_t mod = value % m;
+    // value % m would convert a negative value to unsigned, which only wraps correctly for powers of 2
+    int32_t mod = value % (int32_t)m;
     return mod < 0 ? mod + m : mod;
     }
 
-  int32_t filterbump(uint16_t* s, int32_t pos, int32_t mod, int32_t step)
-    {
-    return s[positive_modulo(pos - step - step, mod)] * 1
-      + s[positive_modulo(pos - step, mod)] * 3
-      - s[positive_modulo(pos, mod)] * 3
-      - s[positive_modulo(pos + step, mod)] * 1;
-    }
-
-  int32_t filterbumpsharp(uint16_t* s, int32_t pos, int32_t mod, int32_t step)
-    {
-    return 4 * (s[positive_modulo(pos - step, mod)] - s[positive_modulo(pos, mod)]);
-    }
-
   enum e_merge_mode
     {
     MERGEMODE_ADD,
@@ -207,176 +199,527 @@ namespace
     MERGEMODE_MUL,
     MERGEMODE_MIN,
     MERGEMODE_MAX,
+    MERGEMODE_ADD_SATURATE,
+    MERGEMODE_SUB_SATURATE,
     MERGEMODE_COLOR_MODES,
     MERGEMODE_COLOR_MUL,
     MERGEMODE_COLOR_ADD,
     MERGEMODE_COLOR_SUB,
     MERGEMODE_COLOR_GRAY,
-    MERGEMODE_COLOR_INVERT
+    MERGEMODE_COLOR_INVERT,
+    MERGEMODE_COLOR_ADD_SATURATE,
+    MERGEMODE_COLOR_SUB_SATURATE,
+    MERGEMODE_COUNT
     };
 
-  void image_inner(uint64_t* d, uint64_t* s, int32_t count, int32_t mode)
+  // Every mode combines the 16 bit channels of d and s one by one. The color modes combine all of d with the single element *s.
+  template <int32_t mode>
+  constexpr bool is_color_merge_mode()
+    {
+    return mode > MERGEMODE_COLOR_MODES;
+    }
+
+  template <int32_t mode>
+  inline uint16_t image_inner_channel(uint16_t d, uint16_t s)
+    {
+    if constexpr (mode == MERGEMODE_ADD || mode == MERGEMODE_COLOR_ADD)
+      return (uint16_t)(d + s);
+    else if constexpr (mode == MERGEMODE_SUB || mode == MERGEMODE_COLOR_SUB)
+      return (uint16_t)(d - s);
+    else if constexpr (mode == MERGEMODE_MUL || mode == MERGEMODE_COLOR_MUL)
+      return (uint16_t)(((uint32_t)d * (uint32_t)s) >> 15);
+    else if constexpr (mode == MERGEMODE_MIN)
+      return s < d ? s : d;
+    else if constexpr (mode == MERGEMODE_MAX)
+      return s > d ? s : d;
+    else if constexpr (mode == MERGEMODE_ADD_SATURATE || mode == MERGEMODE_COLOR_ADD_SATURATE)
+      return (uint16_t)std::min<uint32_t>((uint32_t)d + (uint32_t)s, 0x7fff);
+    else if constexpr (mode == MERGEMODE_SUB_SATURATE || mode == MERGEMODE_COLOR_SUB_SATURATE)
+      return d > s ? (uint16_t)(d - s) : 0;
+    else if constexpr (mode == MERGEMODE_COLOR_INVERT)
+      return d ^ 0x7fff;
+    else
+      return s;
+    }
+
+  typedef void(*image_inner_function)(uint64_t* d, const uint64_t* s, int64_t count);
+
+  template <int32_t mode>
+  void image_inner_scalar(uint64_t* d, const uint64_t* s, int64_t count)
+    {
+    uint16_t* d16 = (uint16_t*)d;
+    const uint16_t* s16 = (const uint16_t*)s;
+    for (int64_t i = 0; i < count * 4; ++i)
+      d16[i] = image_inner_channel<mode>(d16[i], s16[is_color_merge_mode<mode>() ? (i & 3) : i]);
+    }
+
+#ifdef HEIGHTMAP_X86
+  template <int32_t mode>
+  HEIGHTMAP_TARGET_SSE41 inline __m128i image_inner_channels_sse41(__m128i d, __m128i s)
+    {
+    if constexpr (mode == MERGEMODE_ADD || mode == MERGEMODE_COLOR_ADD)
+      return _mm_add_epi16(d, s);
+    else if constexpr (mode == MERGEMODE_SUB || mode == MERGEMODE_COLOR_SUB)
+      return _mm_sub_epi16(d, s);
+    else if constexpr (mode == MERGEMODE_MUL || mode == MERGEMODE_COLOR_MUL)
+      return _mm_or_si128(_mm_slli_epi16(_mm_mulhi_epu16(d, s), 1), _mm_srli_epi16(_mm_mullo_epi16(d, s), 15));
+    else if constexpr (mode == MERGEMODE_MIN)
+      return _mm_min_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_MAX)
+      return _mm_max_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_ADD_SATURATE || mode == MERGEMODE_COLOR_ADD_SATURATE)
+      return _mm_min_epu16(_mm_adds_epu16(d, s), _mm_set1_epi16(0x7fff));
+    else if constexpr (mode == MERGEMODE_SUB_SATURATE || mode == MERGEMODE_COLOR_SUB_SATURATE)
+      return _mm_subs_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_COLOR_INVERT)
+      return _mm_xor_si128(d, _mm_set1_epi16(0x7fff));
+    else
+      return s;
+    }
+
+  template <int32_t mode>
+  HEIGHTMAP_TARGET_SSE41 void image_inner_sse41(uint64_t* d, const uint64_t* s, int64_t count)
     {
-    for (uint32_t i = 0; i < count; ++i)
+    const __m128i color = _mm_set1_epi64x((long long)*s);
+    int64_t i = 0;
+    for (; i + 2 <= count; i += 2)
       {
-      switch (mode)
-        {
-        case MERGEMODE_ADD:
+      const __m128i vs = is_color_merge_mode<mode>() ? color : _mm_loadu_si128((const __m128i*)(s + i));
+      _mm_storeu_si128((__m128i*)(d + i), image_inner_channels_sse41<mode>(_mm_loadu_si128((const __m128i*)(d + i)), vs));
+      }
+    image_inner_scalar<mode>(d + i, is_color_merge_mode<mode>() ? s : s + i, count - i);
+    }
+
+  template <int32_t mode>
+  HEIGHTMAP_TARGET_AVX2 inline __m256i image_inner_channels_avx2(__m256i d, __m256i s)
+    {
+    if constexpr (mode == MERGEMODE_ADD || mode == MERGEMODE_COLOR_ADD)
+      return _mm256_add_epi16(d, s);
+    else if constexpr (mode == MERGEMODE_SUB || mode == MERGEMODE_COLOR_SUB)
+      return _mm256_sub_epi16(d, s);
+    else if constexpr (mode == MERGEMODE_MUL || mode == MERGEMODE_COLOR_MUL)
+      return _mm256_or_si256(_mm256_slli_epi16(_mm256_mulhi_epu16(d, s), 1), _mm256_srli_epi16(_mm256_mullo_epi16(d, s), 15));
+    else if constexpr (mode == MERGEMODE_MIN)
+      return _mm256_min_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_MAX)
+      return _mm256_max_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_ADD_SATURATE || mode == MERGEMODE_COLOR_ADD_SATURATE)
+      return _mm256_min_epu16(_mm256_adds_epu16(d, s), _mm256_set1_epi16(0x7fff));
+    else if constexpr (mode == MERGEMODE_SUB_SATURATE || mode == MERGEMODE_COLOR_SUB_SATURATE)
+      return _mm256_subs_epu16(d, s);
+    else if constexpr (mode == MERGEMODE_COLOR_INVERT)
+      return _mm256_xor_si256(d, _mm256_set1_epi16(0x7fff));
+    else
+      return s;
+    }
+
+  template <int32_t mode>
+  HEIGHTMAP_TARGET_AVX2 void image_inner_avx2(uint64_t* d, const uint64_t* s, int64_t count)
+    {
+    const __m256i color = _mm256_set1_epi64x((long long)*s);
+    int64_t i = 0;
+    for (; i + 4 <= count; i += 4)
+      {
+      const __m256i vs = is_color_merge_mode<mode>() ? color : _mm256_loadu_si256((const __m256i*)(s + i));
+      _mm256_storeu_si256((__m256i*)(d + i), image_inner_channels_avx2<mode>(_mm256_loadu_si256((const __m256i*)(d + i)), vs));
+      }
+    image_inner_scalar<mode>(d + i, is_color_merge_mode<mode>() ? s : s + i, count - i);
+    }
+#endif
+
+  image_inner_function get_image_inner_function(int32_t mode, simd_level level)
+    {
+#define HEIGHTMAP_INNER_TABLE(kernel) { &kernel<0>, &kernel<1>, &kernel<2>, &kernel<3>, &kernel<4>, &kernel<5>, &kernel<6>, &kernel<7>, \
+      &kernel<8>, &kernel<9>, &kernel<10>, &kernel<11>, &kernel<12>, &kernel<13>, &kernel<14> }
+    static const image_inner_function scalar[MERGEMODE_COUNT] = HEIGHTMAP_INNER_TABLE(image_inner_scalar);
+#ifdef HEIGHTMAP_X86
+    static const image_inner_function sse41[MERGEMODE_COUNT] = HEIGHTMAP_INNER_TABLE(image_inner_sse41);
+    static const image_inner_function avx2[MERGEMODE_COUNT] = HEIGHTMAP_INNER_TABLE(image_inner_avx2);
+    switch (level)
+      {
+      case simd_level::avx2: return avx2[mode];
+      case simd_level::sse41: return sse41[mode];
+      default: break;
+      }
+#endif
+#undef HEIGHTMAP_INNER_TABLE
+    return scalar[mode];
+    }
+
+  // Combines the count elements of d with s following mode. The kernel for the mode is picked once, not per element.
+  void image_inner(uint64_t* d, const uint64_t* s, int64_t count, int32_t mode)
+    {
+    if (mode < 0 || mode >= MERGEMODE_COUNT || mode == MERGEMODE_COLOR_MODES)
+      {
+      memcpy(d, s, sizeof(uint64_t) * (size_t)count);
+      return;
+      }
+    if (mode == MERGEMODE_COLOR_GRAY)
+      {
+      // note that this uses logical ands, so every channel of the color only counts as 0 or 1
+      uint64_t blue = (*s >> 32) && 0xffff;
+      uint64_t green = (*s >> 16) && 0xffff;
+      uint64_t red = (*s) && 0xffff;
+      uint64_t gray = (blue + green + red) / 3;
+      std::fill(d, d + count, 0xffff000000000000 | (gray << 32) | (gray << 16) | gray);
+      return;
+      }
+    get_image_inner_function(mode, get_simd_level())(d, s, count);
+    }
+
+  void image_inner_float(float* d, const float* s, int64_t count, image_merge_mode mode)
+    {
+    switch (mode)
+      {
+      case image_merge_mode::add: for (int64_t i = 0; i < count; ++i) d[i] += s[i]; break;
+      case image_merge_mode::sub: for (int64_t i = 0; i < count; ++i) d[i] -= s[i]; break;
+      case image_merge_mode::mul: for (int64_t i = 0; i < count; ++i) d[i] *= s[i]; break;
+      case image_merge_mode::min: for (int64_t i = 0; i < count; ++i) d[i] = std::min(d[i], s[i]); break;
+      case image_merge_mode::max: for (int64_t i = 0; i < count; ++i) d[i] = std::max(d[i], s[i]); break;
+      case image_merge_mode::add_saturate: for (int64_t i = 0; i < count; ++i) d[i] = std::min(d[i] + s[i], 1.f); break;
+      case image_merge_mode::sub_saturate: for (int64_t i = 0; i < count; ++i) d[i] = std::max(d[i] - s[i], 0.f); break;
+      }
+    }
+
+  void image_color_float(float* d, int64_t count, image_color_mode mode, float c)
+    {
+    switch (mode)
+      {
+      case image_color_mode::mul: for (int64_t i = 0; i < count; ++i) d[i] *= c; break;
+      case image_color_mode::add: for (int64_t i = 0; i < count; ++i) d[i] += c; break;
+      case image_color_mode::sub: for (int64_t i = 0; i < count; ++i) d[i] -= c; break;
+      case image_color_mode::gray: break;
+      case image_color_mode::invert: for (int64_t i = 0; i < count; ++i) d[i] = 1.f - d[i]; break;
+      case image_color_mode::add_saturate: for (int64_t i = 0; i < count; ++i) d[i] = std::min(d[i] + c, 1.f); break;
+      case image_color_mode::sub_saturate: for (int64_t i = 0; i < count; ++i) d[i] = std::max(d[i] - c, 0.f); break;
+      }
+    }
+
+  // The color of a color operation as a full uint64_t for image_inner: the 4 channels for rgba16, 4 times the red channel for gray16
+  uint64_t color_word(uint32_t color, image_format format)
+    {
+    uint64_t color64 = get_color_64(color);
+    if (format == image_format::gray16)
+      {
+      uint64_t red = color64 & 0xffff;
+      return red | (red << 16) | (red << 32) | (red << 48);
+      }
+    return color64;
+    }
+
+  // Calls f(d, s, words) for every row of the views dest and src (src may be null), with the pixels of the row as the whole
+  // uint64_t's that the 64 bit kernels expect. Rows that do not start and end on a whole uint64_t, which happens for gray16,
+  // go through a scratch copy so that the pixels next to the view are not touched.
+  template <class F>
+  void for_each_view_row(const image_view& dest, const image_view* src, F f)
+    {
+    const size_t row_bytes = (size_t)dest.width() * get_bytes_per_pixel(dest.format());
+    const int32_t words = (int32_t)((row_bytes + 7) / 8);
+    std::vector<uint64_t> dest_scratch, src_scratch;
+    for (int32_t y = 0; y < dest.height(); ++y)
+      {
+      uint8_t* d = dest.row(y);
+      const uint8_t* s = src ? src->row(y) : nullptr;
+      if (row_bytes % 8 == 0 && ((uintptr_t)d & 7) == 0 && ((uintptr_t)s & 7) == 0)
         {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        ++d;
-        ++s;
-        break;
+        f((uint64_t*)d, (const uint64_t*)s, words);
+        continue;
         }
-        case MERGEMODE_SUB:
+      dest_scratch.resize(words);
+      memcpy(dest_scratch.data(), d, row_bytes);
+      if (s)
         {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        ++d;
-        ++s;
-        break;
-        }
-        case MERGEMODE_MUL:
-        {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        uint32_t res;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        ++d;
-        ++s;
-        break;
+        src_scratch.resize(words);
+        memcpy(src_scratch.data(), s, row_bytes);
         }
-        case MERGEMODE_MIN:
-        {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16 = *s16 < *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 < *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 < *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 < *d16 ? *s16 : *d16;        
-        ++d;
-        ++s;
-        break;
+      f(dest_scratch.data(), s ? src_scratch.data() : nullptr, words);
+      memcpy(d, dest_scratch.data(), row_bytes);
+      }
+    }
+
+  // Splits the rows [0, height) into contiguous bands and calls f(y0, y1) for each band on its own thread.
+  template <class F>
+  void parallel_for_rows(int32_t height, int32_t nr_of_threads, F f)
+    {
+    if (nr_of_threads > height)
+      nr_of_threads = height;
+    if (nr_of_threads <= 1)
+      {
+      f(0, height);
+      return;
+      }
+    std::vector<std::thread> threads;
+    threads.reserve(nr_of_threads - 1);
+    for (int32_t t = 1; t < nr_of_threads; ++t)
+      {
+      int32_t y0 = (int32_t)((int64_t)height * t / nr_of_threads);
+      int32_t y1 = (int32_t)((int64_t)height * (t + 1) / nr_of_threads);
+      threads.emplace_back(f, y0, y1);
+      }
+    f(0, (int32_t)((int64_t)height / nr_of_threads));
+    for (auto& t : threads)
+      t.join();
+    }
+
+  // Pixels per tile for the functions that stream over several images at once.
+  // A multiple of 4 so that gray16 tiles start on whole uint64_t's, and small enough to stay in the L1/L2 cache.
+  const int32_t tile_pixels = 4096;
+
+  } // namespace
+
+perlin_context::perlin_context(uint32_t table_seed) : perlin_context(table_seed, 8)
+  {
+  }
+
+perlin_context::perlin_context(uint32_t table_seed, int32_t period_bits) : _table_seed(table_seed), _period_bits(clamp(period_bits, 8, max_period_bits)), _random_seed(0x74382381)
+  {
+  set_random_seed(_random_seed, table_seed);
+
+  for (int i = 0; i < 256; ++i)
+    {
+    _gradients[i][0] = get_random(_random_seed, 0x10000);
+    _permute[i] = i;
+    }
+
+  for (int i = 0; i < 255; ++i)
+    {
+    for (int j = i + 1; j < 256; ++j)
+      {
+      if (_gradients[i][0] > _gradients[j][0])
+        {
+        std::swap(_gradients[i][0], _gradients[j][0]);
+        std::swap(_permute[i], _permute[j]);
         }
-        case MERGEMODE_MAX:
-        {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16 = *s16 > *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 > *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 > *d16 ? *s16 : *d16;
-        ++d16; ++s16;
-        *d16 = *s16 > *d16 ? *s16 : *d16;
-        ++d;
-        ++s;
-        break;
+      }
+    }
+
+  memcpy(_permute + 256, _permute, 256);
+
+  for (int i = 0; i < 256;)
+    {
+    int32_t x = get_random(_random_seed, 0x10000) - 0x8000;
+    int32_t y = get_random(_random_seed, 0x10000) - 0x8000;
+    if (x * x + y * y < 0x8000 * 0x8000)
+      {
+      _gradients[i][0] = x / 32768.0f;
+      _gradients[i][1] = y / 32768.0f;
+      ++i;
+      }
+    }
+  }
+
+const perlin_context& default_perlin_context()
+  {
+  static const perlin_context context(1);
+  return context;
+  }
+
+int32_t get_bytes_per_pixel(image_format f)
+  {
+  switch (f)
+    {
+    case image_format::rgba16: return 8;
+    case image_format::gray16: return 2;
+    case image_format::gray32f: return 4;
+    }
+  return 8;
+  }
+
+namespace
+  {
+  // Unused image buffers, kept for reuse by the next image of about the same size.
+  class buffer_pool
+    {
+    public:
+      static const size_t alignment = 64;
+
+      buffer_pool() : _cached(0), _limit((size_t)1 << 31)
+        {
         }
-        case MERGEMODE_COLOR_ADD:
+
+      // Buffers are handed out in size classes, 8 per power of 2, so that maps of almost the same size share buffers.
+      static size_t size_class(size_t bytes)
         {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        *d16++ += *s16++;
-        ++d;
-        break;
+        bytes = (bytes + alignment - 1) & ~(alignment - 1);
+        size_t p = alignment;
+        while (p * 2 <= bytes)
+          p *= 2;
+        const size_t step = p >= 8 * alignment ? p / 8 : alignment;
+        return (bytes + step - 1) / step * step;
         }
-        case MERGEMODE_COLOR_SUB:
+
+      void* allocate(size_t capacity)
         {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        *d16++ -= *s16++;
-        ++d;
-        break;
+          {
+          std::lock_guard<std::mutex> lock(_mutex);
+          for (auto it = _free.rbegin(); it != _free.rend(); ++it)
+            {
+            if (it->first == capacity)
+              {
+              void* p = it->second;
+              _free.erase(std::next(it).base());
+              _cached -= capacity;
+              return p;
+              }
+            }
+          }
+        return ::operator new(capacity, std::align_val_t(alignment));
         }
-        case MERGEMODE_COLOR_MUL:
-        {
-        uint16_t* d16 = (uint16_t*)d;
-        uint16_t* s16 = (uint16_t*)s;
-        uint32_t res;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        res = (uint32_t)(*d16) * (uint32_t)(*s16++);
-        *d16++ = res >> 15;
-        ++d;
-        break;
+
+      void release(void* p, size_t capacity)
+        {
+        std::vector<void*> evicted;
+          {
+          std::lock_guard<std::mutex> lock(_mutex);
+          if (capacity <= _limit)
+            {
+            evict(_limit - capacity, evicted);
+            _free.emplace_back(capacity, p);
+            _cached += capacity;
+            p = nullptr;
+            }
+          }
+        if (p)
+          evicted.push_back(p);
+        destroy(evicted);
         }
-        case MERGEMODE_COLOR_GRAY:
-        {        
-        uint64_t blue = (*s >> 32) && 0xffff;
-        uint64_t green = (*s >> 16) && 0xffff;
-        uint64_t red = (*s) && 0xffff;
-        uint64_t gray = (blue + green + red)/3;
-        *d++ = 0xffff000000000000 | (gray << 32) | (gray << 16) | gray;
-        break;
+
+      void set_limit(size_t bytes)
+        {
+        std::vector<void*> evicted;
+          {
+          std::lock_guard<std::mutex> lock(_mutex);
+          _limit = bytes;
+          evict(_limit, evicted);
+          }
+        destroy(evicted);
         }
-        case MERGEMODE_COLOR_INVERT:
+
+      void clear()
         {
-        *d ^= 0x7fff7fff7fff7fff;
-        ++d;
-        break;
+        std::vector<void*> evicted;
+          {
+          std::lock_guard<std::mutex> lock(_mutex);
+          evict(0, evicted);
+          }
+        destroy(evicted);
         }
-        default:
+
+    private:
+      // Removes the buffers that were released longest ago until at most keep bytes are cached.
+      void evict(size_t keep, std::vector<void*>& evicted)
         {
-        *d++ = *s++;
-        break;
+        size_t i = 0;
+        while (_cached > keep)
+          {
+          _cached -= _free[i].first;
+          evicted.push_back(_free[i++].second);
+          }
+        _free.erase(_free.begin(), _free.begin() + i);
         }
+
+      static void destroy(const std::vector<void*>& buffers)
+        {
+        for (void* p : buffers)
+          ::operator delete(p, std::align_val_t(alignment));
         }
+
+      std::mutex _mutex;
+      std::vector<std::pair<size_t, void*>> _free; // capacity and buffer, in the order they were released
+      size_t _cached; // bytes in _free
+      size_t _limit;
+    };
+
+  // Maps bytes of the file into memory for reading and writing, after creating or growing the file to that size.
+  void* map_file(const char* filename, size_t bytes)
+    {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename, GENERIC_READ | GENERIC_WRITE, 0, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+      return nullptr;
+    LARGE_INTEGER size;
+    size.QuadPart = (LONGLONG)bytes;
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, size.HighPart, size.LowPart, nullptr);
+    CloseHandle(file);
+    if (!mapping)
+      return nullptr;
+    void* p = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes);
+    CloseHandle(mapping); // the view keeps the mapping alive
+    return p;
+#else
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0)
+      return nullptr;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < bytes && ftruncate(fd, (off_t)bytes) != 0))
+      {
+      close(fd);
+      return nullptr;
       }
+    void* p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd); // the mapping keeps the file open
+    return p == MAP_FAILED ? nullptr : p;
+#endif
     }
 
-  } // namespace
+  void unmap_file(void* p, size_t bytes)
+    {
+#ifdef _WIN32
+    (void)bytes;
+    UnmapViewOfFile(p);
+#else
+    munmap(p, bytes);
+#endif
+    }
+
+  buffer_pool& get_buffer_pool()
+    {
+    // never destroyed, images may still be released during static destruction
+    static buffer_pool* pool = new buffer_pool();
+    return *pool;
+    }
+  }
+
+void set_image_pool_limit(size_t bytes)
+  {
+  get_buffer_pool().set_limit(bytes);
+  }
+
+void clear_image_pool()
+  {
+  get_buffer_pool().clear();
+  }
 
-image::image() : _data(nullptr), _width(0), _height(0), _size(0), _format(image_format::rgba16)
+image::image() : _data(nullptr), _width(0), _height(0), _size(0), _format(image_format::rgba16), _capacity(0), _pooled(false), _mapped_bytes(0)
   {
   }
 
 image::~image()
   {
-  if (_data)
-    delete[] _data;
-  _data = nullptr;
+  _release();
   }
 
-void image::copy(const image& other)
+void image::_release()
   {
   if (_data)
     {
-    delete[] _data;
-    _data = nullptr;
+    if (_pooled)
+      get_buffer_pool().release(_data, _capacity);
+    else if (_mapped_bytes)
+      unmap_file(_data, _mapped_bytes);
+    else
+      delete[] _data;
     }
-  init(other._width, other._height);
-  _format = other._format;
-  memcpy(_data, other._data, _size * sizeof(uint64_t));
+  _data = nullptr;
+  _capacity = 0;
+  _pooled = false;
+  _mapped_bytes = 0;
+  }
+
+void image::copy(const image& other)
+  {
+  init(other._width, other._height, other._format);
+  memcpy(_data, other._data, (size_t)_size * bytes_per_pixel());
   }
 
 std::unique_ptr<image> image::copy() const
@@ -388,160 +731,1263 @@ std::unique_ptr<image> image::copy() const
 
 void image::init(int32_t w, int32_t h)
   {
+  init(w, h, image_format::rgba16);
+  }
+
+void image::init(int32_t w, int32_t h, image_format f)
+  {
+  _release();
   _width = w;
   _height = h;
-  _size = w * h;
-  _data = new uint64_t[_size];
+  _size = (int64_t)w * h;
+  _format = f;
+  // round up to whole uint64_t's, so 16 bit kernels can always process 4 pixels at a time
+  _capacity = buffer_pool::size_class(((size_t)_size * bytes_per_pixel() + 7) / 8 * 8);
+  _data = (uint64_t*)get_buffer_pool().allocate(_capacity);
+  _pooled = true;
   }
 
 void image::init(int32_t w, int32_t h, uint64_t* data)
   {
+  _release();
   _width = w;
   _height = h;
-  _size = w * h;
+  _size = (int64_t)w * h;
   _data = data;
   }
 
-void image::set_format(image_format f)
+bool image::init_mapped(const char* filename, int32_t w, int32_t h, image_format f)
   {
+  _release();
+  // whole uint64_t's, like the buffers in memory
+  const size_t bytes = ((size_t)w * h * get_bytes_per_pixel(f) + 7) / 8 * 8;
+  void* p = map_file(filename, bytes);
+  if (!p)
+    return false;
+  _width = w;
+  _height = h;
+  _size = (int64_t)w * h;
   _format = f;
+  _data = (uint64_t*)p;
+  _mapped_bytes = bytes;
+  return true;
   }
 
-
-std::unique_ptr<image> image_import(const char* filename)
+void image::advise(image_access access)
   {
-  int w, h, nr_of_channels;
-  if (!filename)
-    return nullptr;
-  unsigned char* im = stbi_load(filename, &w, &h, &nr_of_channels, 0);
-  if (!im)
-    return nullptr;
-  std::unique_ptr<image> out = std::make_unique<image>();
-  out->init(w, h);
+  advise(access, 0, _height);
+  }
 
-  for (uint32_t y = 0; y < (uint32_t)h; ++y)
+void image::advise(image_access access, int32_t y0, int32_t y1)
+  {
+  y0 = std::max(y0, 0);
+  y1 = std::min(y1, _height);
+  if (!_mapped_bytes || y0 >= y1)
+    return;
+#ifndef _WIN32
+  // madvise works on whole pages: all pages touching the rows, but for dontneed only the pages within them, so that the
+  // neighbouring rows stay in memory
+  const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  const size_t row_bytes = (size_t)_width * bytes_per_pixel();
+  size_t first = (size_t)y0 * row_bytes;
+  size_t last = y1 == _height ? _mapped_bytes : (size_t)y1 * row_bytes;
+  if (access == image_access::dontneed)
     {
-    uint64_t* p_out = out->data() + y * w;
-    const unsigned char* p_im = im + y * w * nr_of_channels;
-    for (uint32_t x = 0; x < (uint32_t)w; ++x, ++p_out, p_im += nr_of_channels)
-      {
-      uint32_t color = 0;
-      switch (nr_of_channels)
-        {
-        case 1:
-        {
-        uint32_t g = *p_im;
-        color = 0xff000000 | (g << 16) | (g << 8) | g;
-        break;
-        }
+    first = (first + page - 1) / page * page;
+    last = last == _mapped_bytes ? last : last / page * page;
+    }
+  else
+    {
+    first = first / page * page;
+    last = std::min((last + page - 1) / page * page, _mapped_bytes);
+    }
+  if (first >= last)
+    return;
+  void* p = (uint8_t*)_data + first;
+  switch (access)
+    {
+    case image_access::normal: madvise(p, last - first, MADV_NORMAL); break;
+    case image_access::sequential: madvise(p, last - first, MADV_SEQUENTIAL); break;
+    case image_access::random: madvise(p, last - first, MADV_RANDOM); break;
+    case image_access::willneed: madvise(p, last - first, MADV_WILLNEED); break;
+    case image_access::dontneed: madvise(p, last - first, MADV_DONTNEED); break;
+    }
+#else
+  (void)access;
+#endif
+  }
+
+std::unique_ptr<image> image_mapped(const char* filename, int32_t w, int32_t h, image_format format)
+  {
+  std::unique_ptr<image> im = std::make_unique<image>();
+  if (!im->init_mapped(filename, w, h, format))
+    return nullptr;
+  return im;
+  }
+
+void image::set_format(image_format f)
+  {
+  _format = f;
+  }
+
+image_view::image_view() : _data(nullptr), _width(0), _height(0), _stride(0), _x0(0), _y0(0), _image_width(0), _image_height(0), _format(image_format::rgba16)
+  {
+  }
+
+image_view::image_view(const std::unique_ptr<image>& im) : image_view(im, 0, 0, im->width(), im->height())
+  {
+  }
+
+image_view::image_view(const std::unique_ptr<image>& im, int32_t x0, int32_t y0, int32_t w, int32_t h)
+  {
+  const int32_t x1 = std::min(im->width(), x0 + w);
+  const int32_t y1 = std::min(im->height(), y0 + h);
+  _x0 = std::max(0, x0);
+  _y0 = std::max(0, y0);
+  _width = std::max(0, x1 - _x0);
+  _height = std::max(0, y1 - _y0);
+  _stride = im->width();
+  _image_width = im->width();
+  _image_height = im->height();
+  _format = im->format();
+  _data = (uint8_t*)im->data() + ((int64_t)_y0 * _stride + _x0) * get_bytes_per_pixel(_format);
+  }
+
+image_view::image_view(void* data, int32_t w, int32_t h, int32_t stride, image_format f) : _data((uint8_t*)data), _width(w), _height(h), _stride(stride),
+  _x0(0), _y0(0), _image_width(w), _image_height(h), _format(f)
+  {
+  }
+
+
+namespace
+  {
+  // Scales samples of 8 or 16 bits to 16 bits
+  inline uint32_t sample_16(uint8_t v)
+    {
+    return v * 257u;
+    }
+
+  inline uint32_t sample_16(uint16_t v)
+    {
+    return v;
+    }
+
+  const float sample_16_to_float = 1.0f / 65535.0f;
+
+  // 16 bit samples to the 15 bit values of the pipeline, or to floats in [0, 1]
+  void convert_16_to_7fff_scalar(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i)
+      d[i] = s[i] >> 1;
+    }
+
+  void convert_16_to_float_scalar(const uint16_t* s, float* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i)
+      d[i] = (float)s[i] * sample_16_to_float;
+    }
+
+  void convert_float_to_7fff_scalar(const float* s, uint16_t* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i)
+      d[i] = float_to_value_7fff(s[i]);
+    }
+
+#ifdef HEIGHTMAP_X86
+  HEIGHTMAP_TARGET_AVX2 void convert_16_to_7fff_avx2(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+    int64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      _mm256_storeu_si256((__m256i*)(d + i), _mm256_srli_epi16(_mm256_loadu_si256((const __m256i*)(s + i)), 1));
+    convert_16_to_7fff_scalar(s + i, d + i, count - i);
+    }
+
+  HEIGHTMAP_TARGET_AVX2 void convert_16_to_float_avx2(const uint16_t* s, float* d, int64_t count)
+    {
+    const __m256 scale = _mm256_set1_ps(sample_16_to_float);
+    int64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+      const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(s + i)));
+      _mm256_storeu_ps(d + i, _mm256_mul_ps(_mm256_cvtepi32_ps(v), scale));
+      }
+    convert_16_to_float_scalar(s + i, d + i, count - i);
+    }
+
+  // Bit identical to float_to_value_7fff, also for values outside [0, 1]
+  HEIGHTMAP_TARGET_AVX2 void convert_float_to_7fff_avx2(const float* s, uint16_t* d, int64_t count)
+    {
+    const __m256 scale = _mm256_set1_ps(32767.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi32(0x7fff);
+    int64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+      __m256i v0 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(s + i), scale), half));
+      __m256i v1 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(s + i + 8), scale), half));
+      v0 = _mm256_min_epi32(_mm256_max_epi32(v0, zero), max);
+      v1 = _mm256_min_epi32(_mm256_max_epi32(v1, zero), max);
+      // packus works per 128 bit lane, so the 64 bit quarters are put back in order
+      _mm256_storeu_si256((__m256i*)(d + i), _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1), 0xd8));
+      }
+    convert_float_to_7fff_scalar(s + i, d + i, count - i);
+    }
+#endif
+
+  void convert_16_to_7fff(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return convert_16_to_7fff_avx2(s, d, count);
+#endif
+    convert_16_to_7fff_scalar(s, d, count);
+    }
+
+  void convert_16_to_float(const uint16_t* s, float* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return convert_16_to_float_avx2(s, d, count);
+#endif
+    convert_16_to_float_scalar(s, d, count);
+    }
+
+  void convert_float_to_7fff(const float* s, uint16_t* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return convert_float_to_7fff_avx2(s, d, count);
+#endif
+    convert_float_to_7fff_scalar(s, d, count);
+    }
+
+  // Converts the count pixels of c interleaved samples of type T (uint8_t or uint16_t) to format.
+  // The gray formats take the first channel, one or two channels are gray (and alpha) for rgba16.
+  template <class T>
+  void import_pixels(const T* s, int32_t c, int64_t count, image_format format, void* out)
+    {
+    switch (format)
+      {
+      case image_format::rgba16:
+      {
+      uint16_t* d = (uint16_t*)out;
+      const uint32_t opaque = 0x7fff;
+      switch (c)
+        {
+        case 1:
+          for (int64_t i = 0; i < count; ++i, d += 4, ++s)
+            d[0] = d[1] = d[2] = sample_16(s[0]) >> 1, d[3] = opaque;
+          break;
+        case 2:
+          for (int64_t i = 0; i < count; ++i, d += 4, s += 2)
+            d[0] = d[1] = d[2] = sample_16(s[0]) >> 1, d[3] = sample_16(s[1]) >> 1;
+          break;
         case 3:
+          for (int64_t i = 0; i < count; ++i, d += 4, s += 3)
+            d[0] = sample_16(s[0]) >> 1, d[1] = sample_16(s[1]) >> 1, d[2] = sample_16(s[2]) >> 1, d[3] = opaque;
+          break;
+        default:
+          for (int64_t i = 0; i < count; ++i, d += 4, s += 4)
+            d[0] = sample_16(s[0]) >> 1, d[1] = sample_16(s[1]) >> 1, d[2] = sample_16(s[2]) >> 1, d[3] = sample_16(s[3]) >> 1;
+          break;
+        }
+      break;
+      }
+      case image_format::gray16:
+      {
+      uint16_t* d = (uint16_t*)out;
+      if constexpr (std::is_same<T, uint16_t>::value)
         {
-        uint32_t r = p_im[0];
-        uint32_t g = p_im[1];
-        uint32_t b = p_im[2];
-        color = 0xff000000 | (b << 16) | (g << 8) | r;
-        break;
+        if (c == 1)
+          {
+          convert_16_to_7fff(s, d, count);
+          break;
+          }
         }
-        case 4:
+      for (int64_t i = 0; i < count; ++i, s += c)
+        d[i] = sample_16(s[0]) >> 1;
+      break;
+      }
+      case image_format::gray32f:
+      {
+      float* d = (float*)out;
+      if constexpr (std::is_same<T, uint16_t>::value)
         {
-        color = *((const uint32_t*)p_im);
-        break;
+        if (c == 1)
+          {
+          convert_16_to_float(s, d, count);
+          break;
+          }
         }
+      for (int64_t i = 0; i < count; ++i, s += c)
+        d[i] = (float)sample_16(s[0]) * sample_16_to_float;
+      break;
+      }
+      }
+    }
+
+  // Converts count float heights, the first of c samples per pixel, to format. They are kept as they are for gray32f,
+  // and clamped to [0, 1] for the other formats.
+  void import_floats(const float* s, int32_t c, int64_t count, image_format format, void* out)
+    {
+    switch (format)
+      {
+      case image_format::rgba16:
+      {
+      uint16_t* d = (uint16_t*)out;
+      for (int64_t i = 0; i < count; ++i, d += 4, s += c)
+        d[0] = d[1] = d[2] = float_to_value_7fff(s[0]), d[3] = 0x7fff;
+      break;
+      }
+      case image_format::gray16:
+        if (c == 1)
+          convert_float_to_7fff(s, (uint16_t*)out, count);
+        else
+          for (int64_t i = 0; i < count; ++i, s += c)
+            ((uint16_t*)out)[i] = float_to_value_7fff(s[0]);
+        break;
+      case image_format::gray32f:
+        if (c == 1)
+          memcpy(out, s, (size_t)count * sizeof(float));
+        else
+          for (int64_t i = 0; i < count; ++i, s += c)
+            ((float*)out)[i] = s[0];
+        break;
+      }
+    }
+
+  // Reads a pfm file (Pf gray or PF color, whose first channel is taken). Returns nullptr if filename is no pfm.
+  std::unique_ptr<image> import_pfm(const char* filename, image_format format)
+    {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return nullptr;
+    char magic[3] = { 0 };
+    int w = 0, h = 0;
+    float scale = 0.f;
+    // the single whitespace character after the scale is the end of the header
+    if (fscanf(f, "%2s %d %d %f", magic, &w, &h, &scale) != 4 || magic[0] != 'P' || (magic[1] != 'f' && magic[1] != 'F') || w < 1 || h < 1 || scale == 0.f || fgetc(f) == EOF)
+      {
+      fclose(f);
+      return nullptr;
+      }
+    const int32_t c = magic[1] == 'F' ? 3 : 1;
+    const bool swap = scale > 0.f; // positive scales are big endian
+    std::unique_ptr<image> out = std::make_unique<image>();
+    out->init(w, h, format);
+    std::vector<float> row((size_t)w * c);
+    for (int32_t y = h - 1; y >= 0; --y) // the rows go from the bottom to the top
+      {
+      if (fread(row.data(), sizeof(float), row.size(), f) != row.size())
+        {
+        fclose(f);
+        return nullptr;
         }
-      *p_out = get_color_64(color);
+      if (swap)
+        for (float& v : row)
+          {
+          uint32_t u;
+          memcpy(&u, &v, 4);
+          u = (u >> 24) | ((u >> 8) & 0xff00) | ((u << 8) & 0xff0000) | (u << 24);
+          memcpy(&v, &u, 4);
+          }
+      import_floats(row.data(), c, w, format, (uint8_t*)out->data() + (int64_t)y * w * out->bytes_per_pixel());
       }
+    fclose(f);
+    return out;
     }
 
-  stbi_image_free(im);
-  return out;
+  // Reads a qoi or qoi16 file. Returns nullptr if filename is neither.
+  std::unique_ptr<image> import_qoi(const char* filename, image_format format)
+    {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return nullptr;
+    std::vector<uint8_t> data(4);
+    if (fread(data.data(), 1, 4, f) != 4 || (memcmp(data.data(), "qoif", 4) != 0 && memcmp(data.data(), "qo16", 4) != 0))
+      {
+      fclose(f);
+      return nullptr;
+      }
+    const size_t chunk = 1 << 20;
+    for (size_t n = chunk; n == chunk;)
+      {
+      const size_t size = data.size();
+      data.resize(size + chunk);
+      n = fread(data.data() + size, 1, chunk, f);
+      data.resize(size + n);
+      }
+    fclose(f);
+    qoi_decoder decoder;
+    if (!decoder.begin(data.data(), data.size()))
+      return nullptr;
+    const int32_t w = decoder.width();
+    const int32_t c = decoder.channels();
+    std::unique_ptr<image> out = std::make_unique<image>();
+    out->init(w, decoder.height(), format);
+    std::vector<uint8_t> row8(decoder.sixteen_bit() ? 0 : (size_t)w * c);
+    std::vector<uint16_t> row16(decoder.sixteen_bit() ? (size_t)w * c : 0);
+    for (int32_t y = 0; y < decoder.height(); ++y)
+      {
+      uint8_t* d = (uint8_t*)out->data() + (int64_t)y * w * out->bytes_per_pixel();
+      if (decoder.sixteen_bit())
+        {
+        if (!decoder.decode(row16.data(), w))
+          return nullptr;
+        import_pixels(row16.data(), c, w, format, d);
+        }
+      else
+        {
+        if (!decoder.decode(row8.data(), w))
+          return nullptr;
+        import_pixels(row8.data(), c, w, format, d);
+        }
+      }
+    return out;
+    }
   }
 
-bool image_export(const std::unique_ptr<image>& im, const char* filename, image_export_filetype filetype, int32_t jpeg_quality)
+namespace
   {
-  jpeg_quality = clamp(jpeg_quality, 1, 100);
-  int32_t w = im->width();
-  int32_t h = im->height();
-  int32_t c = 0;
-  uint8_t* bytes = nullptr;
-  if (im->format() == image_format::rgba16)
+  // 15 bit values to the full 16 bits, so that importing the result with a shift back gives the same values
+  void expand_7fff_to_16_scalar(const uint16_t* s, uint16_t* d, int64_t count)
     {
-    c = 4;
-    bytes = new uint8_t[w * h * c];
-    uint32_t* d = (uint32_t*)bytes;
-    const uint16_t* s = (const uint16_t*)im->data();
-    for (int y = 0; y < h; ++y)
+    for (int64_t i = 0; i < count; ++i)
+      d[i] = (uint16_t)((s[i] << 1) | (s[i] >> 14));
+    }
+
+  // The first channel of count rgba16 pixels
+  void extract_first_channel_scalar(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i, s += 4)
+      d[i] = s[0];
+    }
+
+  void convert_7fff_to_float_scalar(const uint16_t* s, float* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i)
+      d[i] = value_7fff_to_float(s[i]);
+    }
+
+  // Floats in [0, 1] to 16 bits, with rounding, so that 16 bit data that was imported as gray32f goes out unchanged
+  void convert_float_to_16_scalar(const float* s, uint16_t* d, int64_t count)
+    {
+    for (int64_t i = 0; i < count; ++i)
+      {
+      const float c = s[i] > 0.f ? (s[i] < 1.f ? s[i] : 1.f) : 0.f;
+      d[i] = (uint16_t)(int32_t)(c * 65535.0f + 0.5f);
+      }
+    }
+
+#ifdef HEIGHTMAP_X86
+  HEIGHTMAP_TARGET_AVX2 void expand_7fff_to_16_avx2(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+    int64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+      const __m256i v = _mm256_loadu_si256((const __m256i*)(s + i));
+      _mm256_storeu_si256((__m256i*)(d + i), _mm256_or_si256(_mm256_slli_epi16(v, 1), _mm256_srli_epi16(v, 14)));
+      }
+    expand_7fff_to_16_scalar(s + i, d + i, count - i);
+    }
+
+  HEIGHTMAP_TARGET_AVX2 void extract_first_channel_avx2(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+    // the first channels of the 2 pixels of each 128 bit lane go to the first 32 bits of the lane, and then next to each other
+    const __m256i shuffle = _mm256_setr_epi8(0, 1, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      0, 1, 8, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+    const __m256i gather = _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0);
+    int64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+      const __m256i a = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + 4 * i)), shuffle), gather);
+      const __m256i b = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)(s + 4 * i + 16)), shuffle), gather);
+      _mm_storeu_si128((__m128i*)(d + i), _mm_unpacklo_epi64(_mm256_castsi256_si128(a), _mm256_castsi256_si128(b)));
+      }
+    extract_first_channel_scalar(s + 4 * i, d + i, count - i);
+    }
+
+  HEIGHTMAP_TARGET_AVX2 void convert_7fff_to_float_avx2(const uint16_t* s, float* d, int64_t count)
+    {
+    const __m256 max = _mm256_set1_ps(32767.0f);
+    int64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+      {
+      const __m256i v = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(s + i)));
+      _mm256_storeu_ps(d + i, _mm256_div_ps(_mm256_cvtepi32_ps(v), max));
+      }
+    convert_7fff_to_float_scalar(s + i, d + i, count - i);
+    }
+
+  HEIGHTMAP_TARGET_AVX2 void convert_float_to_16_avx2(const float* s, uint16_t* d, int64_t count)
+    {
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 one = _mm256_set1_ps(1.0f);
+    const __m256 scale = _mm256_set1_ps(65535.0f);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    int64_t i = 0;
+    for (; i + 16 <= count; i += 16)
+      {
+      // max_ps returns its second operand for nan, like the comparisons of the scalar version
+      const __m256 c0 = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(s + i), zero), one);
+      const __m256 c1 = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(s + i + 8), zero), one);
+      const __m256i v0 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(c0, scale), half));
+      const __m256i v1 = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(c1, scale), half));
+      _mm256_storeu_si256((__m256i*)(d + i), _mm256_permute4x64_epi64(_mm256_packus_epi32(v0, v1), 0xd8));
+      }
+    convert_float_to_16_scalar(s + i, d + i, count - i);
+    }
+#endif
+
+  void expand_7fff_to_16(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return expand_7fff_to_16_avx2(s, d, count);
+#endif
+    expand_7fff_to_16_scalar(s, d, count);
+    }
+
+  void extract_first_channel(const uint16_t* s, uint16_t* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return extract_first_channel_avx2(s, d, count);
+#endif
+    extract_first_channel_scalar(s, d, count);
+    }
+
+  void convert_7fff_to_float(const uint16_t* s, float* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return convert_7fff_to_float_avx2(s, d, count);
+#endif
+    convert_7fff_to_float_scalar(s, d, count);
+    }
+
+  void convert_float_to_16(const float* s, uint16_t* d, int64_t count)
+    {
+#ifdef HEIGHTMAP_X86
+    if (get_simd_level() >= simd_level::avx2)
+      return convert_float_to_16_avx2(s, d, count);
+#endif
+    convert_float_to_16_scalar(s, d, count);
+    }
+
+  // The heights, the first channel, of the pixels [p0, p0 + count) of im as 16 bit samples
+  void export_heights_16(const image& im, int64_t p0, int64_t count, uint16_t* d)
+    {
+    switch (im.format())
+      {
+      case image_format::rgba16:
+        extract_first_channel((const uint16_t*)im.data() + 4 * p0, d, count);
+        expand_7fff_to_16(d, d, count);
+        break;
+      case image_format::gray16:
+        expand_7fff_to_16((const uint16_t*)im.data() + p0, d, count);
+        break;
+      case image_format::gray32f:
+        convert_float_to_16((const float*)im.data() + p0, d, count);
+        break;
+      }
+    }
+
+  // The heights of the pixels [p0, p0 + count) of im as floats. scratch holds count uint16_t's.
+  void export_heights_float(const image& im, int64_t p0, int64_t count, float* d, uint16_t* scratch)
+    {
+    switch (im.format())
+      {
+      case image_format::rgba16:
+        extract_first_channel((const uint16_t*)im.data() + 4 * p0, scratch, count);
+        convert_7fff_to_float(scratch, d, count);
+        break;
+      case image_format::gray16:
+        convert_7fff_to_float((const uint16_t*)im.data() + p0, d, count);
+        break;
+      case image_format::gray32f:
+        memcpy(d, (const float*)im.data() + p0, (size_t)count * sizeof(float));
+        break;
+      }
+    }
+
+  // Pixels per chunk of the raw writers, small enough to stay in the cache between conversion and writing
+  const int64_t export_chunk_pixels = 1 << 16;
+
+  // Sets the progress of an export, if it is followed
+  inline void report_rows(std::atomic<int32_t>* rows, int32_t done)
+    {
+    if (rows)
+      rows->store(done, std::memory_order_relaxed);
+    }
+
+  bool export_raw(const image& im, const char* filename, image_raw_format raw, std::atomic<int32_t>* rows)
+    {
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    bool ok = true;
+    const int64_t count = im.size();
+    const bool direct = raw == image_raw_format::r32f && im.format() == image_format::gray32f; // straight from the image
+    std::vector<uint16_t> samples(direct ? 0 : (size_t)export_chunk_pixels);
+    std::vector<float> floats(raw == image_raw_format::r32f && !direct ? (size_t)export_chunk_pixels : 0);
+    for (int64_t p0 = 0; ok && p0 < count; p0 += export_chunk_pixels)
       {
-      for (int x = 0; x < w; ++x, ++d, s += 4)
+      const int64_t n = std::min(export_chunk_pixels, count - p0);
+      if (direct)
+        ok = fwrite((const float*)im.data() + p0, sizeof(float), (size_t)n, f) == (size_t)n;
+      else if (raw == image_raw_format::r16)
         {
-        *d = (((s[0] >> 7) & 0xff)) |
-          (((s[1] >> 7) & 0xff) << 8) |
-          (((s[2] >> 7) & 0xff) << 16) |
-          (((s[3] >> 7) & 0xff) << 24);
+        export_heights_16(im, p0, n, samples.data());
+        ok = fwrite(samples.data(), sizeof(uint16_t), (size_t)n, f) == (size_t)n;
+        }
+      else
+        {
+        export_heights_float(im, p0, n, floats.data(), samples.data());
+        ok = fwrite(floats.data(), sizeof(float), (size_t)n, f) == (size_t)n;
         }
+      report_rows(rows, (int32_t)((p0 + n) / im.width()));
       }
+    return fclose(f) == 0 && ok;
     }
 
-  int res = 0;
+  // Little endian gray pfm, whose rows go from the bottom to the top
+  bool export_pfm(const image& im, const char* filename, std::atomic<int32_t>* rows)
+    {
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    const int32_t w = im.width();
+    bool ok = fprintf(f, "Pf\n%d %d\n-1.0\n", w, im.height()) > 0;
+    std::vector<float> row(im.format() == image_format::gray32f ? 0 : (size_t)w);
+    std::vector<uint16_t> scratch(row.size());
+    for (int32_t y = im.height() - 1; ok && y >= 0; --y)
+      {
+      const int64_t p0 = (int64_t)y * w;
+      const float* r = (const float*)im.data() + p0;
+      if (im.format() != image_format::gray32f)
+        {
+        export_heights_float(im, p0, w, row.data(), scratch.data());
+        r = row.data();
+        }
+      ok = fwrite(r, sizeof(float), (size_t)w, f) == (size_t)w;
+      report_rows(rows, im.height() - y);
+      }
+    return fclose(f) == 0 && ok;
+    }
+
+  bool write_png_chunk(FILE* f, const char* type, const uint8_t* data, size_t size)
+    {
+    const uint8_t header[8] = { (uint8_t)(size >> 24), (uint8_t)(size >> 16), (uint8_t)(size >> 8), (uint8_t)size, (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2], (uint8_t)type[3] };
+    const uint32_t crc = crc32_update(crc32_update(0, header + 4, 4), data, size);
+    const uint8_t footer[4] = { (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8), (uint8_t)crc };
+    return fwrite(header, 1, 8, f) == 8 && (size == 0 || fwrite(data, 1, size, f) == size) && fwrite(footer, 1, 4, f) == 4;
+    }
+
+  inline uint8_t png_paeth(int32_t a, int32_t b, int32_t c)
+    {
+    const int32_t p = a + b - c;
+    const int32_t pa = std::abs(p - a);
+    const int32_t pb = std::abs(p - b);
+    const int32_t pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+      return (uint8_t)a;
+    return (uint8_t)(pb <= pc ? b : c);
+    }
+
+  // Filters the bytes of row with the png filter type, prev being the previous row (zeros for the first row), bpp the bytes per pixel
+  void png_filter_row(const uint8_t* row, const uint8_t* prev, int64_t size, int32_t bpp, int32_t type, uint8_t* out)
+    {
+    switch (type)
+      {
+      case 0:
+        memcpy(out, row, (size_t)size);
+        break;
+      case 1:
+        memcpy(out, row, (size_t)bpp);
+        for (int64_t i = bpp; i < size; ++i)
+          out[i] = (uint8_t)(row[i] - row[i - bpp]);
+        break;
+      case 2:
+        for (int64_t i = 0; i < size; ++i)
+          out[i] = (uint8_t)(row[i] - prev[i]);
+        break;
+      case 3:
+        for (int64_t i = 0; i < bpp; ++i)
+          out[i] = (uint8_t)(row[i] - (prev[i] >> 1));
+        for (int64_t i = bpp; i < size; ++i)
+          out[i] = (uint8_t)(row[i] - ((row[i - bpp] + prev[i]) >> 1));
+        break;
+      default:
+        for (int64_t i = 0; i < bpp; ++i)
+          out[i] = (uint8_t)(row[i] - prev[i]); // paeth of (0, b, 0) is b
+        for (int64_t i = bpp; i < size; ++i)
+          out[i] = (uint8_t)(row[i] - png_paeth(row[i - bpp], prev[i], prev[i - bpp]));
+        break;
+      }
+    }
+
+  // Streams a png of w x h pixels whose rows come from make_row(y, row), in png byte order, which is called from several
+  // threads at once. The rows are converted and filtered in strips on other threads while the previous strips are deflated
+  // and written, so memory does not grow with the size of the image. Every row gets the filter with the smallest sum of
+  // absolute differences, the usual heuristic.
+  // With more than one thread the strips are deflated in parallel like pigz does: each strip is a deflate stream of its own,
+  // primed with the last 32 kB of the strip before it and ended with a sync flush, so that the strips concatenate to one
+  // zlib stream that any png reader takes. The adler32 checksums of the strips are combined.
+  // level is the compression level of deflate_stream.
+  template <class F>
+  bool write_png(const char* filename, int32_t w, int32_t h, int32_t bit_depth, int32_t channels, int32_t level, int32_t nr_of_threads, std::atomic<int32_t>* rows, F make_row)
+    {
+    const int32_t bpp = channels * bit_depth / 8;
+    const int64_t row_bytes = (int64_t)w * bpp;
+    nr_of_threads = std::max(1, nr_of_threads);
+    // smaller strips with more threads so that smaller images are split as well, but not below the 128 kB blocks of pigz
+    const int64_t strip_bytes = std::max<int64_t>(1 << 17, (1 << 20) / nr_of_threads);
+    const int32_t strip_rows = (int32_t)std::min<int64_t>(h, std::max<int64_t>(1, strip_bytes / (row_bytes + 1)));
+    const int32_t group_rows = (int32_t)std::min<int64_t>(h, (int64_t)strip_rows * nr_of_threads);
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    const uint8_t color_types[5] = { 0, 0, 4, 2, 6 };
+    const uint8_t signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+    const uint8_t ihdr[13] = { (uint8_t)(w >> 24), (uint8_t)(w >> 16), (uint8_t)(w >> 8), (uint8_t)w, (uint8_t)(h >> 24), (uint8_t)(h >> 16), (uint8_t)(h >> 8), (uint8_t)h,
+      (uint8_t)bit_depth, color_types[channels], 0, 0, 0 };
+    bool ok = fwrite(signature, 1, 8, f) == 8 && write_png_chunk(f, "IHDR", ihdr, 13);
+
+    auto filter_strip = [&](int32_t y0, std::vector<uint8_t>& strip)
+      {
+      const int32_t y1 = std::min(h, y0 + strip_rows);
+      std::vector<uint8_t> row((size_t)row_bytes), prev((size_t)row_bytes, 0), candidate((size_t)row_bytes);
+      if (y0 > 0)
+        make_row(y0 - 1, prev.data());
+      strip.resize((size_t)((y1 - y0) * (row_bytes + 1)));
+      for (int32_t y = y0; y < y1; ++y)
+        {
+        make_row(y, row.data());
+        uint8_t* out = strip.data() + (size_t)(y - y0) * (row_bytes + 1);
+        int64_t best_cost = -1;
+        for (int32_t type = 0; type < 5; ++type)
+          {
+          png_filter_row(row.data(), prev.data(), row_bytes, bpp, type, candidate.data());
+          int64_t cost = 0;
+          for (int64_t i = 0; i < row_bytes; ++i)
+            cost += std::abs((int32_t)(int8_t)candidate[i]);
+          if (best_cost < 0 || cost < best_cost)
+            {
+            best_cost = cost;
+            out[0] = (uint8_t)type;
+            memcpy(out + 1, candidate.data(), (size_t)row_bytes);
+            }
+          }
+        std::swap(row, prev);
+        }
+      };
+    // the strips of the rows [y0, y0 + group_rows), one per thread
+    auto filter_group = [&](int32_t y0, std::vector<std::vector<uint8_t>>& strips)
+      {
+      const int32_t count = (std::min(h, y0 + group_rows) - y0 + strip_rows - 1) / strip_rows;
+      strips.resize((size_t)count);
+      parallel_for_rows(count, count, [&](int32_t s0, int32_t s1)
+        {
+        for (int32_t s = s0; s < s1; ++s)
+          filter_strip(y0 + s * strip_rows, strips[s]);
+        });
+      };
+
+    std::vector<std::vector<uint8_t>> groups[2], compressed((size_t)nr_of_threads);
+    std::vector<uint32_t> adlers((size_t)nr_of_threads);
+    std::vector<uint8_t> dictionary; // the end of the last strip of the previous group
+    uint32_t adler = 1;
+    filter_group(0, groups[0]);
+    for (int32_t y0 = 0, g = 0; y0 < h; y0 += group_rows, g ^= 1)
+      {
+      const bool last = y0 + group_rows >= h;
+      std::thread next;
+      if (!last)
+        next = std::thread(filter_group, y0 + group_rows, std::ref(groups[g ^ 1]));
+      const std::vector<std::vector<uint8_t>>& strips = groups[g];
+      const int32_t count = (int32_t)strips.size();
+      parallel_for_rows(count, count, [&](int32_t s0, int32_t s1)
+        {
+        for (int32_t s = s0; s < s1; ++s)
+          {
+          const std::vector<uint8_t>& before = s > 0 ? strips[s - 1] : dictionary;
+          const size_t primed = std::min<size_t>(before.size(), 1 << 15);
+          deflate_stream z(level);
+          z.set_dictionary(before.data() + before.size() - primed, primed);
+          compressed[s].clear();
+          z.write(strips[s].data(), strips[s].size(), compressed[s]);
+          if (last && s == count - 1)
+            z.finish(compressed[s]);
+          else
+            z.flush(compressed[s]);
+          adlers[s] = adler32_update(1, strips[s].data(), strips[s].size());
+          }
+        });
+      for (int32_t s = 0; s < count; ++s)
+        {
+        adler = adler32_combine(adler, adlers[s], strips[s].size());
+        std::vector<uint8_t>& out = compressed[s];
+        if (y0 == 0 && s == 0)
+          {
+          const uint8_t header[2] = { 0x78, (uint8_t)(level < 2 ? 0x01 : level < 6 ? 0x5e : level == 6 ? 0x9c : 0xda) };
+          out.insert(out.begin(), header, header + 2);
+          }
+        if (last && s == count - 1)
+          {
+          const uint8_t checksum[4] = { (uint8_t)(adler >> 24), (uint8_t)(adler >> 16), (uint8_t)(adler >> 8), (uint8_t)adler };
+          out.insert(out.end(), checksum, checksum + 4);
+          }
+        if (ok && !out.empty())
+          ok = write_png_chunk(f, "IDAT", out.data(), out.size());
+        }
+      const std::vector<uint8_t>& tail = strips.back();
+      dictionary.assign(tail.end() - std::min<size_t>(tail.size(), 1 << 15), tail.end());
+      report_rows(rows, std::min(h, y0 + group_rows));
+      if (next.joinable())
+        next.join();
+      }
+    ok = ok && write_png_chunk(f, "IEND", nullptr, 0);
+    return fclose(f) == 0 && ok;
+    }
 
-  switch (filetype)
+  // 16 bit png: gray for the gray formats, rgba for rgba16
+  bool export_png16(const image& im, const char* filename, int32_t level, int32_t nr_of_threads, std::atomic<int32_t>* rows)
     {
-    case image_export_filetype::png:
+    const int32_t w = im.width();
+    const int32_t channels = im.format() == image_format::rgba16 ? 4 : 1;
+    return write_png(filename, w, im.height(), 16, channels, level, nr_of_threads, rows, [&](int32_t y, uint8_t* row)
+      {
+      // the samples are made in place, the rows of write_png being allocated by std::vector
+      uint16_t* samples = (uint16_t*)row;
+      const int64_t count = (int64_t)w * channels;
+      if (channels == 4)
+        expand_7fff_to_16((const uint16_t*)im.data() + (int64_t)y * w * 4, samples, count);
+      else
+        export_heights_16(im, (int64_t)y * w, w, samples);
+      for (int64_t i = 0; i < count; ++i) // png is big endian
+        {
+        const uint16_t v = samples[i];
+        row[2 * i] = (uint8_t)(v >> 8);
+        row[2 * i + 1] = (uint8_t)v;
+        }
+      });
+    }
+
+  // The 8 bit file types are rgba for rgba16 and gray for the gray formats
+  int32_t export_channels_8(image_format format)
     {
-    res = stbi_write_png(filename, w, h, c, (void*)bytes, w * c);
-    break;
+    return format == image_format::rgba16 ? 4 : 1;
     }
-    case image_export_filetype::jpg:
+
+  void export_row_8(const image& im, int32_t y, uint8_t* d)
     {
-    res = stbi_write_jpg(filename, w, h, c, (void*)bytes, jpeg_quality);
-    break;
+    const int64_t w = im.width();
+    switch (im.format())
+      {
+      case image_format::rgba16:
+      {
+      const uint16_t* s = (const uint16_t*)im.data() + y * w * 4;
+      for (int64_t i = 0; i < w * 4; ++i)
+        d[i] = (uint8_t)((s[i] >> 7) & 0xff);
+      break;
+      }
+      case image_format::gray16:
+      {
+      const uint16_t* s = (const uint16_t*)im.data() + y * w;
+      for (int64_t x = 0; x < w; ++x)
+        d[x] = (uint8_t)((s[x] >> 7) & 0xff);
+      break;
+      }
+      case image_format::gray32f:
+      {
+      const float* s = (const float*)im.data() + y * w;
+      for (int64_t x = 0; x < w; ++x)
+        d[x] = (uint8_t)(float_to_value_7fff(s[x]) >> 7);
+      break;
+      }
+      }
     }
-    case image_export_filetype::bmp:
+
+  bool export_png(const image& im, const char* filename, int32_t level, int32_t nr_of_threads, std::atomic<int32_t>* rows)
     {
-    res = stbi_write_bmp(filename, w, h, c, (void*)bytes);
-    break;
+    return write_png(filename, im.width(), im.height(), 8, export_channels_8(im.format()), level, nr_of_threads, rows, [&](int32_t y, uint8_t* row)
+      {
+      export_row_8(im, y, row);
+      });
     }
-    case image_export_filetype::tga:
+
+  // qoi holds the 8 bit rows of export_row_8, qoi16 the 16 bit samples of png16. The rows are encoded one by one.
+  bool export_qoi(const image& im, const char* filename, bool sixteen_bit, std::atomic<int32_t>* rows)
+    {
+    const int32_t w = im.width();
+    const int32_t c = export_channels_8(im.format());
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    qoi_encoder encoder(w, im.height(), c, sixteen_bit);
+    std::vector<uint8_t> row8(sixteen_bit ? 0 : (size_t)w * c), out;
+    std::vector<uint16_t> row16(sixteen_bit ? (size_t)w * c : 0);
+    encoder.begin(out);
+    bool ok = true;
+    for (int32_t y = 0; ok && y < im.height(); ++y)
+      {
+      if (!sixteen_bit)
+        {
+        export_row_8(im, y, row8.data());
+        encoder.encode(row8.data(), w, out);
+        }
+      else
+        {
+        if (c == 4)
+          expand_7fff_to_16((const uint16_t*)im.data() + (int64_t)y * w * 4, row16.data(), (int64_t)w * 4);
+        else
+          export_heights_16(im, (int64_t)y * w, w, row16.data());
+        encoder.encode(row16.data(), w, out);
+        }
+      if (y == im.height() - 1)
+        encoder.finish(out);
+      if (out.size() >= (1 << 20) || y == im.height() - 1)
+        {
+        ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+        out.clear();
+        report_rows(rows, y + 1);
+        }
+      }
+    return fclose(f) == 0 && ok;
+    }
+
+  // Streams a tga row by row, with the top row first, run length encoded like stb_image_write does when stbi_write_tga_with_rle is set
+  bool export_tga(const image& im, const char* filename, std::atomic<int32_t>* rows)
+    {
+    const int32_t w = im.width();
+    const int32_t h = im.height();
+    if (w > 0xffff || h > 0xffff)
+      return false;
+    const int32_t c = export_channels_8(im.format());
+    const bool rle = stbi_write_tga_with_rle != 0;
+    FILE* f = fopen(filename, "wb");
+    if (!f)
+      return false;
+    const uint8_t alpha_bits = c == 4 ? 8 : 0;
+    const uint8_t header[18] = { 0, 0, (uint8_t)((c == 1 ? 3 : 2) + (rle ? 8 : 0)), 0, 0, 0, 0, 0, 0, 0, 0, 0,
+      (uint8_t)w, (uint8_t)(w >> 8), (uint8_t)h, (uint8_t)(h >> 8), (uint8_t)(c * 8), (uint8_t)(alpha_bits | 0x20) }; // 0x20: top row first
+    bool ok = fwrite(header, 1, 18, f) == 18;
+    std::vector<uint8_t> row((size_t)w * c), out;
+    out.reserve((size_t)(w * c + w + 1));
+    auto put_pixel = [&](const uint8_t* p)
+      {
+      if (c == 1)
+        out.push_back(p[0]);
+      else
+        {
+        const uint8_t bgra[4] = { p[2], p[1], p[0], p[3] };
+        out.insert(out.end(), bgra, bgra + c);
+        }
+      };
+    for (int32_t y = 0; ok && y < h; ++y)
+      {
+      export_row_8(im, y, row.data());
+      out.clear();
+      if (!rle)
+        for (int32_t x = 0; x < w; ++x)
+          put_pixel(row.data() + (size_t)x * c);
+      for (int32_t x = 0, len = 0; rle && x < w; x += len)
+        {
+        // a run of equal pixels, or else raw pixels up to the next run, at most 128 per packet
+        const uint8_t* begin = row.data() + (size_t)x * c;
+        len = 1;
+        bool run = false;
+        if (x < w - 1)
+          {
+          ++len;
+          run = memcmp(begin, begin + c, (size_t)c) == 0;
+          if (run)
+            {
+            for (int32_t k = x + 2; k < w && len < 128 && memcmp(begin, row.data() + (size_t)k * c, (size_t)c) == 0; ++k)
+              ++len;
+            }
+          else
+            {
+            const uint8_t* prev = begin + c;
+            for (int32_t k = x + 2; k < w && len < 128; ++k)
+              {
+              if (memcmp(prev, row.data() + (size_t)k * c, (size_t)c) == 0)
+                {
+                --len;
+                break;
+                }
+              prev += c;
+              ++len;
+              }
+            }
+          }
+        out.push_back((uint8_t)(run ? len - 1 + 128 : len - 1));
+        for (int32_t k = 0; k < (run ? 1 : len); ++k)
+          put_pixel(begin + (size_t)k * c);
+        }
+      ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+      report_rows(rows, y + 1);
+      }
+    return fclose(f) == 0 && ok;
+    }
+  }
+
+std::unique_ptr<image> image_import(const char* filename)
+  {
+  return image_import(filename, image_format::rgba16);
+  }
+
+std::unique_ptr<image> image_import(const char* filename, image_format format)
+  {
+  int w, h, nr_of_channels;
+  if (!filename)
+    return nullptr;
+  if (std::unique_ptr<image> pfm = import_pfm(filename, format))
+    return pfm;
+  if (std::unique_ptr<image> qoi = import_qoi(filename, format))
+    return qoi;
+  const bool sixteen_bit = stbi_is_16_bit(filename) != 0;
+  void* im = sixteen_bit ? (void*)stbi_load_16(filename, &w, &h, &nr_of_channels, 0) : (void*)stbi_load(filename, &w, &h, &nr_of_channels, 0);
+  if (!im)
+    return nullptr;
+  std::unique_ptr<image> out = std::make_unique<image>();
+  out->init(w, h, format);
+  if (sixteen_bit)
+    import_pixels((const uint16_t*)im, nr_of_channels, out->size(), format, out->data());
+  else
+    import_pixels((const uint8_t*)im, nr_of_channels, out->size(), format, out->data());
+  stbi_image_free(im);
+  return out;
+  }
+
+std::unique_ptr<image> image_import_raw(const char* filename, int32_t w, int32_t h, image_raw_format raw, image_format format)
+  {
+  if (!filename || w < 1 || h < 1)
+    return nullptr;
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return nullptr;
+  std::unique_ptr<image> out = std::make_unique<image>();
+  out->init(w, h, format);
+  const int64_t count = out->size();
+  const int32_t sample_bytes = raw == image_raw_format::r16 ? 2 : 4;
+  // the file is read in chunks, so that the conversion runs on data that is still in the cache
+  const int64_t chunk = 1 << 16;
+  std::vector<uint32_t> buffer((size_t)chunk);
+  for (int64_t p0 = 0; p0 < count; p0 += chunk)
     {
-    res = stbi_write_tga(filename, w, h, c, (void*)bytes);
-    break;
+    const int64_t n = std::min(chunk, count - p0);
+    if (fread(buffer.data(), sample_bytes, (size_t)n, f) != (size_t)n)
+      {
+      fclose(f);
+      return nullptr;
+      }
+    uint8_t* d = (uint8_t*)out->data() + p0 * out->bytes_per_pixel();
+    if (raw == image_raw_format::r16)
+      {
+      const uint16_t* s = (const uint16_t*)buffer.data();
+      import_pixels(s, 1, n, format, d);
+      }
+    else
+      {
+      import_floats((const float*)buffer.data(), 1, n, format, d);
+      }
     }
+  // a file with more data than w x h heights has another size
+  const bool exact = fgetc(f) == EOF;
+  fclose(f);
+  return exact ? std::move(out) : nullptr;
+  }
+
+bool image_export(const std::unique_ptr<image>& im, const char* filename, image_export_filetype filetype, int32_t jpeg_quality)
+  {
+  image_export_options options;
+  options.filetype = filetype;
+  options.jpeg_quality = jpeg_quality;
+  options.compression_level = stbi_write_png_compression_level;
+  options.nr_of_threads = 1;
+  return image_export(*im, filename, options, nullptr);
+  }
+
+bool image_export(const image& im, const char* filename, const image_export_options& options, std::atomic<int32_t>* rows)
+  {
+  report_rows(rows, 0);
+  switch (options.filetype)
+    {
+    case image_export_filetype::png16: return export_png16(im, filename, options.compression_level, options.nr_of_threads, rows);
+    case image_export_filetype::r16: return export_raw(im, filename, image_raw_format::r16, rows);
+    case image_export_filetype::r32f: return export_raw(im, filename, image_raw_format::r32f, rows);
+    case image_export_filetype::pfm: return export_pfm(im, filename, rows);
+    case image_export_filetype::png: return export_png(im, filename, options.compression_level, options.nr_of_threads, rows);
+    case image_export_filetype::tga: return export_tga(im, filename, rows);
+    case image_export_filetype::qoi: return export_qoi(im, filename, false, rows);
+    case image_export_filetype::qoi16: return export_qoi(im, filename, true, rows);
+    default: break;
     }
-  delete[] bytes;
+  // stb_image_write needs the whole image for jpg and bmp
+  const int32_t w = im.width();
+  const int32_t h = im.height();
+  const int32_t c = export_channels_8(im.format());
+  std::vector<uint8_t> bytes((size_t)w * h * c);
+  for (int32_t y = 0; y < h; ++y)
+    export_row_8(im, y, bytes.data() + (size_t)y * w * c);
+  int res = 0;
+  if (options.filetype == image_export_filetype::jpg)
+    res = stbi_write_jpg(filename, w, h, c, (void*)bytes.data(), clamp(options.jpeg_quality, 1, 100));
+  else
+    res = stbi_write_bmp(filename, w, h, c, (void*)bytes.data());
+  report_rows(rows, h);
   return res != 0;
   }
 
 std::unique_ptr<image> image_flat(int32_t width, int32_t height, uint32_t color)
+  {
+  return image_flat(width, height, color, image_format::rgba16);
+  }
+
+std::unique_ptr<image> image_flat(int32_t width, int32_t height, uint32_t color, image_format format)
   {
   if (width < 0)
     return nullptr;
   if (height < 0)
     return nullptr;
   std::unique_ptr<image> out = std::make_unique<image>();
-  out->init(width, height);
-  set_mem_8(out->data(), get_color_64(color), out->size());
+  out->init(width, height, format);
+  uint64_t color64 = get_color_64(color);
+  switch (format)
+    {
+    case image_format::rgba16:
+      set_mem_8(out->data(), color64, out->size());
+      break;
+    case image_format::gray16:
+      std::fill((uint16_t*)out->data(), (uint16_t*)out->data() + out->size(), (uint16_t)(color64 & 0xffff));
+      break;
+    case image_format::gray32f:
+      std::fill((float*)out->data(), (float*)out->data() + out->size(), value_7fff_to_float(color64 & 0xffff));
+      break;
+    }
+  return out;
+  }
+
+std::unique_ptr<image> image_convert(const std::unique_ptr<image>& im, image_format format)
+  {
+  if (im->format() == format)
+    return im->copy();
+  std::unique_ptr<image> out = std::make_unique<image>();
+  out->init(im->width(), im->height(), format);
+  const int64_t count = im->size();
+  if (im->format() == image_format::rgba16)
+    {
+    const uint16_t* s = (const uint16_t*)im->data();
+    if (format == image_format::gray16)
+      {
+      uint16_t* d = (uint16_t*)out->data();
+      for (int64_t i = 0; i < count; ++i, s += 4)
+        d[i] = s[0];
+      }
+    else
+      {
+      float* d = (float*)out->data();
+      for (int64_t i = 0; i < count; ++i, s += 4)
+        d[i] = value_7fff_to_float(s[0]);
+      }
+    }
+  else if (im->format() == image_format::gray16)
+    {
+    const uint16_t* s = (const uint16_t*)im->data();
+    if (format == image_format::rgba16)
+      {
+      uint64_t* d = out->data();
+      for (int64_t i = 0; i < count; ++i)
+        {
+        uint64_t v = s[i];
+        d[i] = 0x7fff000000000000 | (v << 32) | (v << 16) | v;
+        }
+      }
+    else
+      {
+      float* d = (float*)out->data();
+      for (int64_t i = 0; i < count; ++i)
+        d[i] = value_7fff_to_float(s[i]);
+      }
+    }
+  else
+    {
+    const float* s = (const float*)im->data();
+    if (format == image_format::rgba16)
+      {
+      uint64_t* d = out->data();
+      for (int64_t i = 0; i < count; ++i)
+        {
+        uint64_t v = float_to_value_7fff(s[i]);
+        d[i] = 0x7fff000000000000 | (v << 32) | (v << 16) | v;
+        }
+      }
+    else
+      {
+      uint16_t* d = (uint16_t*)out->data();
+      for (int64_t i = 0; i < count; ++i)
+        d[i] = float_to_value_7fff(s[i]);
+      }
+    }
   return out;
   }
 
 bool fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, const std::unique_ptr<image>& im)
   {
-  const int32_t w = im->width();
-  const int32_t h = im->height();
-  const uint16_t* s = (const uint16_t*)im->data();
-  switch (im->format())
+  return fill_rgba_buffer_with_image(buffer, buffer_bytes_per_row, image_view(im));
+  }
+
+bool fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, const image_view& v)
+  {
+  const int32_t w = v.width();
+  const int32_t h = v.height();
+  switch (v.format())
     {
     case image_format::rgba16:
     {
     for (int y = 0; y < h; ++y)
       {
-      uint32_t* p_buffer_row = (uint32_t*)((uint8_t*)buffer + y * buffer_bytes_per_row);
-
-      for (int x = 0; x < w; ++x, s += 4)
+      const uint16_t* s = (const uint16_t*)v.row(y);
+      uint32_t* p_buffer_row = (uint32_t*)((uint8_t*)buffer + (size_t)y * buffer_bytes_per_row);
+
+      for (int x = 0; x < w; ++x, s += 4)
+        {
+        uint32_t clr = (((s[0] >> 7) & 0xff)) |
+          (((s[1] >> 7) & 0xff) << 8) |
+          (((s[2] >> 7) & 0xff) << 16) |
+          (((s[3] >> 7) & 0xff) << 24);
+        *p_buffer_row++ = clr;
+        }
+      }
+    return true;
+    }
+    case image_format::gray16:
+    {
+    for (int y = 0; y < h; ++y)
+      {
+      const uint16_t* s = (const uint16_t*)v.row(y);
+      uint32_t* p_buffer_row = (uint32_t*)((uint8_t*)buffer + (size_t)y * buffer_bytes_per_row);
+      for (int x = 0; x < w; ++x, ++s)
+        {
+        uint32_t g = (*s >> 7) & 0xff;
+        *p_buffer_row++ = 0xff000000 | (g << 16) | (g << 8) | g;
+        }
+      }
+    return true;
+    }
+    case image_format::gray32f:
+    {
+    for (int y = 0; y < h; ++y)
+      {
+      const float* s = (const float*)v.row(y);
+      uint32_t* p_buffer_row = (uint32_t*)((uint8_t*)buffer + (size_t)y * buffer_bytes_per_row);
+      for (int x = 0; x < w; ++x, ++s)
         {
-        uint32_t clr = (((s[0] >> 7) & 0xff)) |
-          (((s[1] >> 7) & 0xff) << 8) |
-          (((s[2] >> 7) & 0xff) << 16) |
-          (((s[3] >> 7) & 0xff) << 24);
-        *p_buffer_row++ = clr;
+        uint32_t g = float_to_value_7fff(*s) >> 7;
+        *p_buffer_row++ = 0xff000000 | (g << 16) | (g << 8) | g;
         }
       }
     return true;
@@ -553,95 +1999,371 @@ bool fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, co
   }
 
 
-std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1)
+
+namespace
   {
-  if (xs < 1)
-    return nullptr;
-  if (ys < 1)
-    return nullptr;
-  std::unique_ptr<image> bm = std::make_unique<image>();
-  bm->init(xs, ys);
 
-  uint64_t c0 = get_color_64(col0);
-  uint64_t c1 = get_color_64(col1);
+  // The inner loop of image_perlin: accumulates n pixels of one lattice group of one octave into rowp.
+  // poly holds the fade curve for this octave, so that poly[xg] is the weight for pixel xg of the group.
+  typedef void (*perlin_span_function)(int32_t* rowp, int32_t n, int32_t fa, int32_t fb, int32_t fad, int32_t fbd, const int32_t* poly, int32_t si, const int32_t* int32_tab);
 
-  const int32_t w = 1 << get_power_2(bm->width());
+  template <uint32_t mode>
+  inline int32_t perlin_shape(int32_t nni, const int32_t* int32_tab)
+    {
+    if constexpr (mode == 1)
+      nni = std::abs(nni);
+    if constexpr (mode == 3)
+      nni &= 0x7fff;
+    if constexpr (mode >= 2)
+      {
+      int32_t ind = (nni >> 8) & 0xff;
+      nni = int32_tab[ind] + (((int32_tab[ind + 1] - int32_tab[ind]) * (nni & 0xff)) >> 8);
+      }
+    return nni;
+    }
 
-  int32_t shiftx = 16 - get_power_2(w);
-  int32_t shifty = 16 - get_power_2(bm->height());
-  uint64_t* tile = bm->data();
-  seed &= 255;
-  uint32_t mode = static_cast<uint32_t>(m);
-  mode &= 3;
+  // The fade curve at pixel xg of a lattice group of octave freq + shf, poly_size is the group size of octave freq
+  inline int32_t perlin_fade(int32_t xg, int32_t shf, int32_t poly_size)
+    {
+    float f = 1.0f * (xg << shf) / poly_size;
+    return (int32_t)(f * f * f * (10 + f * (6 * f - 15)) * 16384.0f);
+    }
 
-  int32_t i, noffs, x, y;
-  int32_t gamma_table[1025];
-  for (i = 0; i < 1025; ++i)
-    gamma_table[i] = range7fff(std::pow(i / 1024.0f, gamma) * 0x8000) * 2;
+  template <uint32_t mode>
+  void perlin_span_scalar(int32_t* rowp, int32_t n, int32_t fa, int32_t fb, int32_t fad, int32_t fbd, const int32_t* poly, int32_t si, const int32_t* int32_tab)
+    {
+    for (int32_t xg = 0; xg < n; ++xg)
+      {
+      int32_t nni = fa + (((fb - fa) * poly[xg]) >> 14);
+      nni = perlin_shape<mode>(nni, int32_tab);
+      *rowp++ += (nni * si) >> 14;
+      fa += fad;
+      fb += fbd;
+      }
+    }
 
-  if (mode & 1)
+  // perlin_span_scalar for lattice groups of more than 65536 pixels, where fa and fb change by less than 1 per pixel.
+  // fa and fb are at the start of the group, and are advanced in 32.32 fixed point to pixel xg0, where the span starts.
+  // The fade curve is computed per pixel, a table of it would take gigabytes for the widest maps.
+  template <uint32_t mode>
+  void perlin_span_wide_mode(int32_t* rowp, int32_t n, int32_t xg0, int32_t fa, int32_t fb, float fad, float fbd, int32_t shf, int32_t poly_size, int32_t si, const int32_t* int32_tab)
     {
-    amp *= 0x8000;
-    noffs = 0;
+    const int64_t fad64 = (int64_t)(fad * 65536.0f);
+    const int64_t fbd64 = (int64_t)(fbd * 65536.0f);
+    int64_t fa64 = ((int64_t)fa << 16) + fad64 * xg0;
+    int64_t fb64 = ((int64_t)fb << 16) + fbd64 * xg0;
+    for (int32_t xg = 0; xg < n; ++xg)
+      {
+      const int32_t a = (int32_t)(fa64 >> 16);
+      const int32_t b = (int32_t)(fb64 >> 16);
+      int32_t nni = a + (((b - a) * perlin_fade(xg0 + xg, shf, poly_size)) >> 14);
+      nni = perlin_shape<mode>(nni, int32_tab);
+      *rowp++ += (nni * si) >> 14;
+      fa64 += fad64;
+      fb64 += fbd64;
+      }
     }
-  else
+
+  void perlin_span_wide(uint32_t mode, int32_t* rowp, int32_t n, int32_t xg0, int32_t fa, int32_t fb, float fad, float fbd, int32_t shf, int32_t poly_size, int32_t si, const int32_t* int32_tab)
+    {
+    switch (mode & 3)
+      {
+      case 0: perlin_span_wide_mode<0>(rowp, n, xg0, fa, fb, fad, fbd, shf, poly_size, si, int32_tab); break;
+      case 1: perlin_span_wide_mode<1>(rowp, n, xg0, fa, fb, fad, fbd, shf, poly_size, si, int32_tab); break;
+      case 2: perlin_span_wide_mode<2>(rowp, n, xg0, fa, fb, fad, fbd, shf, poly_size, si, int32_tab); break;
+      case 3: perlin_span_wide_mode<3>(rowp, n, xg0, fa, fb, fad, fbd, shf, poly_size, si, int32_tab); break;
+      }
+    }
+
+  // fa + n * fad, wrapping around exactly like n times fa += fad does
+  inline int32_t perlin_advance(int32_t fa, int32_t fad, int32_t n)
+    {
+    return (int32_t)((uint32_t)fa + (uint32_t)fad * (uint32_t)n);
+    }
+
+#ifdef HEIGHTMAP_X86
+  template <uint32_t mode>
+  HEIGHTMAP_TARGET_SSE41 inline __m128i perlin_shape_sse41(__m128i nni, const int32_t* int32_tab)
+    {
+    if constexpr (mode == 1)
+      nni = _mm_abs_epi32(nni);
+    if constexpr (mode == 3)
+      nni = _mm_and_si128(nni, _mm_set1_epi32(0x7fff));
+    if constexpr (mode >= 2)
+      {
+      alignas(16) int32_t ind[4];
+      _mm_store_si128((__m128i*)ind, _mm_and_si128(_mm_srai_epi32(nni, 8), _mm_set1_epi32(0xff)));
+      __m128i t0 = _mm_setr_epi32(int32_tab[ind[0]], int32_tab[ind[1]], int32_tab[ind[2]], int32_tab[ind[3]]);
+      __m128i t1 = _mm_setr_epi32(int32_tab[ind[0] + 1], int32_tab[ind[1] + 1], int32_tab[ind[2] + 1], int32_tab[ind[3] + 1]);
+      __m128i frac = _mm_and_si128(nni, _mm_set1_epi32(0xff));
+      nni = _mm_add_epi32(t0, _mm_srai_epi32(_mm_mullo_epi32(_mm_sub_epi32(t1, t0), frac), 8));
+      }
+    return nni;
+    }
+
+  template <uint32_t mode>
+  HEIGHTMAP_TARGET_SSE41 void perlin_span_sse41(int32_t* rowp, int32_t n, int32_t fa, int32_t fb, int32_t fad, int32_t fbd, const int32_t* poly, int32_t si, const int32_t* int32_tab)
+    {
+    const __m128i lane = _mm_setr_epi32(0, 1, 2, 3);
+    __m128i vfa = _mm_add_epi32(_mm_set1_epi32(fa), _mm_mullo_epi32(lane, _mm_set1_epi32(fad)));
+    __m128i vfb = _mm_add_epi32(_mm_set1_epi32(fb), _mm_mullo_epi32(lane, _mm_set1_epi32(fbd)));
+    const __m128i dfa = _mm_slli_epi32(_mm_set1_epi32(fad), 2);
+    const __m128i dfb = _mm_slli_epi32(_mm_set1_epi32(fbd), 2);
+    const __m128i vsi = _mm_set1_epi32(si);
+    int32_t xg = 0;
+    for (; xg + 4 <= n; xg += 4)
+      {
+      __m128i weight = _mm_loadu_si128((const __m128i*)(poly + xg));
+      __m128i nni = _mm_add_epi32(vfa, _mm_srai_epi32(_mm_mullo_epi32(_mm_sub_epi32(vfb, vfa), weight), 14));
+      nni = perlin_shape_sse41<mode>(nni, int32_tab);
+      __m128i row = _mm_loadu_si128((const __m128i*)(rowp + xg));
+      row = _mm_add_epi32(row, _mm_srai_epi32(_mm_mullo_epi32(nni, vsi), 14));
+      _mm_storeu_si128((__m128i*)(rowp + xg), row);
+      vfa = _mm_add_epi32(vfa, dfa);
+      vfb = _mm_add_epi32(vfb, dfb);
+      }
+    perlin_span_scalar<mode>(rowp + xg, n - xg, perlin_advance(fa, fad, xg), perlin_advance(fb, fbd, xg), fad, fbd, poly + xg, si, int32_tab);
+    }
+
+  template <uint32_t mode>
+  HEIGHTMAP_TARGET_AVX2 inline __m256i perlin_shape_avx2(__m256i nni, const int32_t* int32_tab)
+    {
+    if constexpr (mode == 1)
+      nni = _mm256_abs_epi32(nni);
+    if constexpr (mode == 3)
+      nni = _mm256_and_si256(nni, _mm256_set1_epi32(0x7fff));
+    if constexpr (mode >= 2)
+      {
+      __m256i ind = _mm256_and_si256(_mm256_srai_epi32(nni, 8), _mm256_set1_epi32(0xff));
+      __m256i t0 = _mm256_i32gather_epi32((const int*)int32_tab, ind, 4);
+      __m256i t1 = _mm256_i32gather_epi32((const int*)(int32_tab + 1), ind, 4);
+      __m256i frac = _mm256_and_si256(nni, _mm256_set1_epi32(0xff));
+      nni = _mm256_add_epi32(t0, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(t1, t0), frac), 8));
+      }
+    return nni;
+    }
+
+  template <uint32_t mode>
+  HEIGHTMAP_TARGET_AVX2 void perlin_span_avx2(int32_t* rowp, int32_t n, int32_t fa, int32_t fb, int32_t fad, int32_t fbd, const int32_t* poly, int32_t si, const int32_t* int32_tab)
+    {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    __m256i vfa = _mm256_add_epi32(_mm256_set1_epi32(fa), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fad)));
+    __m256i vfb = _mm256_add_epi32(_mm256_set1_epi32(fb), _mm256_mullo_epi32(lane, _mm256_set1_epi32(fbd)));
+    const __m256i dfa = _mm256_slli_epi32(_mm256_set1_epi32(fad), 3);
+    const __m256i dfb = _mm256_slli_epi32(_mm256_set1_epi32(fbd), 3);
+    const __m256i vsi = _mm256_set1_epi32(si);
+    int32_t xg = 0;
+    for (; xg + 8 <= n; xg += 8)
+      {
+      __m256i weight = _mm256_loadu_si256((const __m256i*)(poly + xg));
+      __m256i nni = _mm256_add_epi32(vfa, _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_sub_epi32(vfb, vfa), weight), 14));
+      nni = perlin_shape_avx2<mode>(nni, int32_tab);
+      __m256i row = _mm256_loadu_si256((const __m256i*)(rowp + xg));
+      row = _mm256_add_epi32(row, _mm256_srai_epi32(_mm256_mullo_epi32(nni, vsi), 14));
+      _mm256_storeu_si256((__m256i*)(rowp + xg), row);
+      vfa = _mm256_add_epi32(vfa, dfa);
+      vfb = _mm256_add_epi32(vfb, dfb);
+      }
+    perlin_span_scalar<mode>(rowp + xg, n - xg, perlin_advance(fa, fad, xg), perlin_advance(fb, fbd, xg), fad, fbd, poly + xg, si, int32_tab);
+    }
+#endif
+
+  perlin_span_function get_perlin_span_function(uint32_t mode, simd_level level)
     {
-    amp *= 0x4000;
-    noffs = 0x4000;
+    static const perlin_span_function scalar[4] = { &perlin_span_scalar<0>, &perlin_span_scalar<1>, &perlin_span_scalar<2>, &perlin_span_scalar<3> };
+#ifdef HEIGHTMAP_X86
+    static const perlin_span_function sse41[4] = { &perlin_span_sse41<0>, &perlin_span_sse41<1>, &perlin_span_sse41<2>, &perlin_span_sse41<3> };
+    static const perlin_span_function avx2[4] = { &perlin_span_avx2<0>, &perlin_span_avx2<1>, &perlin_span_avx2<2>, &perlin_span_avx2<3> };
+    switch (level)
+      {
+      case simd_level::avx2: return avx2[mode & 3];
+      case simd_level::sse41: return sse41[mode & 3];
+      default: break;
+      }
+#endif
+    return scalar[mode & 3];
     }
 
-  int32_t ampi = (int32_t)(amp);
+  // One octave of simplex noise for the n pixels x, x + 1, ... of a row at lattice height v.
+  // permute is the permutation table widened to int32_t, gradients the gradient table as consecutive x, y pairs,
+  // period_mask the lattice period of the perlin_context minus 1.
+  typedef void(*simplex_span_function)(int32_t* rowp, int32_t x, int32_t n, float scalex, float v, const int32_t* permute, const float* gradients, int32_t seed, int32_t period_mask, int32_t si, const int32_t* int32_tab);
+  simplex_span_function get_simplex_span_function(uint32_t mode, simd_level level);
 
-  int32_t int32_tab[257];
-  if (mode & 2)
+  // The gradient index of lattice cell (x, y), with x and y below the period of the context. The low bytes are hashed with the
+  // classic 256 cell permutation, the high bytes pick a permutation of that block, and the first block is the classic one.
+  inline int32_t lattice_hash(const int32_t* permute, int32_t x, int32_t y, int32_t seed)
     {
-    for (x = 0; x < 257; x++)
-      int32_tab[x] = (int32_t)(std::sin(2.f * 3.1415926535897f * x / 256.0f) * 0.5f * 65536.0f);
+    const int32_t block = permute[(x >> 8) + permute[y >> 8]] ^ permute[permute[0]];
+    return permute[(x & 255) + permute[(y & 255) ^ seed ^ block]];
     }
 
-  int32_t* nrow = new int32_t[bm->width()];
-  int32_t* poly = new int32_t[(w) >> freq];
+  // The largest width or height of the noise generators, the size rounded up to a power of 2 must fit in an int32_t
+  const int32_t max_noise_size = 1 << 30;
+
+  // Below this many pixels per lattice group the vector kernels have nothing to chew on.
+  const int32_t perlin_span_simd_threshold = 8;
 
-  for (x = 0; x < ((w) >> freq); ++x)
+  // Everything the octave synthesis of image_perlin needs, computed once per call
+  struct perlin_parameters
     {
-    float f = 1.0f * x / (w >> freq);
-    poly[x] = (int32_t)(f * f * f * (10 + f * (6 * f - 15)) * 16384.0f);
+    const perlin_context* context;
+    int32_t w; // width rounded up to a power of 2, only used to lay out the lattice, no pixels beyond the width are computed
+    int32_t shiftx, shifty; // 16 - log2 of the size, negative for maps of more than 65536 pixels
+    int32_t freq, oct;
+    float fadeoff;
+    int32_t seed;
+    int32_t period_mask; // lattice cells are taken modulo the period of the context
+    uint32_t mode;
+    int32_t int32_tab[257];
+    int32_t poly_size; // pixels in a lattice group of octave freq
+    std::vector<std::vector<int32_t>> poly; // fade curve per octave, indexed by the pixel within a lattice group, empty for groups of more than 65536 pixels
+    perlin_span_function span;
+    perlin_span_function span_scalar;
+    int32_t permute32[512]; // for the gathers of the simplex kernels
+    simplex_span_function simplex_span;
+    };
+
+  // Everything the resolve step of image_perlin needs to turn the accumulated noise into colors
+  struct perlin_resolve_parameters
+    {
+    int32_t noffs;
+    int32_t ampi;
+    uint64_t c0, c1;
+    int32_t gamma_table[1025];
+    };
+
+  void init_perlin_parameters(perlin_parameters& p, const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m)
+    {
+    p.context = &context;
+    p.w = 1 << get_power_2(xs);
+
+    p.shiftx = 16 - get_power_2(p.w);
+    p.shifty = 16 - get_power_2(ys);
+    p.freq = freq;
+    p.oct = oct;
+    p.fadeoff = fadeoff;
+    p.seed = seed & 255;
+    p.period_mask = (1 << context.period_bits()) - 1;
+    p.mode = static_cast<uint32_t>(m) & 3;
+
+    if (p.mode & 2)
+      {
+      for (int32_t x = 0; x < 257; x++)
+        p.int32_tab[x] = (int32_t)(std::sin(2.f * 3.1415926535897f * x / 256.0f) * 0.5f * 65536.0f);
+      }
+
+    // the fade curve over the lattice groups of octave freq, higher octaves sample every 2^(i - freq)'th value of it.
+    // Groups of more than 65536 pixels go through perlin_span_wide, which computes the curve itself, so a table holds at most 65536 values.
+    p.poly_size = std::max<int32_t>(1, p.w >> freq);
+    p.poly.resize(oct > 0 ? oct : 0);
+    for (int32_t i = freq; i < freq + oct; ++i)
+      {
+      if (p.shiftx + i < 0)
+        continue;
+      int32_t xGrpSize = (p.shiftx + i < 16) ? std::min<int32_t>(p.w, 1 << (16 - p.shiftx - i)) : 1;
+      int32_t shf = i - freq;
+      std::vector<int32_t>& poly_octave = p.poly[shf];
+      // a group never holds more pixels than the image is wide, the padding up to the power of 2 is never visited
+      const int32_t used = std::min(xGrpSize, xs);
+      poly_octave.resize(used);
+      for (int32_t xg = 0; xg < used; ++xg)
+        poly_octave[xg] = perlin_fade(xg, shf, p.poly_size);
+      }
+
+    p.span = get_perlin_span_function(p.mode, get_simd_level());
+    p.span_scalar = get_perlin_span_function(p.mode, simd_level::scalar);
+    for (int32_t i = 0; i < 512; ++i)
+      p.permute32[i] = context.permutation()[i];
+    p.simplex_span = get_simplex_span_function(p.mode, get_simd_level());
+    }
+
+  void init_perlin_resolve_parameters(perlin_resolve_parameters& r, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1)
+    {
+    r.c0 = get_color_64(col0);
+    r.c1 = get_color_64(col1);
+
+    for (int32_t i = 0; i < 1025; ++i)
+      r.gamma_table[i] = range7fff(std::pow(i / 1024.0f, gamma) * 0x8000) * 2;
+
+    if (static_cast<uint32_t>(m) & 1)
+      {
+      amp *= 0x8000;
+      r.noffs = 0;
+      }
+    else
+      {
+      amp *= 0x4000;
+      r.noffs = 0x4000;
+      }
+
+    r.ampi = (int32_t)(amp);
     }
 
-  for (y = 0; y < bm->height(); ++y)
+  // Accumulates all octaves of row y, pixels [x0, x1), of the perlin image described by p into nrow.
+  // Every pixel only depends on its coordinates in the full image, so disjoint windows can be computed concurrently
+  // and match the corresponding part of the full image exactly.
+  void perlin_noise_row(const perlin_parameters& p, int32_t x0, int32_t x1, int32_t y, int32_t* nrow)
     {
-    memset(nrow, 0, sizeof(int32_t) * bm->width());
+    const int32_t w = p.w;
+    const int32_t shiftx = p.shiftx;
+    const int32_t shifty = p.shifty;
+    const int32_t freq = p.freq;
+    const int32_t seed = p.seed;
+    const int32_t* int32_tab = p.int32_tab;
+    const uint8_t* perlin_permute = p.context->permutation();
+    const perlin_context::gradient_table& perlin_random = p.context->gradients();
+    const bool wide_period = p.period_mask > 255;
+
+    memset(nrow, 0, sizeof(int32_t) * (x1 - x0));
     float s = 1.0f;
 
     // make some noise
-    for (i = freq; i < freq + oct; ++i)
+    for (int32_t i = freq; i < freq + p.oct; ++i)
       {
       int32_t xGrpSize = (shiftx + i < 16) ? std::min<int32_t>(w, 1 << (16 - shiftx - i)) : 1;
       int32_t groups = (shiftx + i < 16) ? w >> (16 - shiftx - i) : w;
-      int32_t mask = ((1 << i) - 1) & 255;
-      int32_t py = y << (shifty + i);
-
-      int32_t vy = (py >> 16) & mask;
-      int32_t dtx = 1 << (shiftx + i);
-      float ty = (py & 0xffff) / 65536.0f;
+      int32_t mask = i < 31 ? ((1 << i) - 1) & p.period_mask : p.period_mask;
+      // the row in 32.32 fixed point lattice coordinates, the bits above the lattice period are dropped
+      const int32_t sy = shifty + i + 16;
+      const uint64_t py = sy >= 64 ? 0 : (sy >= 0 ? (uint64_t)y << sy : (uint64_t)y >> -sy);
+      const uint32_t pyf = (uint32_t)py;
+
+      int32_t vy = (int32_t)(py >> 32) & mask;
+      float ty = (pyf >> 8) / 16777216.0f;
       float tyf = ty * ty * ty * (10 + ty * (6 * ty - 15));
       float ty0f = ty * (1 - tyf);
       float ty1f = (ty - 1) * tyf;
-      int32_t vy0 = perlin_permute[((vy + 0)) ^ seed];
-      int32_t vy1 = perlin_permute[((vy + 1) & mask) ^ seed];
-      int32_t shf = i - freq;
+      int32_t vy0 = wide_period ? 0 : perlin_permute[((vy + 0)) ^ seed];
+      int32_t vy1 = wide_period ? 0 : perlin_permute[((vy + 1) & mask) ^ seed];
       int32_t si = (int32_t)(s * 16384.0f);
+      const int32_t* poly = p.poly[i - freq].data();
+      perlin_span_function span = xGrpSize >= perlin_span_simd_threshold ? p.span : p.span_scalar;
+      // the change of fa and fb per pixel, which is below 1 for lattice cells of more than 65536 pixels
+      const float dtx = std::ldexp(1.0f, shiftx + i);
 
-      if (shiftx + i < 16 || (py & 0xffff)) // otherwise, the contribution is always zero
+      if (shiftx + i < 16 || pyf) // otherwise, the contribution is always zero
         {
         int32_t* rowp = nrow;
-        int32_t xcount = 0;
-        for (int32_t vx = 0; vx < groups; vx++)
+        int32_t xcount = x0;
+        int32_t xg0 = x0 % xGrpSize; // the window can start in the middle of a group
+        for (int32_t vx = x0 / xGrpSize; vx < groups && xcount < x1; vx++)
           {
-          int32_t v00 = perlin_permute[((vx + 0) & mask) + vy0];
-          int32_t v01 = perlin_permute[((vx + 1) & mask) + vy0];
-          int32_t v10 = perlin_permute[((vx + 0) & mask) + vy1];
-          int32_t v11 = perlin_permute[((vx + 1) & mask) + vy1];
+          int32_t v00, v01, v10, v11;
+          if (wide_period)
+            {
+            v00 = lattice_hash(p.permute32, (vx + 0) & mask, vy, seed);
+            v01 = lattice_hash(p.permute32, (vx + 1) & mask, vy, seed);
+            v10 = lattice_hash(p.permute32, (vx + 0) & mask, (vy + 1) & mask, seed);
+            v11 = lattice_hash(p.permute32, (vx + 1) & mask, (vy + 1) & mask, seed);
+            }
+          else
+            {
+            v00 = perlin_permute[((vx + 0) & mask) + vy0];
+            v01 = perlin_permute[((vx + 1) & mask) + vy0];
+            v10 = perlin_permute[((vx + 0) & mask) + vy1];
+            v11 = perlin_permute[((vx + 1) & mask) + vy1];
+            }
 
           float f_0h = perlin_random[v00][0] + (perlin_random[v10][0] - perlin_random[v00][0]) * tyf;
           float f_1h = perlin_random[v01][0] + (perlin_random[v11][0] - perlin_random[v01][0]) * tyf;
@@ -650,127 +2372,539 @@ std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_
 
           int32_t fa = (int32_t)(f_0v * 65536.0f);
           int32_t fb = (int32_t)((f_1v - f_1h) * 65536.0f);
-          int32_t fad = (int32_t)(f_0h * dtx);
-          int32_t fbd = (int32_t)(f_1h * dtx);
-
-          for (int32_t xg = 0; xg < xGrpSize && xcount < bm->width(); ++xg)
+          int32_t n = std::min<int32_t>(xGrpSize - xg0, x1 - xcount);
+          if (dtx >= 1.0f)
             {
-            int32_t nni = fa + (((fb - fa) * poly[xg << shf]) >> 14);
-            switch (mode)
-              {
-              case 0:   break;
-              case 1:   nni = std::abs(nni); break;
-              case 3:   nni &= 0x7fff;
-              case 2:
-              {
-              int32_t ind = (nni >> 8) & 0xff;
-              nni = int32_tab[ind] + (((int32_tab[ind + 1] - int32_tab[ind]) * (nni & 0xff)) >> 8);
-              }
-              break;
-              default: break;
-              }
-            *rowp++ += (nni * si) >> 14;
-            fa += fad;
-            fb += fbd;
-            ++xcount;
+            int32_t fad = (int32_t)(f_0h * dtx);
+            int32_t fbd = (int32_t)(f_1h * dtx);
+            span(rowp, n, perlin_advance(fa, fad, xg0), perlin_advance(fb, fbd, xg0), fad, fbd, poly + xg0, si, int32_tab);
             }
+          else
+            perlin_span_wide(p.mode, rowp, n, xg0, fa, fb, f_0h * dtx, f_1h * dtx, i - freq, p.poly_size, si, int32_tab);
+          rowp += n;
+          xcount += n;
+          xg0 = 0;
           }
         }
 
-      s *= fadeoff;
+      s *= p.fadeoff;
       }
+    }
 
-    // resolve
-    for (x = 0; x < bm->width(); ++x)
-      fade_64(*tile++, c0, c1, get_gamma(range7fff(mul_shift(nrow[x], ampi) + noffs), gamma_table));
+  void perlin_resolve_row(const perlin_resolve_parameters& r, const int32_t* nrow, void* out, int32_t count, image_format format)
+    {
+    uint64_t c0 = r.c0;
+    uint64_t c1 = r.c1;
+    switch (format)
+      {
+      case image_format::rgba16:
+      {
+      uint64_t* out64 = (uint64_t*)out;
+      for (int32_t x = 0; x < count; ++x)
+        fade_64(*out64++, c0, c1, get_gamma(range7fff(mul_shift(nrow[x], r.ampi) + r.noffs), r.gamma_table));
+      break;
+      }
+      case image_format::gray16:
+      {
+      uint16_t* out16 = (uint16_t*)out;
+      for (int32_t x = 0; x < count; ++x)
+        *out16++ = fade_16((uint16_t)c0, (uint16_t)c1, get_gamma(range7fff(mul_shift(nrow[x], r.ampi) + r.noffs), r.gamma_table));
+      break;
+      }
+      case image_format::gray32f:
+      {
+      float* outf = (float*)out;
+      for (int32_t x = 0; x < count; ++x)
+        *outf++ = value_7fff_to_float(fade_16((uint16_t)c0, (uint16_t)c1, get_gamma(range7fff(mul_shift(nrow[x], r.ampi) + r.noffs), r.gamma_table)));
+      break;
+      }
+      }
     }
 
-  delete[] nrow;
-  delete[] poly;
+  const float simplex_skew = 0.366025403784f; // (sqrt(3) - 1) / 2
+  const float simplex_unskew = 0.211324865405f; // (3 - sqrt(3)) / 6
+  const float simplex_scale = 65536.0f * 40.0f; // brings simplex noise in the range of the perlin noise, so amp and the modes behave alike
 
-  return bm;
-  }
+  inline int32_t fast_floor(float f)
+    {
+    const int32_t i = (int32_t)f;
+    return f < (float)i ? i - 1 : i;
+    }
 
-void image_init()
-  {
-  init_perlin();
-  }
+  inline float simplex_corner(const float* gradients, int32_t h, float x, float y)
+    {
+    float t = std::max(0.5f - x * x - y * y, 0.0f);
+    t *= t;
+    return t * t * (gradients[2 * h] * x + gradients[2 * h + 1] * y);
+    }
 
-std::unique_ptr<image> image_normals(const std::unique_ptr<image>& im, float _dist, image_normals_mode m)
-  {
-  int32_t shiftx, shifty;
-  int32_t xs, ys;
-  int32_t x, y;
-  uint16_t* sx, * sy, * s, * d;
-  int32_t vx, vy, vz;
-  float e;
-  int32_t dist;
+  template <uint32_t mode>
+  void simplex_span_scalar(int32_t* rowp, int32_t x, int32_t n, float scalex, float v, const int32_t* permute, const float* gradients, int32_t seed, int32_t period_mask, int32_t si, const int32_t* int32_tab)
+    {
+    for (int32_t k = 0; k < n; ++k)
+      {
+      const float u = (float)(x + k) * scalex;
+      // the simplex (triangle) that contains (u, v), and the offsets to its 3 corners
+      const float sk = (u + v) * simplex_skew;
+      const int32_t ci = fast_floor(u + sk);
+      const int32_t cj = fast_floor(v + sk);
+      const float t = ((float)ci + (float)cj) * simplex_unskew;
+      const float dx0 = u - ((float)ci - t);
+      const float dy0 = v - ((float)cj - t);
+      const int32_t i1 = dx0 > dy0 ? 1 : 0;
+      const int32_t j1 = 1 - i1;
+      const float dx1 = (dx0 - (float)i1) + simplex_unskew;
+      const float dy1 = (dy0 - (float)j1) + simplex_unskew;
+      const float dx2 = (dx0 - 1.0f) + 2.0f * simplex_unskew;
+      const float dy2 = (dy0 - 1.0f) + 2.0f * simplex_unskew;
+
+      const int32_t ii = ci & period_mask;
+      const int32_t jj = cj & period_mask;
+      int32_t h0, h1, h2;
+      if (period_mask > 255)
+        {
+        h0 = lattice_hash(permute, ii, jj, seed);
+        h1 = lattice_hash(permute, (ii + i1) & period_mask, (jj + j1) & period_mask, seed);
+        h2 = lattice_hash(permute, (ii + 1) & period_mask, (jj + 1) & period_mask, seed);
+        }
+      else
+        {
+        h0 = permute[ii + permute[jj ^ seed]];
+        h1 = permute[((ii + i1) & 255) + permute[((jj + j1) & 255) ^ seed]];
+        h2 = permute[((ii + 1) & 255) + permute[((jj + 1) & 255) ^ seed]];
+        }
 
-  std::unique_ptr<image> bm = std::make_unique<image>();
-  bm->init(im->width(), im->height());
-  dist = (int32_t)(_dist * 65536.0f);
-  d = (uint16_t*)bm->data();
-  sx = sy = s = (uint16_t*)im->data();
-  xs = im->width();
-  ys = im->height();
-  shiftx = get_power_2(im->width());
-  shifty = get_power_2(im->height());
+      const float nf = (simplex_corner(gradients, h0, dx0, dy0) + simplex_corner(gradients, h1, dx1, dy1)) + simplex_corner(gradients, h2, dx2, dy2);
+      const int32_t nni = perlin_shape<mode>((int32_t)(nf * simplex_scale), int32_tab);
+      rowp[k] += (nni * si) >> 14;
+      }
+    }
 
-  uint32_t mode = static_cast<uint32_t>(m);
+#ifdef HEIGHTMAP_X86
+  HEIGHTMAP_TARGET_AVX2 inline __m256 simplex_corner_avx2(const float* gradients, __m256i h, __m256 x, __m256 y)
+    {
+    const __m256i h2 = _mm256_slli_epi32(h, 1);
+    const __m256 gx = _mm256_i32gather_ps(gradients, h2, 4);
+    const __m256 gy = _mm256_i32gather_ps(gradients + 1, h2, 4);
+    __m256 t = _mm256_max_ps(_mm256_sub_ps(_mm256_sub_ps(_mm256_set1_ps(0.5f), _mm256_mul_ps(x, x)), _mm256_mul_ps(y, y)), _mm256_setzero_ps());
+    t = _mm256_mul_ps(t, t);
+    return _mm256_mul_ps(_mm256_mul_ps(t, t), _mm256_add_ps(_mm256_mul_ps(gx, x), _mm256_mul_ps(gy, y)));
+    }
+
+  // lattice_hash of 8 cells
+  HEIGHTMAP_TARGET_AVX2 inline __m256i lattice_hash_avx2(const int32_t* permute, __m256i x, __m256i y, __m256i seed)
+    {
+    const __m256i byte = _mm256_set1_epi32(255);
+    const __m256i first = _mm256_set1_epi32(permute[permute[0]]);
+    const __m256i block = _mm256_xor_si256(_mm256_i32gather_epi32(permute, _mm256_add_epi32(_mm256_srli_epi32(x, 8), _mm256_i32gather_epi32(permute, _mm256_srli_epi32(y, 8), 4)), 4), first);
+    const __m256i row = _mm256_i32gather_epi32(permute, _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(y, byte), seed), block), 4);
+    return _mm256_i32gather_epi32(permute, _mm256_add_epi32(_mm256_and_si256(x, byte), row), 4);
+    }
 
-  for (y = 0; y < ys; y++)
+  // Bit identical to simplex_span_scalar: same operations in the same order, 8 pixels at a time.
+  template <uint32_t mode>
+  HEIGHTMAP_TARGET_AVX2 void simplex_span_avx2(int32_t* rowp, int32_t x, int32_t n, float scalex, float v, const int32_t* permute, const float* gradients, int32_t seed, int32_t period_mask, int32_t si, const int32_t* int32_tab)
     {
-    sy = s;
-    for (x = 0; x < xs; x++)
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i byte = _mm256_set1_epi32(255);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i vseed = _mm256_set1_epi32(seed);
+    const __m256i vmask = _mm256_set1_epi32(period_mask);
+    const bool wide_period = period_mask > 255;
+    const __m256i vsi = _mm256_set1_epi32(si);
+    const __m256 vv = _mm256_set1_ps(v);
+    const __m256 vscalex = _mm256_set1_ps(scalex);
+    const __m256 skew = _mm256_set1_ps(simplex_skew);
+    const __m256 unskew = _mm256_set1_ps(simplex_unskew);
+    const __m256 unskew2 = _mm256_set1_ps(2.0f * simplex_unskew);
+    const __m256 onef = _mm256_set1_ps(1.0f);
+    int32_t k = 0;
+    for (; k + 8 <= n; k += 8)
       {
-      if (mode & 4)
+      const __m256 u = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x + k), lane)), vscalex);
+      const __m256 sk = _mm256_mul_ps(_mm256_add_ps(u, vv), skew);
+      const __m256 fi = _mm256_floor_ps(_mm256_add_ps(u, sk));
+      const __m256 fj = _mm256_floor_ps(_mm256_add_ps(vv, sk));
+      const __m256 t = _mm256_mul_ps(_mm256_add_ps(fi, fj), unskew);
+      const __m256 dx0 = _mm256_sub_ps(u, _mm256_sub_ps(fi, t));
+      const __m256 dy0 = _mm256_sub_ps(vv, _mm256_sub_ps(fj, t));
+      const __m256 upper = _mm256_cmp_ps(dx0, dy0, _CMP_GT_OQ);
+      const __m256 i1f = _mm256_and_ps(upper, onef);
+      const __m256 j1f = _mm256_andnot_ps(upper, onef);
+      const __m256i i1 = _mm256_and_si256(_mm256_castps_si256(upper), one);
+      const __m256i j1 = _mm256_sub_epi32(one, i1);
+      const __m256 dx1 = _mm256_add_ps(_mm256_sub_ps(dx0, i1f), unskew);
+      const __m256 dy1 = _mm256_add_ps(_mm256_sub_ps(dy0, j1f), unskew);
+      const __m256 dx2 = _mm256_add_ps(_mm256_sub_ps(dx0, onef), unskew2);
+      const __m256 dy2 = _mm256_add_ps(_mm256_sub_ps(dy0, onef), unskew2);
+
+      __m256i h0, h1, h2;
+      if (wide_period)
         {
-        vx = filterbumpsharp(sx, x * 4, xs * 4, 4);
-        vy = filterbumpsharp(sy, y * xs * 4, ys * xs * 4, xs * 4);
+        const __m256i ii = _mm256_and_si256(_mm256_cvttps_epi32(fi), vmask);
+        const __m256i jj = _mm256_and_si256(_mm256_cvttps_epi32(fj), vmask);
+        h0 = lattice_hash_avx2(permute, ii, jj, vseed);
+        h1 = lattice_hash_avx2(permute, _mm256_and_si256(_mm256_add_epi32(ii, i1), vmask), _mm256_and_si256(_mm256_add_epi32(jj, j1), vmask), vseed);
+        h2 = lattice_hash_avx2(permute, _mm256_and_si256(_mm256_add_epi32(ii, one), vmask), _mm256_and_si256(_mm256_add_epi32(jj, one), vmask), vseed);
         }
       else
         {
-        vx = filterbump(sx, x * 4, xs * 4, 4);
-        vy = filterbump(sy, y * xs * 4, ys * xs * 4, xs * 4);
+        const __m256i ii = _mm256_and_si256(_mm256_cvttps_epi32(fi), byte);
+        const __m256i jj = _mm256_and_si256(_mm256_cvttps_epi32(fj), byte);
+        h0 = _mm256_i32gather_epi32(permute, _mm256_add_epi32(ii, _mm256_i32gather_epi32(permute, _mm256_xor_si256(jj, vseed), 4)), 4);
+        h1 = _mm256_i32gather_epi32(permute, _mm256_add_epi32(_mm256_and_si256(_mm256_add_epi32(ii, i1), byte),
+          _mm256_i32gather_epi32(permute, _mm256_xor_si256(_mm256_and_si256(_mm256_add_epi32(jj, j1), byte), vseed), 4)), 4);
+        h2 = _mm256_i32gather_epi32(permute, _mm256_add_epi32(_mm256_and_si256(_mm256_add_epi32(ii, one), byte),
+          _mm256_i32gather_epi32(permute, _mm256_xor_si256(_mm256_and_si256(_mm256_add_epi32(jj, one), byte), vseed), 4)), 4);
+        }
+
+      const __m256 nf = _mm256_add_ps(_mm256_add_ps(simplex_corner_avx2(gradients, h0, dx0, dy0), simplex_corner_avx2(gradients, h1, dx1, dy1)), simplex_corner_avx2(gradients, h2, dx2, dy2));
+      const __m256i nni = perlin_shape_avx2<mode>(_mm256_cvttps_epi32(_mm256_mul_ps(nf, _mm256_set1_ps(simplex_scale))), int32_tab);
+      __m256i row = _mm256_loadu_si256((const __m256i*)(rowp + k));
+      row = _mm256_add_epi32(row, _mm256_srai_epi32(_mm256_mullo_epi32(nni, vsi), 14));
+      _mm256_storeu_si256((__m256i*)(rowp + k), row);
+      }
+    simplex_span_scalar<mode>(rowp + k, x + k, n - k, scalex, v, permute, gradients, seed, period_mask, si, int32_tab);
+    }
+#endif
+
+  simplex_span_function get_simplex_span_function(uint32_t mode, simd_level level)
+    {
+    static const simplex_span_function scalar[4] = { &simplex_span_scalar<0>, &simplex_span_scalar<1>, &simplex_span_scalar<2>, &simplex_span_scalar<3> };
+#ifdef HEIGHTMAP_X86
+    static const simplex_span_function avx2[4] = { &simplex_span_avx2<0>, &simplex_span_avx2<1>, &simplex_span_avx2<2>, &simplex_span_avx2<3> };
+    if (level == simd_level::avx2) // there is no gather before avx2
+      return avx2[mode & 3];
+#endif
+    return scalar[mode & 3];
+    }
+
+  // Accumulates all octaves of row y, pixels [x0, x1), of simplex noise into nrow.
+  // Octave i has the same lattice scale as image_perlin: 2^i cells over the width and height rounded up to a power of 2.
+  void simplex_noise_row(const perlin_parameters& p, int32_t x0, int32_t x1, int32_t y, int32_t* nrow)
+    {
+    memset(nrow, 0, sizeof(int32_t) * (x1 - x0));
+    float s = 1.0f;
+
+    for (int32_t i = p.freq; i < p.freq + p.oct; ++i)
+      {
+      const float scalex = std::ldexp(1.0f, p.shiftx + i - 16);
+      const float v = std::ldexp((float)y, p.shifty + i - 16);
+      p.simplex_span(nrow, x0, x1 - x0, scalex, v, p.permute32, &p.context->gradients()[0][0], p.seed, p.period_mask, (int32_t)(s * 16384.0f), p.int32_tab);
+      s *= p.fadeoff;
+      }
+    }
+
+  typedef void(*noise_row_function)(const perlin_parameters& p, int32_t x0, int32_t x1, int32_t y, int32_t* nrow);
+
+  noise_row_function get_noise_row_function(image_noise_generator generator)
+    {
+    return generator == image_noise_generator::simplex ? &simplex_noise_row : &perlin_noise_row;
+    }
+
+  std::unique_ptr<image> noise_region(const perlin_context& context, image_noise_generator generator, int32_t xs, int32_t ys, int32_t x0, int32_t y0, int32_t w, int32_t h, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads)
+    {
+    if (xs < 1 || xs > max_noise_size)
+      return nullptr;
+    if (ys < 1 || ys > max_noise_size)
+      return nullptr;
+    if (w < 1 || h < 1)
+      return nullptr;
+    if (x0 < 0 || y0 < 0 || x0 > xs - w || y0 > ys - h)
+      return nullptr;
+    std::unique_ptr<image> bm = std::make_unique<image>();
+    bm->init(w, h, format);
+    const int32_t bpp = bm->bytes_per_pixel();
+
+    std::unique_ptr<perlin_parameters> p = std::make_unique<perlin_parameters>();
+    init_perlin_parameters(*p, context, xs, ys, freq, oct, fadeoff, seed, m);
+    perlin_resolve_parameters r;
+    init_perlin_resolve_parameters(r, m, amp, gamma, col0, col1);
+    const noise_row_function noise_row = get_noise_row_function(generator);
+
+    parallel_for_rows(h, nr_of_threads, [&](int32_t r0, int32_t r1)
+      {
+      int32_t* nrow = new int32_t[w];
+      for (int32_t y = r0; y < r1; ++y)
+        {
+        noise_row(*p, x0, x0 + w, y0 + y, nrow);
+        perlin_resolve_row(r, nrow, (uint8_t*)bm->data() + (size_t)y * w * bpp, w, format);
         }
-      vx = range7fff((((vx) * (dist >> 4)) >> (20 - shiftx)) + 0x4000) - 0x4000;
-      vy = range7fff((((vy) * (dist >> 4)) >> (20 - shifty)) + 0x4000) - 0x4000;
-      vz = 0;
+      delete[] nrow;
+      });
+
+    return bm;
+    }
+
+  } // namespace
+
+std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1)
+  {
+  return image_perlin(default_perlin_context(), xs, ys, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, image_format::rgba16, 1);
+  }
+
+std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads)
+  {
+  return image_perlin(default_perlin_context(), xs, ys, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, image_format::rgba16, nr_of_threads);
+  }
+
+std::unique_ptr<image> image_perlin(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads)
+  {
+  return image_perlin_region(context, xs, ys, 0, 0, xs, ys, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, format, nr_of_threads);
+  }
+
+std::unique_ptr<image> image_perlin_region(int32_t xs, int32_t ys, int32_t x0, int32_t y0, int32_t w, int32_t h, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads)
+  {
+  return image_perlin_region(default_perlin_context(), xs, ys, x0, y0, w, h, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, image_format::rgba16, nr_of_threads);
+  }
+
+std::unique_ptr<image> image_perlin_region(const perlin_context& context, int32_t xs, int32_t ys, int32_t x0, int32_t y0, int32_t w, int32_t h, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads)
+  {
+  return noise_region(context, image_noise_generator::perlin, xs, ys, x0, y0, w, h, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, format, nr_of_threads);
+  }
+
+bool image_noise_stream(const perlin_context& context, image_noise_generator generator, std::unique_ptr<image>& dest, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t band_height, int32_t nr_of_threads)
+  {
+  if (!dest || band_height < 1)
+    return false;
+  const int32_t xs = dest->width();
+  const int32_t ys = dest->height();
+  const size_t row_bytes = (size_t)xs * dest->bytes_per_pixel();
+  for (int32_t y0 = 0; y0 < ys; y0 += band_height)
+    {
+    // the band is an exact window of the full map, and its buffer goes back to the pool for the next band
+    const int32_t h = std::min(band_height, ys - y0);
+    std::unique_ptr<image> band = noise_region(context, generator, xs, ys, 0, y0, xs, h, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, dest->format(), nr_of_threads);
+    if (!band)
+      return false;
+    dest->advise(image_access::sequential, y0, y0 + h);
+    memcpy((uint8_t*)dest->data() + (size_t)y0 * row_bytes, band->data(), (size_t)h * row_bytes);
+    dest->advise(image_access::dontneed, y0, y0 + h);
+    }
+  return true;
+  }
+
+bool image_perlin_stream(const perlin_context& context, std::unique_ptr<image>& dest, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t band_height, int32_t nr_of_threads)
+  {
+  return image_noise_stream(context, image_noise_generator::perlin, dest, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, band_height, nr_of_threads);
+  }
+
+std::unique_ptr<image> image_simplex(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1)
+  {
+  return image_simplex(default_perlin_context(), xs, ys, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, image_format::rgba16, 1);
+  }
+
+std::unique_ptr<image> image_simplex(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads)
+  {
+  return noise_region(context, image_noise_generator::simplex, xs, ys, 0, 0, xs, ys, freq, oct, fadeoff, seed, m, amp, gamma, col0, col1, format, nr_of_threads);
+  }
+
+std::unique_ptr<image_perlin_noise> image_perlin_synthesize(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, int32_t nr_of_threads)
+  {
+  return image_noise_synthesize(default_perlin_context(), image_noise_generator::perlin, xs, ys, freq, oct, fadeoff, seed, m, nr_of_threads);
+  }
+
+std::unique_ptr<image_perlin_noise> image_perlin_synthesize(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, int32_t nr_of_threads)
+  {
+  return image_noise_synthesize(context, image_noise_generator::perlin, xs, ys, freq, oct, fadeoff, seed, m, nr_of_threads);
+  }
+
+std::unique_ptr<image_perlin_noise> image_noise_synthesize(const perlin_context& context, image_noise_generator generator, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode m, int32_t nr_of_threads)
+  {
+  if (xs < 1 || xs > max_noise_size)
+    return nullptr;
+  if (ys < 1 || ys > max_noise_size)
+    return nullptr;
+  std::unique_ptr<image_perlin_noise> noise = std::make_unique<image_perlin_noise>();
+  noise->width = xs;
+  noise->height = ys;
+  noise->frequency = freq;
+  noise->octaves = oct;
+  noise->fadeoff = fadeoff;
+  noise->seed = seed;
+  noise->mode = m;
+  noise->generator = generator;
+  noise->table_seed = context.table_seed();
+  noise->period_bits = context.period_bits();
+  noise->data.resize((size_t)xs * (size_t)ys);
+
+  std::unique_ptr<perlin_parameters> p = std::make_unique<perlin_parameters>();
+  init_perlin_parameters(*p, context, xs, ys, freq, oct, fadeoff, seed, m);
+  const noise_row_function noise_row = get_noise_row_function(generator);
+
+  parallel_for_rows(ys, nr_of_threads, [&](int32_t r0, int32_t r1)
+    {
+    for (int32_t y = r0; y < r1; ++y)
+      noise_row(*p, 0, xs, y, noise->data.data() + (size_t)y * xs);
+    });
+
+  return noise;
+  }
+
+bool image_perlin_noise::matches(const perlin_context& context, image_noise_generator gen, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fade, int32_t s, image_perlin_mode m) const
+  {
+  return table_seed == context.table_seed() && period_bits == context.period_bits() && generator == gen && width == xs && height == ys && frequency == freq && octaves == oct && fadeoff == fade && seed == s && mode == m;
+  }
+
+std::unique_ptr<image> image_perlin_resolve(const image_perlin_noise& noise, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads)
+  {
+  return image_perlin_resolve(noise, amp, gamma, col0, col1, image_format::rgba16, nr_of_threads);
+  }
+
+std::unique_ptr<image> image_perlin_resolve(const image_perlin_noise& noise, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads)
+  {
+  std::unique_ptr<image> bm = std::make_unique<image>();
+  bm->init(noise.width, noise.height, format);
+  const int32_t bpp = bm->bytes_per_pixel();
 
-      if (mode & 1)
+  perlin_resolve_parameters r;
+  init_perlin_resolve_parameters(r, noise.mode, amp, gamma, col0, col1);
+
+  parallel_for_rows(noise.height, nr_of_threads, [&](int32_t r0, int32_t r1)
+    {
+    for (int32_t y = r0; y < r1; ++y)
+      perlin_resolve_row(r, noise.data.data() + (size_t)y * noise.width, (uint8_t*)bm->data() + (size_t)y * noise.width * bpp, noise.width, format);
+    });
+
+  return bm;
+  }
+
+void image_init()
+  {
+  default_perlin_context();
+  }
+
+namespace
+  {
+  inline int32_t normal_sample(const uint16_t* p)
+    {
+    return *p;
+    }
+
+  inline int32_t normal_sample(const float* p)
+    {
+    // floats are sampled as 15 bit values, so that all formats share the fixed point filters below
+    return float_to_value_7fff(*p);
+    }
+
+  // T is uint16_t for the 16 bit formats, with the height in the first of c channels, or float for gray32f.
+  template <class T>
+  void normals_view(const image_view& v, int32_t c, int32_t dist, uint32_t mode, uint16_t* d)
+    {
+    int32_t vx, vy, vz;
+    float e;
+    const int32_t xs = v.image_width();
+    const int32_t ys = v.image_height();
+    const int32_t shiftx = get_power_2(xs);
+    const int32_t shifty = get_power_2(ys);
+    const int32_t bpp = get_bytes_per_pixel(v.format());
+    // neighbours wrap around the image, also when they are outside the view
+    auto image_row = [&](int32_t py)
+      {
+      py = (int32_t)positive_modulo(py, ys);
+      return (const T*)(v.data() + ((int64_t)(py - v.y0()) * v.stride() - v.x0()) * bpp);
+      };
+
+    for (int32_t y = 0; y < v.height(); y++)
+      {
+      const int32_t py = v.y0() + y;
+      const T* r0 = image_row(py - 2);
+      const T* r1 = image_row(py - 1);
+      const T* r2 = image_row(py);
+      const T* r3 = image_row(py + 1);
+      for (int32_t x = 0; x < v.width(); x++)
         {
-        vz = (0x3fff * 0x3fff) - vx * vx - vy * vy;
-        if (vz > 0)
+        const int32_t px = v.x0() + x;
+        const int32_t xm1 = positive_modulo(px - 1, xs) * c;
+        const int32_t xc = px * c;
+        if (mode & 4)
+          {
+          vx = 4 * (normal_sample(r2 + xm1) - normal_sample(r2 + xc));
+          vy = 4 * (normal_sample(r1 + xc) - normal_sample(r2 + xc));
+          }
+        else
+          {
+          const int32_t xm2 = positive_modulo(px - 2, xs) * c;
+          const int32_t xp1 = positive_modulo(px + 1, xs) * c;
+          vx = normal_sample(r2 + xm2) * 1 + normal_sample(r2 + xm1) * 3 - normal_sample(r2 + xc) * 3 - normal_sample(r2 + xp1) * 1;
+          vy = normal_sample(r0 + xc) * 1 + normal_sample(r1 + xc) * 3 - normal_sample(r2 + xc) * 3 - normal_sample(r3 + xc) * 1;
+          }
+        vx = range7fff((((vx) * (dist >> 4)) >> (20 - shiftx)) + 0x4000) - 0x4000;
+        vy = range7fff((((vy) * (dist >> 4)) >> (20 - shifty)) + 0x4000) - 0x4000;
+        vz = 0;
+
+        if (mode & 1)
           {
-          vz = std::sqrt(vz);
+          vz = (0x3fff * 0x3fff) - vx * vx - vy * vy;
+          if (vz > 0)
+            {
+            vz = std::sqrt(vz);
+            }
+          else
+            {
+            e = 1.f / std::sqrt(vx * vx + vy * vy) * 0x3fff;
+            vx *= e;
+            vy *= e;
+            vz = 0;
+            }
           }
-        else
+        if (mode & 2)
           {
-          e = 1.f / std::sqrt(vx * vx + vy * vy) * 0x3fff;
-          vx *= e;
-          vy *= e;
-          vz = 0;
+          std::swap(vx, vy);
+          vy = -vy;
           }
-        }
-      if (mode & 2)
-        {
-        std::swap(vx, vy);
-        vy = -vy;
-        }
 
-      d[0] = vx + 0x4000;
-      d[1] = vy + 0x4000;
-      d[2] = vz + 0x4000;
-      d[3] = 0xffff;
+        d[0] = vx + 0x4000;
+        d[1] = vy + 0x4000;
+        d[2] = vz + 0x4000;
+        d[3] = 0xffff;
 
-      d += 4;
-      sy += 4;
+        d += 4;
+        }
       }
-    sx += xs * 4;
+    }
+  }
+
+std::unique_ptr<image> image_normals(const std::unique_ptr<image>& im, float dist, image_normals_mode m)
+  {
+  return image_normals(image_view(im), dist, m);
+  }
+
+std::unique_ptr<image> image_normals(const image_view& v, float _dist, image_normals_mode m)
+  {
+  std::unique_ptr<image> bm = std::make_unique<image>();
+  bm->init(v.width(), v.height());
+  const int32_t dist = (int32_t)(_dist * 65536.0f);
+  const uint32_t mode = static_cast<uint32_t>(m);
+  uint16_t* d = (uint16_t*)bm->data();
+  switch (v.format())
+    {
+    case image_format::rgba16: normals_view<uint16_t>(v, 4, dist, mode, d); break;
+    case image_format::gray16: normals_view<uint16_t>(v, 1, dist, mode, d); break;
+    case image_format::gray32f: normals_view<float>(v, 1, dist, mode, d); break;
     }
   return bm;
   }
 
+bool image_normals_stream(const std::unique_ptr<image>& heightmap, std::unique_ptr<image>& dest, float dist, image_normals_mode mode, int32_t band_height)
+  {
+  if (!heightmap || !dest || band_height < 1 || dest->format() != image_format::rgba16 || dest->width() != heightmap->width() || dest->height() != heightmap->height())
+    return false;
+  const size_t row_bytes = (size_t)dest->width() * dest->bytes_per_pixel();
+  for (int32_t y0 = 0; y0 < dest->height(); y0 += band_height)
+    {
+    const int32_t h = std::min(band_height, dest->height() - y0);
+    // the band reads the rows next to it as well, the last of them is read again by the next band
+    heightmap->advise(image_access::willneed, y0 - 1, y0 + h + 1);
+    std::unique_ptr<image> band = image_normals(image_view(heightmap, 0, y0, heightmap->width(), h), dist, mode);
+    dest->advise(image_access::sequential, y0, y0 + h);
+    memcpy((uint8_t*)dest->data() + (size_t)y0 * row_bytes, band->data(), (size_t)h * row_bytes);
+    dest->advise(image_access::dontneed, y0, y0 + h);
+    heightmap->advise(image_access::dontneed, y0 - 1, y0 + h - 1);
+    }
+  return true;
+  }
+
 std::unique_ptr<image> image_gradient(int32_t xs, int32_t ys, uint32_t col0, uint32_t col1, float posf, float a, float length, image_gradient_mode m)
   {
   if (xs < 1)
@@ -829,145 +2963,734 @@ std::unique_ptr<image> image_gradient(int32_t xs, int32_t ys, uint32_t col0, uin
   return bm;
   }
 
-void image_glow_rect(std::unique_ptr<image>& im, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags fl)
+namespace
   {
-  uint64_t* d;
-  int32_t x, y;
-  float a;
-  int32_t f, fm;
-  uint64_t col;
-  float fx, fy, thresh;
-  int32_t low_table[32];
-  uint32_t flags = static_cast<uint32_t>(fl);
-
-  bool circular = (flags & 2) == 0;
+  // The tables of image_glow_rect, and the centers of the glows: the glow itself and its wrapped copies.
+  struct glow_rect_parameters
+    {
+    std::vector<std::pair<float, float>> centers; // in pixels, in the order in which the glows are applied
+    float rx, ry, sx, sy;
+    bool circular;
+    uint64_t col;
+    int32_t gamma_table[1025];
+    int32_t low_table[32];
+    };
 
-  if (wrap == image_glow_rect_wrap::on)
+  void add_glow_rect_centers(std::vector<std::pair<float, float>>& centers, float cx, float cy, float rx, float ry, float sx, float sy, image_glow_rect_wrap wrap)
     {
-    if (cx + rx + sx > 1.0f)
-      image_glow_rect(im, cx - 1.0f, cy, rx, ry, sx, sy, color, alpha, power, image_glow_rect_wrap::vertical, fl);
-    if (cx - rx - sx < -0.0f)
-      image_glow_rect(im, cx + 1.0f, cy, rx, ry, sx, sy, color, alpha, power, image_glow_rect_wrap::vertical, fl);
+    if (wrap == image_glow_rect_wrap::on)
+      {
+      if (cx + rx + sx > 1.0f)
+        add_glow_rect_centers(centers, cx - 1.0f, cy, rx, ry, sx, sy, image_glow_rect_wrap::vertical);
+      if (cx - rx - sx < -0.0f)
+        add_glow_rect_centers(centers, cx + 1.0f, cy, rx, ry, sx, sy, image_glow_rect_wrap::vertical);
+      }
+    if (wrap == image_glow_rect_wrap::on || wrap == image_glow_rect_wrap::vertical)
+      {
+      if (cy + ry + sy > 1.0f)
+        add_glow_rect_centers(centers, cx, cy - 1.0f, rx, ry, sx, sy, image_glow_rect_wrap::repeat);
+      if (cy - ry - sy < -0.0f)
+        add_glow_rect_centers(centers, cx, cy + 1.0f, rx, ry, sx, sy, image_glow_rect_wrap::repeat);
+      }
+    centers.emplace_back(cx, cy);
     }
-  if (wrap == image_glow_rect_wrap::on || wrap == image_glow_rect_wrap::vertical)
+
+  void init_glow_rect_parameters(glow_rect_parameters& g, int32_t width, int32_t height, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags fl)
     {
-    if (cy + ry + sy > 1.0f)
-      image_glow_rect(im, cx, cy - 1.0f, rx, ry, sx, sy, color, alpha, power, image_glow_rect_wrap::repeat, fl);
-    if (cy - ry - sy < -0.0f)
-      image_glow_rect(im, cx, cy + 1.0f, rx, ry, sx, sy, color, alpha, power, image_glow_rect_wrap::repeat, fl);
-    }
+    uint32_t flags = static_cast<uint32_t>(fl);
+    g.circular = (flags & 2) == 0;
+
+    g.centers.clear();
+    add_glow_rect_centers(g.centers, cx, cy, rx, ry, sx, sy, wrap);
+    for (auto& c : g.centers)
+      {
+      c.first *= width;
+      c.second *= height;
+      }
 
-  if (power == 0)
-    power = (1.0f / 65536.0f);
-  power = 0.25 / power;
+    if (power == 0)
+      power = (1.0f / 65536.0f);
+    power = 0.25 / power;
 
-  cx *= im->width();
-  cy *= im->height();
-  rx *= im->width();
-  ry *= im->height();
-  sx *= im->width();
-  sy *= im->height();
+    rx *= width;
+    ry *= height;
+    g.sx = sx * width;
+    g.sy = sy * height;
 
-  int32_t icx = cx, icy = cy, isx = sx, isy = sy;
+    float thresh = 1.0f / 65536.0f;
+    if (rx < thresh)
+      rx = thresh;
+    g.rx = g.circular ? 1.0f / (rx * rx) : 1.0f / rx;
 
-  thresh = 1.0f / 65536.0f;
-  if (rx < thresh)
-    rx = thresh;
-  rx = circular ? 1.0f / (rx * rx) : 1.0f / rx;
+    if (ry < thresh)
+      ry = thresh;
+    g.ry = g.circular ? 1.0f / (ry * ry) : 1.0f / ry;
 
-  if (ry < thresh)
-    ry = thresh;
-  ry = circular ? 1.0f / (ry * ry) : 1.0f / ry;
+    alpha *= 32768.0f;
+    g.col = get_color_64(color);
 
-  alpha *= 32768.0f;
-  col = get_color_64(color);
-  fm = alpha;
-  int32_t gamma_table[1025];
+    for (int32_t x = 0; x < 1025; ++x)
+      {
+      if (flags & 1)
+        g.gamma_table[x] = range7fff(std::pow(1.0f - x / 1024.0f, power) * alpha) * 2;
+      else
+        g.gamma_table[x] = range7fff((1.0f - std::pow(x / 1024.0f, power * 2.0f)) * alpha) * 2;
+      }
 
-  for (x = 0; x < 1025; ++x)
-    {
-    if (flags & 1)
-      gamma_table[x] = range7fff(std::pow(1.0f - x / 1024.0f, power) * alpha) * 2;
-    else
-      gamma_table[x] = range7fff((1.0f - std::pow(x / 1024.0f, power * 2.0f)) * alpha) * 2;
+    // there are very steep slopes around 0, so don't try approximating them
+    for (int32_t x = 0; x < 32; ++x)
+      {
+      if (flags & 1)
+        g.low_table[x] = range7fff(std::pow(1.0f - x / 32768.0f, power) * alpha) * 2;
+      else
+        g.low_table[x] = range7fff((1.0f - std::pow(x / 32768.0f, power * 2.0f)) * alpha) * 2;
+      }
     }
 
-  // there are very steep slopes around 0, so don't try approximating them
-  for (x = 0; x < 32; ++x)
+  // Applies all glows to the pixels [p0, p1) of a width pixels wide image, counted row by row. data points to pixel p0.
+  void glow_rect_span(const glow_rect_parameters& g, image_format format, void* data, int32_t width, int64_t p0, int64_t p1)
     {
-    if (flags & 1)
-      low_table[x] = range7fff(std::pow(1.0f - x / 32768.0f, power) * alpha) * 2;
-    else
-      low_table[x] = range7fff((1.0f - std::pow(x / 32768.0f, power * 2.0f)) * alpha) * 2;
-    }
+    for (const auto& center : g.centers)
+      {
+      const float cx = center.first;
+      const float cy = center.second;
 
-  d = im->data();
+      // calls fade_pixel(index, f) for every pixel that the glow touches
+      auto glow = [&](auto fade_pixel)
+        {
+        int64_t p = p0;
+        while (p < p1)
+          {
+          const int32_t y = (int32_t)(p / width);
+          const int32_t x0 = (int32_t)(p - (int64_t)y * width);
+          const int32_t x1 = (int32_t)std::min<int64_t>(width, x0 + (p1 - p));
+          float fy = std::abs(y - cy) - g.sy;
+          if (fy < 0)
+            fy = 0;
+          fy *= g.circular ? fy * g.ry : g.ry;
+
+          for (int32_t x = x0; x < x1; ++x)
+            {
+            float fx = std::abs(x - cx) - g.sx;
+            if (fx < 0)
+              fx = 0;
 
-  for (y = 0; y < im->height(); ++y)
-    {
-    fy = std::abs(y - cy) - sy;
-    if (fy < 0)
-      fy = 0;
-    fy *= circular ? fy * ry : ry;
+            float a = g.circular ? fx * fx * g.rx + fy : std::max(fx * g.rx, fy);
+            if (a < 1.0f - 1.0f / 32768.0f) // to cull a few more pixels...
+              {
+              int32_t f = (int32_t)(a * 32768);
+              if (f < 32)
+                f = g.low_table[f];
+              else
+                f = get_gamma(f, g.gamma_table);
 
-    for (x = 0; x < im->width(); ++x)
-      {
-      fx = std::abs(x - cx) - sx;
-      if (fx < 0)
-        fx = 0;
+              fade_pixel(p - p0 + (x - x0), f);
+              }
+            }
+          p += x1 - x0;
+          }
+        };
 
-      a = circular ? fx * fx * rx + fy : std::max(fx * rx, fy);
-      if (a < 1.0f - 1.0f / 32768.0f) // to cull a few more pixels...
+      switch (format)
         {
-        f = (int32_t)(a * 32768);
-        if (f < 32)
-          f = low_table[f];
-        else
-          f = get_gamma(f, gamma_table);
-
-        fade_64(*d, *d, col, f);
+        case image_format::rgba16:
+        {
+        uint64_t* d = (uint64_t*)data;
+        uint64_t col = g.col;
+        glow([&](int64_t i, int32_t fade) { fade_64(d[i], d[i], col, fade); });
+        break;
+        }
+        case image_format::gray16:
+        {
+        uint16_t* d16 = (uint16_t*)data;
+        const uint16_t col16 = (uint16_t)(g.col & 0xffff);
+        glow([&](int64_t i, int32_t fade) { d16[i] = fade_16(d16[i], col16, fade); });
+        break;
+        }
+        case image_format::gray32f:
+        {
+        float* df = (float*)data;
+        const float colf = value_7fff_to_float(g.col & 0xffff);
+        glow([&](int64_t i, int32_t fade) { df[i] += (colf - df[i]) * (fade / 65536.0f); });
+        break;
+        }
         }
-
-      ++d;
       }
     }
   }
 
+void image_glow_rect(std::unique_ptr<image>& im, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags fl)
+  {
+  std::unique_ptr<glow_rect_parameters> g = std::make_unique<glow_rect_parameters>();
+  init_glow_rect_parameters(*g, im->width(), im->height(), cx, cy, rx, ry, sx, sy, color, alpha, power, wrap, fl);
+  glow_rect_span(*g, im->format(), im->data(), im->width(), 0, (int64_t)im->width() * im->height());
+  }
+
+void image_glow_rect(const image_view& v, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags fl)
+  {
+  if (v.empty())
+    return;
+  std::unique_ptr<glow_rect_parameters> g = std::make_unique<glow_rect_parameters>();
+  init_glow_rect_parameters(*g, v.image_width(), v.image_height(), cx, cy, rx, ry, sx, sy, color, alpha, power, wrap, fl);
+  for (int32_t y = 0; y < v.height(); ++y)
+    {
+    const int64_t p0 = (int64_t)(v.y0() + y) * v.image_width() + v.x0();
+    glow_rect_span(*g, v.format(), v.row(y), v.image_width(), p0, p0 + v.width());
+    }
+  }
+
 std::unique_ptr<image> image_merge(image_merge_mode mode, int32_t count, const std::unique_ptr<image>* i0, ...)
   {
   if (i0 == nullptr)
     return nullptr;
+  std::vector<const image*> images;
+  images.reserve(std::max<int32_t>(count, 1));
+  images.push_back(i0->get());
   va_list args;
   va_start(args, i0);
-  const std::unique_ptr<image>* ii;
-  int i;
-  for (i = 1; i < count; ++i)
+  for (int32_t i = 1; i < count; ++i)
     {
-    ii = va_arg(args, const std::unique_ptr<image>*);
+    const std::unique_ptr<image>* ii = va_arg(args, const std::unique_ptr<image>*);
     if (ii == nullptr)
+      {
+      va_end(args);
       return nullptr;
-    if ((*i0)->width() != (*ii)->width() || (*i0)->height() != (*ii)->height())
-      return nullptr;
+      }
+    images.push_back(ii->get());
     }
   va_end(args);
+  return image_merge(mode, images.data(), (int32_t)images.size(), 1);
+  }
 
-  std::unique_ptr<image> im_out = (*i0)->copy();
+std::unique_ptr<image> image_merge(image_merge_mode mode, const image* const* images, int32_t count, int32_t nr_of_threads)
+  {
+  if (count < 1 || images[0] == nullptr)
+    return nullptr;
+  std::unique_ptr<image> im_out = std::make_unique<image>();
+  im_out->init(images[0]->width(), images[0]->height(), images[0]->format());
+  if (!image_merge(im_out, mode, images, count, nr_of_threads))
+    return nullptr;
+  return im_out;
+  }
 
-  va_start(args, i0);
-  i = 1;
-  while (i < count)
+bool image_merge(std::unique_ptr<image>& dest, image_merge_mode mode, const image* const* images, int32_t count, int32_t nr_of_threads)
+  {
+  if (!dest || count < 1)
+    return false;
+  for (int32_t i = 0; i < count; ++i)
     {
-    ii = va_arg(args, const std::unique_ptr<image>*);
-    image_inner(im_out->data(), (*ii)->data(), im_out->size(), static_cast<uint32_t>(mode));
-    ++i;
+    if (images[i] == nullptr)
+      return false;
+    if (images[i]->width() != dest->width() || images[i]->height() != dest->height() || images[i]->format() != dest->format())
+      return false;
     }
-  va_end(args);
-  return im_out;
+  const image_format format = dest->format();
+  const int64_t size = (int64_t)dest->width() * dest->height();
+  const int32_t tiles = (int32_t)((size + tile_pixels - 1) / tile_pixels);
+  const int32_t bpp = get_bytes_per_pixel(format);
+
+  parallel_for_rows(tiles, nr_of_threads, [&](int32_t t0, int32_t t1)
+    {
+    // all inputs are combined in a scratch tile, so dest may be any of the inputs
+    std::vector<uint64_t> tile(((size_t)tile_pixels * bpp + 7) / 8);
+    for (int32_t t = t0; t < t1; ++t)
+      {
+      const int64_t p0 = (int64_t)t * tile_pixels;
+      const int32_t n = (int32_t)std::min<int64_t>(tile_pixels, size - p0);
+      memcpy(tile.data(), (const uint8_t*)images[0]->data() + p0 * bpp, (size_t)n * bpp);
+      for (int32_t i = 1; i < count; ++i)
+        {
+        const uint64_t* src = (const uint64_t*)((const uint8_t*)images[i]->data() + p0 * bpp);
+        switch (format)
+          {
+          case image_format::rgba16:
+            image_inner(tile.data(), src, n, static_cast<uint32_t>(mode));
+            break;
+          case image_format::gray16:
+            // the buffers are padded to whole uint64_t's, so the 4 channel kernel can run over 4 gray pixels at a time
+            image_inner(tile.data(), src, (n + 3) / 4, static_cast<uint32_t>(mode));
+            break;
+          case image_format::gray32f:
+            image_inner_float((float*)tile.data(), (const float*)src, n, mode);
+            break;
+          }
+        }
+      memcpy((uint8_t*)dest->data() + p0 * bpp, tile.data(), (size_t)n * bpp);
+      }
+    });
+  return true;
+  }
+
+bool image_merge(std::unique_ptr<image>& dest, image_merge_mode mode, const std::vector<const image*>& images, int32_t nr_of_threads)
+  {
+  return image_merge(dest, mode, images.data(), (int32_t)images.size(), nr_of_threads);
+  }
+
+std::unique_ptr<image> image_merge(image_merge_mode mode, const std::vector<const image*>& images, int32_t nr_of_threads)
+  {
+  return image_merge(mode, images.data(), (int32_t)images.size(), nr_of_threads);
+  }
+
+bool image_merge(const image_view& dest, image_merge_mode mode, const image_view& src)
+  {
+  if (dest.width() != src.width() || dest.height() != src.height() || dest.format() != src.format())
+    return false;
+  if (dest.format() == image_format::gray32f)
+    {
+    for (int32_t y = 0; y < dest.height(); ++y)
+      image_inner_float((float*)dest.row(y), (const float*)src.row(y), dest.width(), mode);
+    }
+  else
+    for_each_view_row(dest, &src, [&](uint64_t* d, const uint64_t* s, int32_t words) { image_inner(d, s, words, static_cast<uint32_t>(mode)); });
+  return true;
   }
 
 void image_color(std::unique_ptr<image>& im, image_color_mode mode, uint32_t color)
   {
   int32_t inner_mode = static_cast<uint32_t>(mode) + MERGEMODE_COLOR_MODES + 1;
-  uint64_t color64 = get_color_64(color);
-  image_inner(im->data(), &color64, im->size(), inner_mode);
-  }
\ No newline at end of file
+  uint64_t color64 = color_word(color, im->format());
+  switch (im->format())
+    {
+    case image_format::rgba16:
+      image_inner(im->data(), &color64, im->size(), inner_mode);
+      break;
+    case image_format::gray16:
+      if (mode == image_color_mode::gray)
+        break;
+      image_inner(im->data(), &color64, (im->size() + 3) / 4, inner_mode);
+      break;
+    case image_format::gray32f:
+      image_color_float((float*)im->data(), im->size(), mode, value_7fff_to_float(color64 & 0xffff));
+      break;
+    }
+  }
+
+void image_color(const image_view& v, image_color_mode mode, uint32_t color)
+  {
+  int32_t inner_mode = static_cast<uint32_t>(mode) + MERGEMODE_COLOR_MODES + 1;
+  uint64_t color64 = color_word(color, v.format());
+  switch (v.format())
+    {
+    case image_format::rgba16:
+    case image_format::gray16:
+      if (v.format() == image_format::gray16 && mode == image_color_mode::gray)
+        break;
+      for_each_view_row(v, nullptr, [&](uint64_t* d, const uint64_t*, int32_t words) { image_inner(d, &color64, words, inner_mode); });
+      break;
+    case image_format::gray32f:
+      for (int32_t y = 0; y < v.height(); ++y)
+        image_color_float((float*)v.row(y), v.width(), mode, value_7fff_to_float(color64 & 0xffff));
+      break;
+    }
+  }
+
+
+namespace
+  {
+  // table[(y >> (15 - y_bits)) << x_bits | (x >> (15 - x_bits))] for n pixels, reading x and y from the first 16 bit channel of every x_step / y_step
+  void lookup_span_scalar(uint64_t* d, const uint16_t* x, int32_t x_step, const uint16_t* y, int32_t y_step, int32_t n, const uint64_t* table, int32_t x_bits, int32_t y_bits)
+    {
+    const int32_t x_shift = 15 - x_bits;
+    const int32_t y_shift = 15 - y_bits;
+    for (int32_t i = 0; i < n; ++i)
+      {
+      d[i] = table[(((*y & 0x7fff) >> y_shift) << x_bits) | ((*x & 0x7fff) >> x_shift)];
+      x += x_step;
+      y += y_step;
+      }
+    }
+
+#ifdef HEIGHTMAP_X86
+  // Same as lookup_span_scalar for gray16 x and y, 8 pixels at a time with 2 gathers of 4 entries.
+  HEIGHTMAP_TARGET_AVX2 void lookup_span_avx2(uint64_t* d, const uint16_t* x, const uint16_t* y, int32_t n, const uint64_t* table, int32_t x_bits, int32_t y_bits)
+    {
+    const __m256i mask = _mm256_set1_epi32(0x7fff);
+    const __m128i x_shift = _mm_cvtsi32_si128(15 - x_bits);
+    const __m128i y_shift = _mm_cvtsi32_si128(15 - y_bits);
+    const __m128i y_bits_shift = _mm_cvtsi32_si128(x_bits);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+      {
+      const __m256i xi = _mm256_srl_epi32(_mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(x + i))), mask), x_shift);
+      const __m256i yi = _mm256_srl_epi32(_mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(y + i))), mask), y_shift);
+      const __m256i index = _mm256_or_si256(_mm256_sll_epi32(yi, y_bits_shift), xi);
+      _mm256_storeu_si256((__m256i*)(d + i), _mm256_i32gather_epi64((const long long*)table, _mm256_castsi256_si128(index), 8));
+      _mm256_storeu_si256((__m256i*)(d + i + 4), _mm256_i32gather_epi64((const long long*)table, _mm256_extracti128_si256(index, 1), 8));
+      }
+    lookup_span_scalar(d + i, x + i, 1, y + i, 1, n - i, table, x_bits, y_bits);
+    }
+#endif
+  }
+
+std::unique_ptr<image> image_lookup(const std::unique_ptr<image>& im_x, const std::unique_ptr<image>& im_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, int32_t nr_of_threads)
+  {
+  if (!im_x || !im_y)
+    return nullptr;
+  std::unique_ptr<image> im_out = std::make_unique<image>();
+  im_out->init(im_x->width(), im_x->height());
+  if (!image_lookup(image_view(im_x), image_view(im_y), table, x_bits, y_bits, image_view(im_out), nr_of_threads))
+    return nullptr;
+  return im_out;
+  }
+
+bool image_lookup(const image_view& v_x, const image_view& v_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, const image_view& dest, int32_t nr_of_threads)
+  {
+  if (v_x.width() != v_y.width() || v_x.height() != v_y.height() || v_x.width() != dest.width() || v_x.height() != dest.height())
+    return false;
+  if (v_x.format() == image_format::gray32f || v_y.format() == image_format::gray32f || dest.format() != image_format::rgba16)
+    return false;
+  if (x_bits < 0 || y_bits < 0 || x_bits > 15 || y_bits > 15)
+    return false;
+  const int32_t x_step = v_x.format() == image_format::rgba16 ? 4 : 1;
+  const int32_t y_step = v_y.format() == image_format::rgba16 ? 4 : 1;
+  const int32_t w = dest.width();
+#ifdef HEIGHTMAP_X86
+  const bool avx2 = x_step == 1 && y_step == 1 && get_simd_level() >= simd_level::avx2;
+#endif
+  parallel_for_rows(dest.height(), nr_of_threads, [&](int32_t y0, int32_t y1)
+    {
+    for (int32_t y = y0; y < y1; ++y)
+      {
+      uint64_t* d = (uint64_t*)dest.row(y);
+      const uint16_t* xp = (const uint16_t*)v_x.row(y);
+      const uint16_t* yp = (const uint16_t*)v_y.row(y);
+#ifdef HEIGHTMAP_X86
+      if (avx2)
+        {
+        lookup_span_avx2(d, xp, yp, w, table, x_bits, y_bits);
+        continue;
+        }
+#endif
+      lookup_span_scalar(d, xp, x_step, yp, y_step, w, table, x_bits, y_bits);
+      }
+    });
+  return true;
+  }
+
+bool image_lookup_stream(const std::unique_ptr<image>& im_x, const std::unique_ptr<image>& im_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, std::unique_ptr<image>& dest, int32_t band_height, int32_t nr_of_threads)
+  {
+  if (!im_x || !im_y || !dest || band_height < 1)
+    return false;
+  for (int32_t y0 = 0; y0 < dest->height(); y0 += band_height)
+    {
+    const int32_t h = std::min(band_height, dest->height() - y0);
+    im_x->advise(image_access::willneed, y0, y0 + h);
+    im_y->advise(image_access::willneed, y0, y0 + h);
+    dest->advise(image_access::sequential, y0, y0 + h);
+    if (!image_lookup(image_view(im_x, 0, y0, im_x->width(), h), image_view(im_y, 0, y0, im_y->width(), h), table, x_bits, y_bits, image_view(dest, 0, y0, dest->width(), h), nr_of_threads))
+      return false;
+    im_x->advise(image_access::dontneed, y0, y0 + h);
+    im_y->advise(image_access::dontneed, y0, y0 + h);
+    dest->advise(image_access::dontneed, y0, y0 + h);
+    }
+  return true;
+  }
+
+namespace
+  {
+  // The color c of 15 bit channels with var added to red, green and blue, clamped to 0..0x7fff
+  inline uint64_t vary_color_64(uint64_t c, int32_t var)
+    {
+    const int32_t red = std::min(std::max((int32_t)(c & 0x7fff) + var, 0), 0x7fff);
+    const int32_t green = std::min(std::max((int32_t)((c >> 16) & 0x7fff) + var, 0), 0x7fff);
+    const int32_t blue = std::min(std::max((int32_t)((c >> 32) & 0x7fff) + var, 0), 0x7fff);
+    return ((c >> 48) & 0x7fff) << 48 | (uint64_t)blue << 32 | (uint64_t)green << 16 | (uint64_t)red;
+    }
+
+  // table[h & 0x7fff] for n pixels, varied by the first channel of every v_step'th value of v if v is not null
+  void colormap_span_scalar(uint64_t* d, const uint16_t* h, int32_t h_step, const uint16_t* v, int32_t v_step, int32_t n, const uint64_t* table, int32_t strength)
+    {
+    if (!v)
+      {
+      for (int32_t i = 0; i < n; ++i, h += h_step)
+        d[i] = table[*h & 0x7fff];
+      return;
+      }
+    const int32_t offset = 0x7fff >> (1 + strength);
+    for (int32_t i = 0; i < n; ++i, h += h_step, v += v_step)
+      d[i] = vary_color_64(table[*h & 0x7fff], ((*v & 0x7fff) >> strength) - offset);
+    }
+
+#ifdef HEIGHTMAP_X86
+  // Same as colormap_span_scalar for gray16 h and v, 8 pixels at a time with 2 gathers of 4 entries.
+  // The variation is added to the 3 color channels of a pixel with saturating 16 bit adds, which clamp like vary_color_64.
+  HEIGHTMAP_TARGET_AVX2 void colormap_span_avx2(uint64_t* d, const uint16_t* h, const uint16_t* v, int32_t n, const uint64_t* table, int32_t strength)
+    {
+    const __m256i mask = _mm256_set1_epi32(0x7fff);
+    const __m128i strength_shift = _mm_cvtsi32_si128(strength);
+    const __m256i offset = _mm256_set1_epi32(0x7fff >> (1 + strength));
+    const __m256i spread = _mm256_set1_epi64x(0x10001);
+    const __m256i rgb = _mm256_set1_epi64x(0x0000ffffffffffffll);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i maximum = _mm256_set1_epi16(0x7fff);
+    int32_t i = 0;
+    for (; i + 8 <= n; i += 8)
+      {
+      const __m256i index = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(h + i))), mask);
+      __m256i c0 = _mm256_i32gather_epi64((const long long*)table, _mm256_castsi256_si128(index), 8);
+      __m256i c1 = _mm256_i32gather_epi64((const long long*)table, _mm256_extracti128_si256(index, 1), 8);
+      if (v)
+        {
+        const __m256i vi = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(v + i))), mask);
+        const __m256i var32 = _mm256_sub_epi32(_mm256_srl_epi32(vi, strength_shift), offset);
+        // the 8 variations as 16 bit values in pixel order, then one per 64 bit pixel, copied to red, green and blue
+        const __m128i var16 = _mm_packs_epi32(_mm256_castsi256_si128(var32), _mm256_extracti128_si256(var32, 1));
+        __m256i var0 = _mm256_mul_epu32(_mm256_cvtepu16_epi64(var16), spread);
+        __m256i var1 = _mm256_mul_epu32(_mm256_cvtepu16_epi64(_mm_srli_si128(var16, 8)), spread);
+        var0 = _mm256_and_si256(_mm256_or_si256(var0, _mm256_slli_epi64(var0, 32)), rgb);
+        var1 = _mm256_and_si256(_mm256_or_si256(var1, _mm256_slli_epi64(var1, 32)), rgb);
+        c0 = _mm256_min_epi16(_mm256_max_epi16(_mm256_adds_epi16(c0, var0), zero), maximum);
+        c1 = _mm256_min_epi16(_mm256_max_epi16(_mm256_adds_epi16(c1, var1), zero), maximum);
+        }
+      _mm256_storeu_si256((__m256i*)(d + i), c0);
+      _mm256_storeu_si256((__m256i*)(d + i + 4), c1);
+      }
+    colormap_span_scalar(d + i, h + i, 1, v ? v + i : nullptr, 1, n - i, table, strength);
+    }
+#endif
+  }
+
+std::unique_ptr<image> image_colormap(const std::unique_ptr<image>& im_height, const std::unique_ptr<image>& im_variation, const uint64_t* table, int32_t variation_strength, int32_t nr_of_threads)
+  {
+  if (!im_height)
+    return nullptr;
+  std::unique_ptr<image> im_out = std::make_unique<image>();
+  im_out->init(im_height->width(), im_height->height());
+  if (!image_colormap(image_view(im_height), im_variation ? image_view(im_variation) : image_view(), table, variation_strength, image_view(im_out), nr_of_threads))
+    return nullptr;
+  return im_out;
+  }
+
+bool image_colormap(const image_view& v_height, const image_view& v_variation, const uint64_t* table, int32_t variation_strength, const image_view& dest, int32_t nr_of_threads)
+  {
+  const bool vary = !v_variation.empty();
+  if (v_height.width() != dest.width() || v_height.height() != dest.height())
+    return false;
+  if (vary && (v_variation.width() != dest.width() || v_variation.height() != dest.height() || v_variation.format() == image_format::gray32f))
+    return false;
+  if (v_height.format() == image_format::gray32f || dest.format() != image_format::rgba16)
+    return false;
+  const int32_t strength = std::min(std::max(variation_strength, 0), 15);
+  const int32_t h_step = v_height.format() == image_format::rgba16 ? 4 : 1;
+  const int32_t v_step = vary && v_variation.format() == image_format::rgba16 ? 4 : 1;
+  const int32_t w = dest.width();
+#ifdef HEIGHTMAP_X86
+  const bool avx2 = h_step == 1 && v_step == 1 && get_simd_level() >= simd_level::avx2;
+#endif
+  parallel_for_rows(dest.height(), nr_of_threads, [&](int32_t y0, int32_t y1)
+    {
+    for (int32_t y = y0; y < y1; ++y)
+      {
+      uint64_t* d = (uint64_t*)dest.row(y);
+      const uint16_t* hp = (const uint16_t*)v_height.row(y);
+      const uint16_t* vp = vary ? (const uint16_t*)v_variation.row(y) : nullptr;
+#ifdef HEIGHTMAP_X86
+      if (avx2)
+        {
+        colormap_span_avx2(d, hp, vp, w, table, strength);
+        continue;
+        }
+#endif
+      colormap_span_scalar(d, hp, h_step, vp, v_step, w, table, strength);
+      }
+    });
+  return true;
+  }
+
+bool image_colormap_stream(const std::unique_ptr<image>& im_height, const std::unique_ptr<image>& im_variation, const uint64_t* table, int32_t variation_strength, std::unique_ptr<image>& dest, int32_t band_height, int32_t nr_of_threads)
+  {
+  if (!im_height || !dest || band_height < 1)
+    return false;
+  for (int32_t y0 = 0; y0 < dest->height(); y0 += band_height)
+    {
+    const int32_t h = std::min(band_height, dest->height() - y0);
+    im_height->advise(image_access::willneed, y0, y0 + h);
+    if (im_variation)
+      im_variation->advise(image_access::willneed, y0, y0 + h);
+    dest->advise(image_access::sequential, y0, y0 + h);
+    const image_view v_variation = im_variation ? image_view(im_variation, 0, y0, im_variation->width(), h) : image_view();
+    if (!image_colormap(image_view(im_height, 0, y0, im_height->width(), h), v_variation, table, variation_strength, image_view(dest, 0, y0, dest->width(), h), nr_of_threads))
+      return false;
+    im_height->advise(image_access::dontneed, y0, y0 + h);
+    if (im_variation)
+      im_variation->advise(image_access::dontneed, y0, y0 + h);
+    dest->advise(image_access::dontneed, y0, y0 + h);
+    }
+  return true;
+  }
+
+struct image_expression::node
+  {
+  enum kind_type
+    {
+    NODE_SOURCE,
+    NODE_FLAT,
+    NODE_GLOW_RECT,
+    NODE_COLOR,
+    NODE_MERGE
+    };
+
+  kind_type kind;
+  int32_t width, height;
+  image_format format;
+  bool valid;
+  const image* im; // source
+  uint64_t color; // flat and color, as a full uint64_t of 16 bit channels
+  int32_t mode; // color and merge, one of the e_merge_mode's
+  std::shared_ptr<const glow_rect_parameters> glow;
+  std::shared_ptr<const node> a, b; // the operands
+  int32_t depth; // number of scratch tiles needed to evaluate this node
+
+  void evaluate_tile(int64_t p0, int32_t count, uint64_t* out, uint64_t* const* scratch) const;
+  };
+
+// Evaluates the pixels [p0, p0 + count) into out. scratch holds depth - 1 tiles for the operands.
+void image_expression::node::evaluate_tile(int64_t p0, int32_t count, uint64_t* out, uint64_t* const* scratch) const
+  {
+  const int32_t bpp = get_bytes_per_pixel(format);
+  const int32_t words = (int32_t)(((int64_t)count * bpp + 7) / 8);
+  switch (kind)
+    {
+    case NODE_SOURCE:
+      memcpy(out, (const uint8_t*)im->data() + p0 * bpp, (size_t)count * bpp);
+      break;
+    case NODE_FLAT:
+      std::fill(out, out + words, color);
+      break;
+    case NODE_GLOW_RECT:
+      a->evaluate_tile(p0, count, out, scratch);
+      glow_rect_span(*glow, format, out, width, p0, p0 + count);
+      break;
+    case NODE_COLOR:
+      a->evaluate_tile(p0, count, out, scratch);
+      image_inner(out, &color, words, mode);
+      break;
+    case NODE_MERGE:
+      a->evaluate_tile(p0, count, out, scratch);
+      b->evaluate_tile(p0, count, scratch[0], scratch + 1);
+      image_inner(out, scratch[0], words, mode);
+      break;
+    }
+  }
+
+image_expression::image_expression(std::shared_ptr<const node> n) : _node(n)
+  {
+  }
+
+image_expression image_expression::source(const std::unique_ptr<image>& im)
+  {
+  std::shared_ptr<node> n = std::make_shared<node>();
+  n->kind = node::NODE_SOURCE;
+  n->width = im->width();
+  n->height = im->height();
+  n->format = im->format();
+  n->valid = im->format() != image_format::gray32f;
+  n->im = im.get();
+  n->depth = 1;
+  return image_expression(n);
+  }
+
+image_expression image_expression::flat(int32_t w, int32_t h, uint32_t color, image_format format)
+  {
+  std::shared_ptr<node> n = std::make_shared<node>();
+  n->kind = node::NODE_FLAT;
+  n->width = w;
+  n->height = h;
+  n->format = format;
+  n->valid = format != image_format::gray32f;
+  n->color = color_word(color, format);
+  n->depth = 1;
+  return image_expression(n);
+  }
+
+image_expression image_expression::glow_rect(float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags flags) const
+  {
+  std::shared_ptr<glow_rect_parameters> g = std::make_shared<glow_rect_parameters>();
+  init_glow_rect_parameters(*g, _node->width, _node->height, cx, cy, rx, ry, sx, sy, color, alpha, power, wrap, flags);
+  std::shared_ptr<node> n = std::make_shared<node>(*_node);
+  n->kind = node::NODE_GLOW_RECT;
+  n->glow = g;
+  n->a = _node;
+  n->b.reset();
+  return image_expression(n);
+  }
+
+image_expression image_expression::color(image_color_mode mode, uint32_t color) const
+  {
+  if (_node->format == image_format::gray16 && mode == image_color_mode::gray) // gray has no effect on a single channel
+    return *this;
+  std::shared_ptr<node> n = std::make_shared<node>(*_node);
+  n->kind = node::NODE_COLOR;
+  n->color = color_word(color, _node->format);
+  n->mode = static_cast<uint32_t>(mode) + MERGEMODE_COLOR_MODES + 1;
+  n->a = _node;
+  n->b.reset();
+  return image_expression(n);
+  }
+
+image_expression image_expression::merge(image_merge_mode mode, const image_expression& other) const
+  {
+  std::shared_ptr<node> n = std::make_shared<node>(*_node);
+  n->kind = node::NODE_MERGE;
+  n->valid = _node->valid && other._node->valid && _node->width == other._node->width && _node->height == other._node->height && _node->format == other._node->format;
+  n->mode = static_cast<uint32_t>(mode);
+  n->a = _node;
+  n->b = other._node;
+  n->depth = std::max(_node->depth, other._node->depth + 1);
+  return image_expression(n);
+  }
+
+int32_t image_expression::width() const
+  {
+  return _node->width;
+  }
+
+int32_t image_expression::height() const
+  {
+  return _node->height;
+  }
+
+image_format image_expression::format() const
+  {
+  return _node->format;
+  }
+
+std::unique_ptr<image> image_expression::evaluate(int32_t nr_of_threads) const
+  {
+  if (!_node->valid)
+    return nullptr;
+  std::unique_ptr<image> im = std::make_unique<image>();
+  im->init(_node->width, _node->height, _node->format);
+  if (!evaluate(im, nr_of_threads))
+    return nullptr;
+  return im;
+  }
+
+bool image_expression::evaluate(std::unique_ptr<image>& dest, int32_t nr_of_threads) const
+  {
+  if (!_node->valid || !dest || dest->width() != _node->width || dest->height() != _node->height || dest->format() != _node->format)
+    return false;
+  const int64_t size = (int64_t)_node->width * _node->height;
+  const int32_t tiles = (int32_t)((size + tile_pixels - 1) / tile_pixels);
+  const int32_t bpp = get_bytes_per_pixel(_node->format);
+  const int32_t tile_words = (tile_pixels * bpp + 7) / 8;
+  const node& root = *_node;
+
+  parallel_for_rows(tiles, nr_of_threads, [&](int32_t t0, int32_t t1)
+    {
+    // the tile that is evaluated and the scratch tiles for the operands, all reused for every tile
+    std::vector<uint64_t> buffer((size_t)tile_words * root.depth);
+    std::vector<uint64_t*> scratch(root.depth);
+    for (int32_t i = 0; i < root.depth; ++i)
+      scratch[i] = buffer.data() + (size_t)i * tile_words;
+    for (int32_t t = t0; t < t1; ++t)
+      {
+      const int64_t p0 = (int64_t)t * tile_pixels;
+      const int32_t count = (int32_t)std::min<int64_t>(tile_pixels, size - p0);
+      root.evaluate_tile(p0, count, scratch[0], scratch.data() + 1);
+      // the tile is only written back after all its sources were read, so dest can be one of them
+      memcpy((uint8_t*)dest->data() + p0 * bpp, scratch[0], (size_t)count * bpp);
+      }
+    });
+  return true;
+  }
@@ -1,11 +1,26 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
 #include <memory>
+#include <vector>
 
 enum class image_format
   {
-  rgba16
+  rgba16, // 4 x 16 bit per pixel, each channel holds a 15 bit value 0..0x7fff
+  gray16, // 1 x 16 bit per pixel, same 15 bit range as one rgba16 channel
+  gray32f // 1 x 32 bit float per pixel, 0..1
+  };
+
+int32_t get_bytes_per_pixel(image_format f);
+
+enum class image_access
+  {
+  normal,
+  sequential,
+  random,
+  willneed, // the pixels are read soon
+  dontneed // the pixels are not used for a while, the os may drop them from memory, changes are kept in the file
   };
 
 class image
@@ -18,45 +33,158 @@ class image
     std::unique_ptr<image> copy() const;
 
     void init(int32_t w, int32_t h);
+    void init(int32_t w, int32_t h, image_format f);
     void init(int32_t w, int32_t h, uint64_t* data);
 
+    // Uses the file as the pixel buffer, creating it or growing it to the size of the image, so that maps larger than the
+    // memory can be worked on. Changes to the pixels end up in the file. Returns false if the file cannot be mapped.
+    bool init_mapped(const char* filename, int32_t w, int32_t h, image_format f);
+    bool mapped() const { return _mapped_bytes != 0; }
+
+    // Tells the os how the pixels of a mapped image will be accessed. Ignored for images in memory, and on Windows.
+    void advise(image_access access);
+    // The same for the rows [y0, y1) only, the streaming functions call it for every band.
+    void advise(image_access access, int32_t y0, int32_t y1);
+
     const uint64_t* data() const { return _data; }
     uint64_t* data() { return _data; }
-    int32_t size() const { return _size; }
+    int64_t size() const { return _size; }
     int32_t width() const { return _width; }
     int32_t height() const { return _height; }
     image_format format() const { return _format; }
+    int32_t bytes_per_pixel() const { return get_bytes_per_pixel(_format); }
 
+    // Only changes how the data is interpreted, the buffer is not converted or resized.
     void set_format(image_format f);
 
+  private:
+    void _release();
+
   private:
     uint64_t* _data;
     int32_t _width;
     int32_t _height;
-    int32_t _size; // width * height
+    int64_t _size; // width * height
     image_format _format;
+    size_t _capacity; // bytes of the pooled buffer, 0 for an image without pixels
+    bool _pooled; // _data comes from the buffer pool, otherwise it was mapped or allocated with new[]
+    size_t _mapped_bytes; // bytes of the file mapping, 0 if _data is in memory
   };
 
+// Returns nullptr if the file cannot be mapped, see image::init_mapped.
+std::unique_ptr<image> image_mapped(const char* filename, int32_t w, int32_t h, image_format format);
+
+// A non-owning window of width x height pixels on an image. Pixel (x, y) of the view is pixel (x0 + x, y0 + y) of the image,
+// and rows are stride pixels apart. Operations on a view only touch the pixels inside it, and give the same result there
+// as the operation on the whole image. The view must not outlive the image.
+class image_view
+  {
+  public:
+    image_view();
+    image_view(const std::unique_ptr<image>& im);
+    // the rectangle is clipped to the image
+    image_view(const std::unique_ptr<image>& im, int32_t x0, int32_t y0, int32_t w, int32_t h);
+    // a view on any buffer of w x h pixels in format f, with rows stride pixels apart
+    image_view(void* data, int32_t w, int32_t h, int32_t stride, image_format f);
+
+    uint8_t* data() const { return _data; }
+    uint8_t* row(int32_t y) const { return _data + (int64_t)y * _stride * get_bytes_per_pixel(_format); }
+    int32_t width() const { return _width; }
+    int32_t height() const { return _height; }
+    int32_t stride() const { return _stride; }
+    image_format format() const { return _format; }
+    bool empty() const { return _width <= 0 || _height <= 0; }
 
-std::unique_ptr<image> image_import(const char* filename);
+    // the position of the view in the image, and the size of the image
+    int32_t x0() const { return _x0; }
+    int32_t y0() const { return _y0; }
+    int32_t image_width() const { return _image_width; }
+    int32_t image_height() const { return _image_height; }
+
+  private:
+    uint8_t* _data; // pixel (0, 0) of the view
+    int32_t _width;
+    int32_t _height;
+    int32_t _stride;
+    int32_t _x0;
+    int32_t _y0;
+    int32_t _image_width;
+    int32_t _image_height;
+    image_format _format;
+  };
+
+// The buffers of images are 64 byte aligned and come from a pool. When an image is destroyed, its buffer is kept for
+// the next image of about the same size, so regenerating the maps reuses memory that is already mapped instead of
+// faulting in new pages. At most limit bytes of unused buffers are kept, 2 GB by default.
+void set_image_pool_limit(size_t limit);
+void clear_image_pool();
+
+
+std::unique_ptr<image> image_import(const char* filename); // rgba16
+
+// Reads 8 and 16 bit images in the formats of stb_image, and pfm, qoi and qoi16 files. 16 bit pngs and qoi16 keep their precision: gray16 keeps the 15 bits
+// that all formats have in common, gray32f all 16 bits. The gray formats take the first channel. Returns nullptr if the file cannot be read.
+std::unique_ptr<image> image_import(const char* filename, image_format format);
+
+enum class image_raw_format
+  {
+  r16, // unsigned 16 bit heights, little endian
+  r32f // 32 bit float heights in [0, 1], little endian
+  };
+
+// Reads a headerless file of w x h heights, as written by terrain tools and dem converters (.r16, .raw, .r32).
+// Floats are kept as they are for gray32f, and clamped to [0, 1] for the other formats.
+// Returns nullptr if the file cannot be read or doesn't hold exactly w x h heights.
+std::unique_ptr<image> image_import_raw(const char* filename, int32_t w, int32_t h, image_raw_format raw, image_format format);
 
 enum class image_export_filetype
   {
   png,
   jpg,
   bmp,
-  tga
+  tga,
+  // Lossless height formats. They hold the first channel, except png16 which keeps all channels of rgba16 images.
+  // 15 bit values are scaled to the full 16 bits, and read back unchanged by image_import and image_import_raw.
+  png16, // 16 bit png
+  r16, // headerless unsigned 16 bit, little endian, see image_raw_format
+  r32f, // headerless 32 bit float, little endian
+  pfm, // gray portable float map
+  // Fast lossless formats, for caching maps on disk: qoi holds the 8 bit channels of png, qoi16 the 16 bit channels of png16,
+  // with the ops of qoi (see qoi.h).
+  qoi,
+  qoi16
   };
 
 uint64_t get_color_64(uint32_t color);
 
+// Builds the default perlin_context up front. Calling it is optional: the default context is created on first use.
 void image_init();
 
+struct image_export_options
+  {
+  image_export_filetype filetype;
+  int32_t jpeg_quality; // 1 (small) to 100 (best)
+  int32_t compression_level; // of png and png16, 1 (fast) to 9 (small)
+  int32_t nr_of_threads; // png and png16 are deflated in parallel blocks if more than 1, with slightly larger files
+  };
+
+// png, png16, tga, qoi and the raw formats are converted and written in strips of rows, so they need little memory besides the image.
+// The compression level of pngs is stbi_write_png_compression_level, and they are deflated on one thread.
 bool image_export(const std::unique_ptr<image>& im, const char* filename, image_export_filetype filetype, int32_t jpeg_quality);
 
+// rows, if not null, is set to the number of rows that are written so far, so that another thread can follow the export.
+// Images can be exported at the same time on different threads.
+bool image_export(const image& im, const char* filename, const image_export_options& options, std::atomic<int32_t>* rows);
+
 std::unique_ptr<image> image_flat(int32_t width, int32_t height, uint32_t color);
+// gray formats take the red channel of color
+std::unique_ptr<image> image_flat(int32_t width, int32_t height, uint32_t color, image_format format);
+
+// Converting rgba16 to a gray format keeps the red channel, which is the channel that holds the height in heightmaps.
+std::unique_ptr<image> image_convert(const std::unique_ptr<image>& im, image_format format);
 
 bool fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, const std::unique_ptr<image>& im);
+bool fill_rgba_buffer_with_image(void* buffer, uint32_t buffer_bytes_per_row, const image_view& v);
 
 enum class image_perlin_mode
   {
@@ -66,8 +194,102 @@ enum class image_perlin_mode
   abs_plus_sin
   };
 
+// The random generator state and the permutation and gradient tables of the perlin generators.
+// A context is immutable after construction, so one context can be shared by many threads, and contexts with different table seeds
+// can generate independently of each other in the same process. The functions without context argument use default_perlin_context().
+class perlin_context
+  {
+  public:
+    typedef float gradient_table[256][2];
+
+    explicit perlin_context(uint32_t table_seed);
+    // The lattice of the generators repeats every 2^period_bits cells, period_bits being clamped to [8, max_period_bits].
+    // 8 is the classic 256 cell permutation of the single argument constructor, larger periods keep the high octaves of
+    // very wide maps from repeating. The first 256 cells are the same for all periods.
+    perlin_context(uint32_t table_seed, int32_t period_bits);
+
+    static const int32_t max_period_bits = 16;
+
+    uint32_t table_seed() const { return _table_seed; }
+    int32_t period_bits() const { return _period_bits; }
+    const uint8_t* permutation() const { return _permute; } // 512 entries, the second half repeats the first
+    const gradient_table& gradients() const { return _gradients; }
+
+  private:
+    uint32_t _table_seed;
+    int32_t _period_bits;
+    uint32_t _random_seed;
+    gradient_table _gradients;
+    uint8_t _permute[512];
+  };
+
+// The context with table seed 1, which produces the same maps as all earlier versions
+const perlin_context& default_perlin_context();
+
+// The lattice of each octave is laid out over the size rounded up to a power of 2, so power of 2 sizes tile.
+// Other sizes are the top left part of that image, but only the xs x ys pixels that are returned are computed.
 std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1);
 
+// Same as image_perlin above, but the rows are split in bands over nr_of_threads worker threads. The result is identical to the single threaded version.
+std::unique_ptr<image> image_perlin(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads);
+
+// Generates the w x h window starting at (x0, y0) of the xs x ys perlin image, without computing the rest of it.
+// The window is exactly equal to the corresponding part of image_perlin(xs, ys, ...), so tiles of a large virtual map line up without seams
+// and can be generated independently, also concurrently. The window must lie inside the virtual image, which can be up to 2^30 x 2^30.
+std::unique_ptr<image> image_perlin_region(int32_t xs, int32_t ys, int32_t x0, int32_t y0, int32_t w, int32_t h, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads);
+
+// For the gray formats the result is the red channel of the rgba16 result.
+std::unique_ptr<image> image_perlin(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads);
+std::unique_ptr<image> image_perlin_region(const perlin_context& context, int32_t xs, int32_t ys, int32_t x0, int32_t y0, int32_t w, int32_t h, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads);
+
+// Simplex style gradient noise with the same parameters and lattice scale as image_perlin.
+// Every sample blends 3 gradients instead of 4 and the triangular lattice shows fewer axis aligned artifacts,
+// but unlike image_perlin the result does not tile. It is several times slower than image_perlin, which shares the
+// gradients of a lattice cell over all of its pixels, see benchmarks/noise_benchmark.cpp.
+std::unique_ptr<image> image_simplex(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1);
+std::unique_ptr<image> image_simplex(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads);
+
+enum class image_noise_generator
+  {
+  perlin,
+  simplex
+  };
+
+// The noise field of image_perlin: all octaves accumulated, before amplification, gamma and colors are applied.
+// Keeping it around allows changing amp, gamma or the colors with a single pass over the map via image_perlin_resolve.
+struct image_perlin_noise
+  {
+  int32_t width;
+  int32_t height;
+  int32_t frequency;
+  int32_t octaves;
+  float fadeoff;
+  int32_t seed;
+  image_perlin_mode mode;
+  image_noise_generator generator;
+  uint32_t table_seed; // of the perlin_context that synthesized the field
+  int32_t period_bits; // of the perlin_context that synthesized the field
+  std::vector<int32_t> data; // width * height accumulated noise values
+
+  // returns true if this noise field was synthesized with these parameters
+  bool matches(const perlin_context& context, image_noise_generator generator, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode) const;
+  };
+
+std::unique_ptr<image_perlin_noise> image_perlin_synthesize(int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, int32_t nr_of_threads);
+std::unique_ptr<image_perlin_noise> image_perlin_synthesize(const perlin_context& context, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, int32_t nr_of_threads);
+// Synthesizes the noise field of image_perlin or image_simplex, image_perlin_resolve turns either into an image.
+std::unique_ptr<image_perlin_noise> image_noise_synthesize(const perlin_context& context, image_noise_generator generator, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, int32_t nr_of_threads);
+
+// image_perlin_resolve(image_perlin_synthesize(xs, ys, freq, oct, fadeoff, seed, mode, ...), amp, gamma, col0, col1, ...) equals image_perlin(xs, ys, freq, oct, fadeoff, seed, mode, amp, gamma, col0, col1)
+std::unique_ptr<image> image_perlin_resolve(const image_perlin_noise& noise, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t nr_of_threads);
+std::unique_ptr<image> image_perlin_resolve(const image_perlin_noise& noise, float amp, float gamma, uint32_t col0, uint32_t col1, image_format format, int32_t nr_of_threads);
+
+// Out of core variants: the result is computed in bands of band_height rows that are copied into dest one after the other,
+// so the working memory stays at one band however large dest, typically a mapped image, is.
+// The noise has the size and format of dest, and equals image_perlin or image_simplex of that size.
+bool image_noise_stream(const perlin_context& context, image_noise_generator generator, std::unique_ptr<image>& dest, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t band_height, int32_t nr_of_threads);
+bool image_perlin_stream(const perlin_context& context, std::unique_ptr<image>& dest, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, float amp, float gamma, uint32_t col0, uint32_t col1, int32_t band_height, int32_t nr_of_threads);
+
 enum class image_normals_mode
   {
   normal_2d,
@@ -81,6 +303,10 @@ enum class image_normals_mode
   };
 
 std::unique_ptr<image> image_normals(const std::unique_ptr<image>& im, float dist, image_normals_mode mode);
+// The normals of the pixels of the view, as an rgba16 image of the size of the view. Neighbours outside the view are read from the image.
+std::unique_ptr<image> image_normals(const image_view& v, float dist, image_normals_mode mode);
+// dest is an rgba16 image of the size of heightmap, see image_noise_stream
+bool image_normals_stream(const std::unique_ptr<image>& heightmap, std::unique_ptr<image>& dest, float dist, image_normals_mode mode, int32_t band_height);
 
 enum class image_gradient_mode
   {
@@ -107,25 +333,96 @@ enum class image_glow_rect_flags
   };
 
 void image_glow_rect(std::unique_ptr<image>& im, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags flags);
+// The glow is positioned relative to the whole image, only the pixels inside the view are changed.
+void image_glow_rect(const image_view& v, float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags flags);
 
 enum class image_merge_mode
   {
-  add,
-  sub,
+  add, // wraps around
+  sub, // wraps around
   mul,
   min,
-  max
+  max,
+  add_saturate, // clamps at 0x7fff (1 for gray32f)
+  sub_saturate // clamps at 0
   };
 
 std::unique_ptr<image> image_merge(image_merge_mode mode, int32_t count, const std::unique_ptr<image>* i0, ...);
 
+// Merges images[0] with images[1], then the result with images[2], and so on, in a single pass over all inputs.
+// The images must all have the same size and format. Returns nullptr or false otherwise.
+std::unique_ptr<image> image_merge(image_merge_mode mode, const image* const* images, int32_t count, int32_t nr_of_threads);
+std::unique_ptr<image> image_merge(image_merge_mode mode, const std::vector<const image*>& images, int32_t nr_of_threads);
+
+// Same as above, but writes the result into dest, which must have the size and format of the inputs and may be one of them.
+bool image_merge(std::unique_ptr<image>& dest, image_merge_mode mode, const image* const* images, int32_t count, int32_t nr_of_threads);
+bool image_merge(std::unique_ptr<image>& dest, image_merge_mode mode, const std::vector<const image*>& images, int32_t nr_of_threads);
+
+// Merges src into dest. Both views must have the same width, height and format. Returns false otherwise.
+bool image_merge(const image_view& dest, image_merge_mode mode, const image_view& src);
+
 enum class image_color_mode
   {
   mul,
   add,
   sub,
   gray,
-  invert
+  invert,
+  add_saturate,
+  sub_saturate
   };
 
-void image_color(std::unique_ptr<image>& im, image_color_mode mode, uint32_t color);
\ No newline at end of file
+void image_color(std::unique_ptr<image>& im, image_color_mode mode, uint32_t color);
+void image_color(const image_view& v, image_color_mode mode, uint32_t color);
+
+// Colors every pixel with a 2 dimensional lookup table of 1 << (x_bits + y_bits) entries, indexed by the 15 bit values x and y
+// of the first channel of im_x and im_y: table[(y >> (15 - y_bits)) << x_bits | (x >> (15 - x_bits))].
+// im_x and im_y are rgba16 or gray16 images of the same size, the result is rgba16. Returns nullptr otherwise.
+std::unique_ptr<image> image_lookup(const std::unique_ptr<image>& im_x, const std::unique_ptr<image>& im_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, int32_t nr_of_threads);
+// Writes into dest, an rgba16 view of the size of v_x and v_y. Returns false otherwise.
+bool image_lookup(const image_view& v_x, const image_view& v_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, const image_view& dest, int32_t nr_of_threads);
+// dest is an rgba16 image of the size of im_x and im_y, see image_noise_stream
+bool image_lookup_stream(const std::unique_ptr<image>& im_x, const std::unique_ptr<image>& im_y, const uint64_t* table, int32_t x_bits, int32_t y_bits, std::unique_ptr<image>& dest, int32_t band_height, int32_t nr_of_threads);
+
+// Colors every pixel with a table of 0x8000 colors, indexed by the 15 bit value of the first channel of im_height.
+// If im_variation is not null, the 15 bit value v of its first channel is added to the red, green and blue channel of the color
+// as (v >> variation_strength) - (0x7fff >> (variation_strength + 1)), clamped to 0..0x7fff. variation_strength is 0 to 15.
+// The images are rgba16 or gray16 images of the same size, the result is rgba16. Returns nullptr otherwise.
+std::unique_ptr<image> image_colormap(const std::unique_ptr<image>& im_height, const std::unique_ptr<image>& im_variation, const uint64_t* table, int32_t variation_strength, int32_t nr_of_threads);
+// Writes into dest, an rgba16 view of the size of v_height. v_variation is empty for no variation. Returns false otherwise.
+bool image_colormap(const image_view& v_height, const image_view& v_variation, const uint64_t* table, int32_t variation_strength, const image_view& dest, int32_t nr_of_threads);
+// dest is an rgba16 image of the size of im_height, see image_noise_stream
+bool image_colormap_stream(const std::unique_ptr<image>& im_height, const std::unique_ptr<image>& im_variation, const uint64_t* table, int32_t variation_strength, std::unique_ptr<image>& dest, int32_t band_height, int32_t nr_of_threads);
+
+// A lazily evaluated chain of element-wise image operations. Building an expression does not touch any pixel.
+// Evaluating it runs all operations in a single pass over the map, tile by tile, so that the intermediate results
+// only ever exist for one cache sized tile instead of as full size images.
+// Expressions work on rgba16 and gray16 images and give exactly the same result as the corresponding image_xxx calls.
+class image_expression
+  {
+  public:
+    // refers to im, which must stay alive and unchanged until the expression is evaluated
+    static image_expression source(const std::unique_ptr<image>& im);
+    static image_expression flat(int32_t w, int32_t h, uint32_t color, image_format format);
+
+    image_expression glow_rect(float cx, float cy, float rx, float ry, float sx, float sy, uint32_t color, float alpha, float power, image_glow_rect_wrap wrap, image_glow_rect_flags flags) const;
+    image_expression color(image_color_mode mode, uint32_t color) const;
+    image_expression merge(image_merge_mode mode, const image_expression& other) const;
+
+    int32_t width() const;
+    int32_t height() const;
+    image_format format() const;
+
+    // returns nullptr if the expression is invalid, i.e. merges images of different sizes or formats, or uses gray32f
+    std::unique_ptr<image> evaluate(int32_t nr_of_threads) const;
+
+    // evaluates into dest, which must have the size and format of the expression and may be one of its sources
+    bool evaluate(std::unique_ptr<image>& dest, int32_t nr_of_threads) const;
+
+  private:
+    struct node;
+    explicit image_expression(std::shared_ptr<const node> n);
+
+  private:
+    std::shared_ptr<const node> _node;
+  };
@@ -0,0 +1,398 @@
+#include "qoi.h"
+
+#include <string.h>
+#include <algorithm>
+
+namespace
+  {
+  const uint8_t op_index = 0x00;
+  const uint8_t op_diff = 0x40;
+  const uint8_t op_luma = 0x80;
+  const uint8_t op_run = 0xc0;
+  const uint8_t op_rgb = 0xfe;
+  const uint8_t op_rgba = 0xff;
+  const int64_t header_size = 14;
+  const uint8_t end_marker[8] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+  const int32_t max_run = 62;
+  const int64_t max_bytes_per_pixel = 9; // QOI_OP_RGBA of qoi16
+  const int64_t max_run_bytes = 1; // the run that the first pixel of an encode call can end
+
+  template <class P>
+  inline uint32_t pixel_hash(const P& p)
+    {
+    return (p.r * 3u + p.g * 5u + p.b * 7u + p.a * 11u) & 63;
+    }
+
+  template <class P>
+  inline bool same_pixel(const P& p, const P& q)
+    {
+    return p.r == q.r && p.g == q.g && p.b == q.b && p.a == q.a;
+    }
+
+  inline void put_16(uint8_t*& d, uint32_t v)
+    {
+    d[0] = (uint8_t)(v >> 8);
+    d[1] = (uint8_t)v;
+    d += 2;
+    }
+
+  inline uint16_t get_16(const uint8_t*& s)
+    {
+    const uint16_t v = (uint16_t)((s[0] << 8) | s[1]);
+    s += 2;
+    return v;
+    }
+
+  inline void put_32(uint8_t* d, uint32_t v)
+    {
+    d[0] = (uint8_t)(v >> 24);
+    d[1] = (uint8_t)(v >> 16);
+    d[2] = (uint8_t)(v >> 8);
+    d[3] = (uint8_t)v;
+    }
+
+  inline uint32_t get_32(const uint8_t* s)
+    {
+    return ((uint32_t)s[0] << 24) | ((uint32_t)s[1] << 16) | ((uint32_t)s[2] << 8) | (uint32_t)s[3];
+    }
+
+  // The difference of two samples, wrapped around to the signed range of T
+  template <class T>
+  inline int32_t sample_difference(uint32_t a, uint32_t b)
+    {
+    return sizeof(T) == 1 ? (int32_t)(int8_t)(uint8_t)(a - b) : (int32_t)(int16_t)(uint16_t)(a - b);
+    }
+  }
+
+qoi_encoder::qoi_encoder(int32_t width, int32_t height, int32_t channels, bool sixteen_bit) : _width(width), _height(height),
+  _channels(channels), _sixteen_bit(sixteen_bit), _run(0)
+  {
+  memset(_index, 0, sizeof(_index));
+  _previous = pixel{ 0, 0, 0, (uint16_t)(sixteen_bit ? 0xffff : 0xff) };
+  }
+
+void qoi_encoder::begin(std::vector<uint8_t>& out)
+  {
+  uint8_t header[header_size];
+  memcpy(header, _sixteen_bit ? "qo16" : "qoif", 4);
+  put_32(header + 4, (uint32_t)_width);
+  put_32(header + 8, (uint32_t)_height);
+  header[12] = (uint8_t)(_sixteen_bit ? _channels : std::max(_channels, 3)); // 8 bit gray is written as rgb
+  header[13] = 0; // srgb with linear alpha, only informative
+  out.insert(out.end(), header, header + header_size);
+  }
+
+template <class T, int32_t C>
+uint8_t* qoi_encoder::_encode(const T* samples, int64_t count, uint8_t* d)
+  {
+  const bool wide = sizeof(T) == 2;
+  const bool gray = wide && C == 1;
+  const uint16_t opaque = wide ? 0xffff : 0xff;
+  for (int64_t i = 0; i < count; ++i, samples += C)
+    {
+    pixel p;
+    p.r = samples[0];
+    p.g = C >= 3 ? samples[1] : samples[0];
+    p.b = C >= 3 ? samples[2] : samples[0];
+    p.a = C == 4 ? samples[3] : opaque;
+    if (same_pixel(p, _previous))
+      {
+      if (_run++ == 0)
+        _index[pixel_hash(p)] = p; // as the decoder does for a run
+      if (_run == max_run)
+        {
+        *d++ = (uint8_t)(op_run | (max_run - 1));
+        _run = 0;
+        }
+      continue;
+      }
+    if (_run > 0)
+      {
+      *d++ = (uint8_t)(op_run | (_run - 1));
+      _run = 0;
+      }
+    const uint32_t hash = pixel_hash(p);
+    if (same_pixel(_index[hash], p))
+      {
+      *d++ = (uint8_t)(op_index | hash);
+      _previous = p;
+      continue;
+      }
+    _index[hash] = p;
+    if (gray)
+      {
+      const int32_t dv = sample_difference<T>(p.r, _previous.r);
+      if (dv >= -32 && dv < 32)
+        *d++ = (uint8_t)(op_diff | (dv + 32));
+      else if (dv >= -8192 && dv < 8192)
+        {
+        const uint32_t v = (uint32_t)(dv + 8192);
+        *d++ = (uint8_t)(op_luma | (v >> 8));
+        *d++ = (uint8_t)v;
+        }
+      else
+        {
+        *d++ = op_rgb;
+        put_16(d, p.r);
+        }
+      }
+    else if (p.a == _previous.a)
+      {
+      const int32_t dr = sample_difference<T>(p.r, _previous.r);
+      const int32_t dg = sample_difference<T>(p.g, _previous.g);
+      const int32_t db = sample_difference<T>(p.b, _previous.b);
+      const int32_t dr_dg = dr - dg;
+      const int32_t db_dg = db - dg;
+      const int32_t luma_range = wide ? 8192 : 32;
+      if (dr >= -2 && dr < 2 && dg >= -2 && dg < 2 && db >= -2 && db < 2)
+        *d++ = (uint8_t)(op_diff | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2));
+      else if (dg >= -luma_range && dg < luma_range && dr_dg >= -8 && dr_dg < 8 && db_dg >= -8 && db_dg < 8)
+        {
+        const uint32_t v = (uint32_t)(dg + luma_range);
+        if (wide)
+          {
+          *d++ = (uint8_t)(op_luma | (v >> 8));
+          *d++ = (uint8_t)v;
+          }
+        else
+          *d++ = (uint8_t)(op_luma | v);
+        *d++ = (uint8_t)(((dr_dg + 8) << 4) | (db_dg + 8));
+        }
+      else
+        {
+        *d++ = op_rgb;
+        if (wide)
+          {
+          put_16(d, p.r);
+          put_16(d, p.g);
+          put_16(d, p.b);
+          }
+        else
+          {
+          *d++ = (uint8_t)p.r;
+          *d++ = (uint8_t)p.g;
+          *d++ = (uint8_t)p.b;
+          }
+        }
+      }
+    else
+      {
+      *d++ = op_rgba;
+      if (wide)
+        {
+        put_16(d, p.r);
+        put_16(d, p.g);
+        put_16(d, p.b);
+        put_16(d, p.a);
+        }
+      else
+        {
+        *d++ = (uint8_t)p.r;
+        *d++ = (uint8_t)p.g;
+        *d++ = (uint8_t)p.b;
+        *d++ = (uint8_t)p.a;
+        }
+      }
+    _previous = p;
+    }
+  return d;
+  }
+
+void qoi_encoder::encode(const uint8_t* samples, int64_t count, std::vector<uint8_t>& out)
+  {
+  const size_t size = out.size();
+  out.resize(size + (size_t)(count * max_bytes_per_pixel + max_run_bytes));
+  uint8_t* d = out.data() + size;
+  switch (_channels)
+    {
+    case 1: d = _encode<uint8_t, 1>(samples, count, d); break;
+    case 3: d = _encode<uint8_t, 3>(samples, count, d); break;
+    default: d = _encode<uint8_t, 4>(samples, count, d); break;
+    }
+  out.resize((size_t)(d - out.data()));
+  }
+
+void qoi_encoder::encode(const uint16_t* samples, int64_t count, std::vector<uint8_t>& out)
+  {
+  const size_t size = out.size();
+  out.resize(size + (size_t)(count * max_bytes_per_pixel + max_run_bytes));
+  uint8_t* d = out.data() + size;
+  if (_channels == 1)
+    d = _encode<uint16_t, 1>(samples, count, d);
+  else
+    d = _encode<uint16_t, 4>(samples, count, d);
+  out.resize((size_t)(d - out.data()));
+  }
+
+void qoi_encoder::finish(std::vector<uint8_t>& out)
+  {
+  if (_run > 0)
+    out.push_back((uint8_t)(op_run | (_run - 1)));
+  _run = 0;
+  out.insert(out.end(), end_marker, end_marker + 8);
+  }
+
+qoi_decoder::qoi_decoder() : _data(nullptr), _end(nullptr), _width(0), _height(0), _channels(0), _sixteen_bit(false), _run(0)
+  {
+  memset(_index, 0, sizeof(_index));
+  _previous = pixel{ 0, 0, 0, 0 };
+  }
+
+bool qoi_decoder::begin(const uint8_t* data, size_t size)
+  {
+  if ((int64_t)size < header_size + 8)
+    return false;
+  if (memcmp(data, "qoif", 4) == 0)
+    _sixteen_bit = false;
+  else if (memcmp(data, "qo16", 4) == 0)
+    _sixteen_bit = true;
+  else
+    return false;
+  const uint32_t w = get_32(data + 4);
+  const uint32_t h = get_32(data + 8);
+  _channels = data[12];
+  const bool channels_ok = _sixteen_bit ? (_channels == 1 || _channels == 4) : (_channels == 3 || _channels == 4);
+  // every op gives at least one pixel and at most a run of max_run, which rejects sizes that the data cannot hold
+  const int64_t ops = (int64_t)size - header_size - 8;
+  if (!channels_ok || w == 0 || h == 0 || w > 0x7fffffff || h > 0x7fffffff || (int64_t)w * h > ops * max_run)
+    return false;
+  _width = (int32_t)w;
+  _height = (int32_t)h;
+  _data = data + header_size;
+  _end = data + size - 8; // the end marker
+  memset(_index, 0, sizeof(_index));
+  _previous = pixel{ 0, 0, 0, (uint16_t)(_sixteen_bit ? 0xffff : 0xff) };
+  _run = 0;
+  return true;
+  }
+
+template <class T, int32_t C>
+bool qoi_decoder::_decode(T* samples, int64_t count)
+  {
+  const bool wide = sizeof(T) == 2;
+  const bool gray = wide && C == 1;
+  for (int64_t i = 0; i < count; ++i, samples += C)
+    {
+    if (_run > 0)
+      --_run;
+    else
+      {
+      if (_data >= _end)
+        return false;
+      const uint8_t b1 = *_data++;
+      pixel p = _previous;
+      if (b1 == op_rgb)
+        {
+        if (_end - _data < (gray ? 2 : wide ? 6 : 3))
+          return false;
+        if (gray)
+          p.r = p.g = p.b = get_16(_data);
+        else if (wide)
+          {
+          p.r = get_16(_data);
+          p.g = get_16(_data);
+          p.b = get_16(_data);
+          }
+        else
+          {
+          p.r = _data[0];
+          p.g = _data[1];
+          p.b = _data[2];
+          _data += 3;
+          }
+        }
+      else if (b1 == op_rgba)
+        {
+        if (gray || _end - _data < (wide ? 8 : 4))
+          return false;
+        if (wide)
+          {
+          p.r = get_16(_data);
+          p.g = get_16(_data);
+          p.b = get_16(_data);
+          p.a = get_16(_data);
+          }
+        else
+          {
+          p.r = _data[0];
+          p.g = _data[1];
+          p.b = _data[2];
+          p.a = _data[3];
+          _data += 4;
+          }
+        }
+      else
+        {
+        switch (b1 & 0xc0)
+          {
+          case op_index:
+            p = _index[b1];
+            break;
+          case op_diff:
+            if (gray)
+              p.r = p.g = p.b = (uint16_t)(p.r + (b1 & 63) - 32);
+            else
+              {
+              p.r = (T)(p.r + ((b1 >> 4) & 3) - 2);
+              p.g = (T)(p.g + ((b1 >> 2) & 3) - 2);
+              p.b = (T)(p.b + (b1 & 3) - 2);
+              }
+            break;
+          case op_luma:
+          {
+          if (_end - _data < (wide && !gray ? 2 : 1))
+            return false;
+          if (gray)
+            {
+            const int32_t dv = (((b1 & 63) << 8) | *_data++) - 8192;
+            p.r = p.g = p.b = (uint16_t)(p.r + dv);
+            break;
+            }
+          int32_t dg;
+          if (wide)
+            dg = (((b1 & 63) << 8) | *_data++) - 8192;
+          else
+            dg = (b1 & 63) - 32;
+          const uint8_t b2 = *_data++;
+          p.r = (T)(p.r + dg - 8 + (b2 >> 4));
+          p.g = (T)(p.g + dg);
+          p.b = (T)(p.b + dg - 8 + (b2 & 15));
+          break;
+          }
+          default:
+            _run = b1 & 63;
+            break;
+          }
+        }
+      _index[pixel_hash(p)] = p;
+      _previous = p;
+      }
+    samples[0] = (T)_previous.r;
+    if (C >= 3)
+      {
+      samples[1] = (T)_previous.g;
+      samples[2] = (T)_previous.b;
+      }
+    if (C == 4)
+      samples[3] = (T)_previous.a;
+    }
+  return true;
+  }
+
+bool qoi_decoder::decode(uint8_t* samples, int64_t count)
+  {
+  if (_sixteen_bit)
+    return false;
+  if (_channels == 3)
+    return _decode<uint8_t, 3>(samples, count);
+  return _decode<uint8_t, 4>(samples, count);
+  }
+
+bool qoi_decoder::decode(uint16_t* samples, int64_t count)
+  {
+  if (!_sixteen_bit)
+    return false;
+  if (_channels == 1)
+    return _decode<uint16_t, 1>(samples, count);
+  return _decode<uint16_t, 4>(samples, count);
+  }
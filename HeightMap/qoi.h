@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/*
+qoi, the "Quite OK Image" format (qoiformat.org), for 8 bit rgb and rgba, and qoi16, a variant of it with 16 bit channels.
+Both encode a pixel in a single pass with a few integer operations, so they run at hundreds of MB/s, far faster than png.
+
+qoi16 is qoi with the magic "qo16", 1 (gray) or 4 (rgba) channels, and these changes to the ops for 16 bit samples:
+  rgba: QOI_OP_LUMA has 14 bits for the green difference (-8192..8191, high bits in the tag byte) in front of the byte
+        with the red and blue differences, QOI_OP_RGB and QOI_OP_RGBA hold 16 bit big endian samples.
+  gray: the pixel is (v, v, v, 65535) for the hash and the run ops, QOI_OP_DIFF holds the difference -32..31 in its 6 bits,
+        QOI_OP_LUMA the difference -8192..8191 in 14 bits (high bits in the tag byte), and QOI_OP_RGB the 16 bit big endian
+        value. QOI_OP_RGBA is not used.
+The differences wrap around as in qoi. The header and the end marker are those of qoi.
+*/
+
+class qoi_encoder
+  {
+  public:
+    // 8 bit samples (qoi) take 3 or 4 channels, 1 channel is written as gray rgb. 16 bit samples (qoi16) take 1 or 4 channels.
+    qoi_encoder(int32_t width, int32_t height, int32_t channels, bool sixteen_bit);
+
+    // Appends the header to out
+    void begin(std::vector<uint8_t>& out);
+
+    // Appends the ops of count pixels of interleaved samples, the pixels following those of the previous call
+    void encode(const uint8_t* samples, int64_t count, std::vector<uint8_t>& out);
+    void encode(const uint16_t* samples, int64_t count, std::vector<uint8_t>& out);
+
+    // Appends the pending run and the end marker
+    void finish(std::vector<uint8_t>& out);
+
+  private:
+    struct pixel
+      {
+      uint16_t r, g, b, a;
+      };
+
+    template <class T, int32_t C>
+    uint8_t* _encode(const T* samples, int64_t count, uint8_t* d);
+
+  private:
+    int32_t _width;
+    int32_t _height;
+    int32_t _channels;
+    bool _sixteen_bit;
+    pixel _index[64];
+    pixel _previous;
+    int32_t _run;
+  };
+
+class qoi_decoder
+  {
+  public:
+    qoi_decoder();
+
+    // Reads the header at the start of data. Returns false if data is no qoi or qoi16 image, or is too short for its size.
+    bool begin(const uint8_t* data, size_t size);
+
+    int32_t width() const { return _width; }
+    int32_t height() const { return _height; }
+    int32_t channels() const { return _channels; } // 3 or 4 for qoi, 1 or 4 for qoi16
+    bool sixteen_bit() const { return _sixteen_bit; }
+
+    // Decodes the next count pixels to channels() interleaved samples, 8 bit for qoi and 16 bit for qoi16.
+    // Returns false if the data ends too soon or holds an invalid op.
+    bool decode(uint8_t* samples, int64_t count);
+    bool decode(uint16_t* samples, int64_t count);
+
+  private:
+    struct pixel
+      {
+      uint16_t r, g, b, a;
+      };
+
+    template <class T, int32_t C>
+    bool _decode(T* samples, int64_t count);
+
+  private:
+    const uint8_t* _data; // the next op
+    const uint8_t* _end;
+    int32_t _width;
+    int32_t _height;
+    int32_t _channels;
+    bool _sixteen_bit;
+    pixel _index[64];
+    pixel _previous;
+    int32_t _run;
+  };
@@ -11,6 +11,7 @@ settings::settings()
   variation_fadeoff = 0.f;
   seed = 0;
   mode = 0;
+  generator = 0;
   amplify = 1.f;
   gamma = 1.f;
   normalmap_mode = 1;
@@ -35,6 +36,19 @@ settings::settings()
   variation_frequency = 2;
 
   auto_vary_colors = true;
+  biomes = false;
+
+  nr_of_threads = 0;
+  progressive_preview = true;
+
+  heightmap_export_format = 0;
+  normalmap_export_format = 0;
+  colormap_export_format = 0;
+  heightmap_export_level = 8;
+  normalmap_export_level = 8;
+  colormap_export_level = 8;
+  raw_width = 0;
+  raw_height = 0;
   }
 
 
@@ -49,11 +63,14 @@ settings read_settings(const char* filename)
   f["fadeoff"] >> s.fadeoff;
   f["seed"] >> s.seed;
   f["mode"] >> s.mode;
+  f["generator"] >> s.generator;
   f["amplify"] >> s.amplify;
   f["gamma"] >> s.gamma;
   f["normalmap_mode"] >> s.normalmap_mode;
   f["normalmap_strength"] >> s.normalmap_strength;
   f["render_target"] >> s.render_target;
+  f["nr_of_threads"] >> s.nr_of_threads;
+  f["progressive_preview"] >> s.progressive_preview;
 
   f["island_center_x"] >> s.island_center_x;
   f["island_center_y"] >> s.island_center_y;
@@ -69,6 +86,15 @@ settings read_settings(const char* filename)
   f["island_merge_mode"] >> s.island_merge_mode;
   f["island_invert"] >> s.island_invert;
   f["export_folder"] >> s.export_folder;
+  f["heightmap_export_format"] >> s.heightmap_export_format;
+  f["normalmap_export_format"] >> s.normalmap_export_format;
+  f["colormap_export_format"] >> s.colormap_export_format;
+  f["heightmap_export_level"] >> s.heightmap_export_level;
+  f["normalmap_export_level"] >> s.normalmap_export_level;
+  f["colormap_export_level"] >> s.colormap_export_level;
+  f["heightmap_file"] >> s.heightmap_file;
+  f["raw_width"] >> s.raw_width;
+  f["raw_height"] >> s.raw_height;
   f["auto_vary_colors"] >> s.auto_vary_colors;
   f["variation_fadeoff"] >> s.variation_fadeoff;
   f["variation_strength"] >> s.variation_strength;
@@ -77,6 +103,9 @@ settings read_settings(const char* filename)
 
   f["colors"] >> s.colors;
   f["heights"] >> s.heights;
+  f["biomes"] >> s.biomes;
+  f["wet_colors"] >> s.wet_colors;
+  f["wet_heights"] >> s.wet_heights;
   return s;
   }
 
@@ -90,11 +119,14 @@ void write_settings(const settings& s, const char* filename)
   f << "fadeoff" << s.fadeoff;
   f << "seed" << s.seed;
   f << "mode" << s.mode;
+  f << "generator" << s.generator;
   f << "amplify" << s.amplify;
   f << "gamma" << s.gamma;
   f << "normalmap_mode" << s.normalmap_mode;
   f << "normalmap_strength" << s.normalmap_strength;
   f << "render_target" << s.render_target;
+  f << "nr_of_threads" << s.nr_of_threads;
+  f << "progressive_preview" << s.progressive_preview;
 
   f << "island_center_x" << s.island_center_x;
   f << "island_center_y" << s.island_center_y;
@@ -111,6 +143,15 @@ void write_settings(const settings& s, const char* filename)
   f << "island_invert" << s.island_invert;
 
   f << "export_folder" << s.export_folder;
+  f << "heightmap_export_format" << s.heightmap_export_format;
+  f << "normalmap_export_format" << s.normalmap_export_format;
+  f << "colormap_export_format" << s.colormap_export_format;
+  f << "heightmap_export_level" << s.heightmap_export_level;
+  f << "normalmap_export_level" << s.normalmap_export_level;
+  f << "colormap_export_level" << s.colormap_export_level;
+  f << "heightmap_file" << s.heightmap_file;
+  f << "raw_width" << s.raw_width;
+  f << "raw_height" << s.raw_height;
   f << "auto_vary_colors" << s.auto_vary_colors;
   f << "variation_fadeoff" << s.variation_fadeoff;
   f << "variation_strength" << s.variation_strength;
@@ -119,6 +160,9 @@ void write_settings(const settings& s, const char* filename)
 
   f << "colors" << s.colors;
   f << "heights" << s.heights;
+  f << "biomes" << s.biomes;
+  f << "wet_colors" << s.wet_colors;
+  f << "wet_heights" << s.wet_heights;
 
   f.release();
   }
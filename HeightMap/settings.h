@@ -15,6 +15,7 @@ struct settings
   float fadeoff;  
   int32_t seed;
   int32_t mode;
+  int32_t generator; // 0: perlin, 1: simplex
   float amplify;
   float gamma;
 
@@ -38,7 +39,19 @@ struct settings
 
   int32_t render_target;
 
+  int32_t nr_of_threads; // 0 means one thread per hardware core
+  bool progressive_preview; // large maps are shown at a lower resolution first, and refined in the background
+
   std::string export_folder;
+  int32_t heightmap_export_format; // an image_export_filetype
+  int32_t normalmap_export_format;
+  int32_t colormap_export_format;
+  int32_t heightmap_export_level; // png compression, 1 (fast) to 9 (small)
+  int32_t normalmap_export_level;
+  int32_t colormap_export_level;
+  std::string heightmap_file; // a heightmap (png, qoi, .r16, .raw or .r32) that replaces the noise, empty for noise
+  int32_t raw_width; // the size of a headerless heightmap file, 0 to derive it from the file size, square if both are 0
+  int32_t raw_height;
 
   float variation_fadeoff;
   int32_t variation_strength;
@@ -48,6 +61,10 @@ struct settings
 
   std::vector<uint32_t> colors;
   std::vector<double> heights;
+
+  bool biomes; // colors by height and moisture, the variation map being the moisture
+  std::vector<uint32_t> wet_colors; // the colors at full moisture, colors and heights are the colors at zero moisture
+  std::vector<double> wet_heights;
   };
 
 
@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+Runtime selection of SIMD code paths.
+Kernels are compiled for a specific instruction set with the HEIGHTMAP_TARGET_xxx attributes,
+and get_simd_level() tells which of them the cpu we are running on can execute.
+*/
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define HEIGHTMAP_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define HEIGHTMAP_TARGET_SSE41
+#define HEIGHTMAP_TARGET_AVX2
+#else
+#define HEIGHTMAP_TARGET_SSE41 __attribute__((target("sse4.1")))
+#define HEIGHTMAP_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+enum class simd_level
+  {
+  scalar,
+  sse41,
+  avx2
+  };
+
+inline simd_level detect_simd_level()
+  {
+#if defined(HEIGHTMAP_X86)
+#ifdef _MSC_VER
+  int info[4];
+  __cpuid(info, 0);
+  const int max_leaf = info[0];
+  __cpuid(info, 1);
+  const bool sse41 = (info[2] & (1 << 19)) != 0;
+  const bool osxsave = (info[2] & (1 << 27)) != 0;
+  const bool avx = (info[2] & (1 << 28)) != 0;
+  bool avx2 = false;
+  if (max_leaf >= 7 && osxsave && avx && (_xgetbv(0) & 6) == 6)
+    {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+    }
+  if (avx2)
+    return simd_level::avx2;
+  if (sse41)
+    return simd_level::sse41;
+#else
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return simd_level::avx2;
+  if (__builtin_cpu_supports("sse4.1"))
+    return simd_level::sse41;
+#endif
+#endif
+  return simd_level::scalar;
+  }
+
+inline simd_level get_simd_level()
+  {
+  static const simd_level level = detect_simd_level();
+  return level;
+  }
@@ -0,0 +1,245 @@
+// Checks that heightmaps read back as they were written: raw imports of non-square files, and the export formats.
+
+#include "image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+  {
+  int failures = 0;
+  std::string folder;
+
+  void check(bool ok, const char* what)
+    {
+    if (!ok)
+      {
+      printf("FAILED: %s\n", what);
+      ++failures;
+      }
+    }
+
+  std::string file(const char* name)
+    {
+    return folder + "/image_io_test_" + name;
+    }
+
+  // 15 bit heights that hit 0, 0x7fff and every low bit, with a flat left part so that run length encoding has runs
+  uint16_t height_at(int32_t x, int32_t y)
+    {
+    if (x < 40)
+      return (uint16_t)(y * 64);
+    if (x == 40)
+      return y & 1 ? 0x7fff : 0;
+    return (uint16_t)((x * 131 + y * 977 + (x * y) % 53) & 0x7fff);
+    }
+
+  std::unique_ptr<image> make_heightmap(int32_t w, int32_t h)
+    {
+    std::unique_ptr<image> im = image_flat(w, h, 0, image_format::gray16);
+    uint16_t* p = (uint16_t*)im->data();
+    for (int32_t y = 0; y < h; ++y)
+      for (int32_t x = 0; x < w; ++x)
+        p[(int64_t)y * w + x] = height_at(x, y);
+    return im;
+    }
+
+  bool same_heights(const std::unique_ptr<image>& im, int32_t w, int32_t h)
+    {
+    if (!im || im->width() != w || im->height() != h || im->format() != image_format::gray16)
+      return false;
+    const uint16_t* p = (const uint16_t*)im->data();
+    for (int32_t y = 0; y < h; ++y)
+      for (int32_t x = 0; x < w; ++x)
+        if (p[(int64_t)y * w + x] != height_at(x, y))
+          return false;
+    return true;
+    }
+
+  // The 8 bit formats keep the top 8 of the 15 bits of every channel
+  bool same_bytes(const std::unique_ptr<image>& im, const std::unique_ptr<image>& original)
+    {
+    if (!im || im->width() != original->width() || im->height() != original->height() || im->format() != original->format())
+      return false;
+    const int64_t count = original->size() * (original->format() == image_format::rgba16 ? 4 : 1);
+    const uint16_t* p = (const uint16_t*)im->data();
+    const uint16_t* q = (const uint16_t*)original->data();
+    for (int64_t i = 0; i < count; ++i)
+      if (p[i] >> 7 != q[i] >> 7)
+        return false;
+    return true;
+    }
+
+  std::unique_ptr<image> make_colors(int32_t w, int32_t h)
+    {
+    std::unique_ptr<image> im = image_flat(w, h, 0, image_format::rgba16);
+    uint16_t* p = (uint16_t*)im->data();
+    for (int64_t i = 0; i < im->size() * 4; ++i)
+      p[i] = (uint16_t)((i * 7919) & 0x7fff);
+    return im;
+    }
+
+  // A headerless file of w x h heights, plus extra samples of trailing data
+  template <class T, class F>
+  bool write_raw(const std::string& filename, int32_t w, int32_t h, int32_t extra, F sample)
+    {
+    std::vector<T> samples;
+    for (int32_t y = 0; y < h; ++y)
+      for (int32_t x = 0; x < w; ++x)
+        samples.push_back(sample(height_at(x, y)));
+    samples.resize(samples.size() + extra);
+    FILE* f = fopen(filename.c_str(), "wb");
+    if (!f)
+      return false;
+    const bool ok = fwrite(samples.data(), sizeof(T), samples.size(), f) == samples.size();
+    return fclose(f) == 0 && ok;
+    }
+
+  void test_raw_import()
+    {
+    const int32_t w = 300;
+    const int32_t h = 170;
+    const std::string r16 = file("import.r16");
+    const std::string r32 = file("import.r32");
+    const std::string longer = file("import_longer.r16");
+    // little endian samples, like the terrain tools write them
+    check(write_raw<uint16_t>(r16, w, h, 0, [](uint16_t v) { return (uint16_t)(v << 1 | v >> 14); }), "write r16");
+    check(write_raw<float>(r32, w, h, 0, [](uint16_t v) { return v / 32767.f; }), "write r32");
+    check(write_raw<uint16_t>(longer, w, h, 1, [](uint16_t v) { return (uint16_t)(v << 1 | v >> 14); }), "write r16 with trailing data");
+
+    check(same_heights(image_import_raw(r16.c_str(), w, h, image_raw_format::r16, image_format::gray16), w, h), "r16 import of 300 x 170");
+    check(same_heights(image_import_raw(r32.c_str(), w, h, image_raw_format::r32f, image_format::gray16), w, h), "r32 import of 300 x 170");
+    std::unique_ptr<image> f = image_import_raw(r32.c_str(), w, h, image_raw_format::r32f, image_format::gray32f);
+    check(f && ((const float*)f->data())[w * h - 1] == height_at(w - 1, h - 1) / 32767.f, "r32 import keeps the floats of gray32f");
+    std::unique_ptr<image> rgba = image_import_raw(r16.c_str(), w, h, image_raw_format::r16, image_format::rgba16);
+    check(rgba && ((const uint16_t*)rgba->data())[(w * h - 1) * 4] == height_at(w - 1, h - 1), "r16 import to rgba16");
+
+    // the size must account for every sample
+    check(image_import_raw(r16.c_str(), w + 1, h, image_raw_format::r16, image_format::gray16) == nullptr, "r16 import of a too large size");
+    check(image_import_raw(r16.c_str(), w, h - 1, image_raw_format::r16, image_format::gray16) == nullptr, "r16 import of a too small size");
+    check(image_import_raw(longer.c_str(), w, h, image_raw_format::r16, image_format::gray16) == nullptr, "r16 import with trailing data");
+    check(image_import_raw(r16.c_str(), w, h, image_raw_format::r32f, image_format::gray16) == nullptr, "r16 file read as r32");
+    check(image_import_raw(file("missing.r16").c_str(), w, h, image_raw_format::r16, image_format::gray16) == nullptr, "import of a missing file");
+
+    remove(r16.c_str());
+    remove(r32.c_str());
+    remove(longer.c_str());
+    }
+
+  void test_lossless_export()
+    {
+    const int32_t w = 517;
+    const int32_t h = 263;
+    std::unique_ptr<image> im = make_heightmap(w, h);
+    const std::string png16 = file("export.png");
+    const std::string r16 = file("export.r16");
+    const std::string r32 = file("export.r32");
+    const std::string pfm = file("export.pfm");
+    check(image_export(im, png16.c_str(), image_export_filetype::png16, 100), "png16 export");
+    check(image_export(im, r16.c_str(), image_export_filetype::r16, 100), "r16 export");
+    check(image_export(im, r32.c_str(), image_export_filetype::r32f, 100), "r32f export");
+    check(image_export(im, pfm.c_str(), image_export_filetype::pfm, 100), "pfm export");
+
+    check(same_heights(image_import(png16.c_str(), image_format::gray16), w, h), "png16 round trip");
+    check(same_heights(image_import_raw(r16.c_str(), w, h, image_raw_format::r16, image_format::gray16), w, h), "r16 round trip");
+    check(same_heights(image_import_raw(r32.c_str(), w, h, image_raw_format::r32f, image_format::gray16), w, h), "r32f round trip");
+    check(same_heights(image_import(pfm.c_str(), image_format::gray16), w, h), "pfm round trip");
+
+    // png16 keeps all channels of rgba16
+    std::unique_ptr<image> rgba = make_colors(w, h);
+    check(image_export(rgba, png16.c_str(), image_export_filetype::png16, 100), "png16 export of rgba16");
+    std::unique_ptr<image> back = image_import(png16.c_str());
+    check(back && back->width() == w && back->height() == h && memcmp(back->data(), rgba->data(), (size_t)rgba->size() * 8) == 0, "png16 round trip of rgba16");
+
+    remove(png16.c_str());
+    remove(r16.c_str());
+    remove(r32.c_str());
+    remove(pfm.c_str());
+    }
+
+  // png and tga are written in strips of rows, these maps take several strips
+  void test_8_bit_export()
+    {
+    std::unique_ptr<image> gray = make_heightmap(1200, 400);
+    std::unique_ptr<image> rgba = make_colors(600, 300);
+    const std::string png = file("export8.png");
+    const std::string tga = file("export8.tga");
+    check(image_export(gray, png.c_str(), image_export_filetype::png, 100), "png export of gray16");
+    check(same_bytes(image_import(png.c_str(), image_format::gray16), gray), "png round trip of gray16");
+    check(image_export(gray, tga.c_str(), image_export_filetype::tga, 100), "tga export of gray16");
+    check(same_bytes(image_import(tga.c_str(), image_format::gray16), gray), "tga round trip of gray16");
+    check(image_export(rgba, png.c_str(), image_export_filetype::png, 100), "png export of rgba16");
+    check(same_bytes(image_import(png.c_str()), rgba), "png round trip of rgba16");
+    check(image_export(rgba, tga.c_str(), image_export_filetype::tga, 100), "tga export of rgba16");
+    check(same_bytes(image_import(tga.c_str()), rgba), "tga round trip of rgba16");
+    remove(png.c_str());
+    remove(tga.c_str());
+    }
+
+  // The exports of the view: png levels and parallel deflate, the row counter, and several maps at the same time
+  void test_export_options()
+    {
+    const int32_t w = 1200;
+    const int32_t h = 400;
+    std::unique_ptr<image> im = make_heightmap(w, h);
+    const std::string png16 = file("options16.png");
+    const std::string png = file("options8.png");
+    image_export_options options;
+    options.jpeg_quality = 100;
+    for (int32_t level : { 1, 9 })
+      for (int32_t threads : { 1, 4 })
+        {
+        options.compression_level = level;
+        options.nr_of_threads = threads;
+        std::atomic<int32_t> rows(-1);
+        options.filetype = image_export_filetype::png16;
+        check(image_export(*im, png16.c_str(), options, &rows), "png16 export with options");
+        check(rows == h, "rows of the png16 export");
+        check(same_heights(image_import(png16.c_str(), image_format::gray16), w, h), "png16 round trip with options");
+        rows = -1;
+        options.filetype = image_export_filetype::png;
+        check(image_export(*im, png.c_str(), options, &rows), "png export with options");
+        check(rows == h, "rows of the png export");
+        check(same_bytes(image_import(png.c_str(), image_format::gray16), im), "png round trip with options");
+        }
+
+    const std::string r16 = file("options.r16");
+    const std::string bmp = file("options.bmp");
+    std::atomic<int32_t> rows16(-1), rows_bmp(-1);
+    image_export_options r16_options = options;
+    r16_options.filetype = image_export_filetype::r16;
+    image_export_options bmp_options = options;
+    bmp_options.filetype = image_export_filetype::bmp;
+    bool r16_ok = false, bmp_ok = false;
+    std::thread r16_thread([&]() { r16_ok = image_export(*im, r16.c_str(), r16_options, &rows16); });
+    std::thread bmp_thread([&]() { bmp_ok = image_export(*im, bmp.c_str(), bmp_options, &rows_bmp); });
+    r16_thread.join();
+    bmp_thread.join();
+    check(r16_ok && rows16 == h, "r16 export on a thread");
+    check(bmp_ok && rows_bmp == h, "bmp export on a thread");
+    check(same_heights(image_import_raw(r16.c_str(), w, h, image_raw_format::r16, image_format::gray16), w, h), "r16 round trip on a thread");
+    check(same_bytes(image_import(bmp.c_str(), image_format::gray16), im), "bmp round trip on a thread");
+
+    remove(png16.c_str());
+    remove(png.c_str());
+    remove(r16.c_str());
+    remove(bmp.c_str());
+    }
+  }
+
+int main(int argc, char** argv)
+  {
+  folder = argc > 1 ? argv[1] : ".";
+  test_raw_import();
+  test_lossless_export();
+  test_8_bit_export();
+  test_export_options();
+  if (failures == 0)
+    printf("image_io_test passed\n");
+  return failures == 0 ? 0 : 1;
+  }
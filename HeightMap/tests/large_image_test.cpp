@@ -0,0 +1,69 @@
+// Checks the 64-bit pixel counts and offsets on a 50000 x 50000 map, 2.5 billion pixels, which is more than an int32_t can count.
+// The map is a mapped sparse file, and only its last rows are touched, so the test needs little memory and disk.
+
+#include "image.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+
+namespace
+  {
+  int failures = 0;
+
+  void check(bool ok, const char* what)
+    {
+    if (!ok)
+      {
+      printf("FAILED: %s\n", what);
+      ++failures;
+      }
+    }
+
+  uint16_t pixel(const std::unique_ptr<image>& im, int32_t x, int32_t y)
+    {
+    return ((const uint16_t*)im->data())[(int64_t)y * im->width() + x];
+    }
+  }
+
+int main(int argc, char** argv)
+  {
+  const std::string filename = std::string(argc > 1 ? argv[1] : ".") + "/large_image_test.raw";
+  const int32_t w = 50000;
+  const int32_t h = 50000;
+  remove(filename.c_str());
+    {
+    std::unique_ptr<image> im = image_mapped(filename.c_str(), w, h, image_format::gray16);
+    check(im != nullptr, "image_mapped of 50000 x 50000 gray16");
+    if (!im)
+      return 1;
+    check(im->mapped(), "the image is mapped");
+    check(im->size() == 2500000000ll, "size() counts all pixels");
+    check(pixel(im, w - 1, h - 1) == 0, "a new file is zero");
+
+    // the far corner, by pixel index and through a view
+    ((uint16_t*)im->data())[im->size() - 1] = 0x1234;
+    const image_view corner(im, w - 1, h - 1, 1, 1);
+    check(!corner.empty() && corner.data() == (uint8_t*)im->data() + (im->size() - 1) * 2, "view of the far corner");
+    check(pixel(im, w - 1, h - 1) == 0x1234, "far corner pixel");
+
+    // image_color on the last rows only
+    const image_view bottom(im, 0, h - 4, w, 4);
+    image_color(bottom, image_color_mode::add, 0xff404040);
+    const uint16_t added = pixel(im, 0, h - 4);
+    check(added != 0, "image_color changes the last rows");
+    check(pixel(im, 0, h - 5) == 0, "image_color leaves the rows above the view");
+    check(pixel(im, w - 1, h - 1) == (uint16_t)(0x1234 + added), "image_color reaches the far corner");
+
+    // a glow around the bottom center, positioned relative to the whole map
+    const uint16_t before = pixel(im, w / 2, h - 1);
+    image_glow_rect(bottom, 0.5f, 1.f, 0.01f, 0.01f, 0.f, 0.f, 0xffffffff, 1.f, 1.f, image_glow_rect_wrap::on, image_glow_rect_flags::normal_ellipse);
+    check(pixel(im, w / 2, h - 1) > before, "image_glow_rect brightens the bottom center");
+    check(pixel(im, 0, h - 1) == added, "image_glow_rect leaves the bottom left corner");
+    check(pixel(im, w / 2, h - 5) == 0, "image_glow_rect leaves the rows above the view");
+    }
+  remove(filename.c_str());
+  if (failures == 0)
+    printf("large_image_test passed\n");
+  return failures == 0 ? 0 : 1;
+  }
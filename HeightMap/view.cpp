@@ -4,6 +4,12 @@
 #include <vector>
 #include <sstream>
 #include <numeric>
+#include <thread>
+#include <fstream>
+#include <cmath>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
 
 #include "imgui.h"
 #include "imgui_impl_sdl2.h"
@@ -69,21 +75,109 @@ namespace
     vec.erase(++last, vec.end());
     }
 
-  SDL_Surface* create_sdl_surface(const std::unique_ptr<image>& im)
+  int32_t get_nr_of_threads(const settings& s)
     {
-    SDL_Surface* surf = SDL_CreateRGBSurface(0, im->width(), im->height(), 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
+    if (s.nr_of_threads > 0)
+      return s.nr_of_threads;
+    return std::max<int32_t>(1, (int32_t)std::thread::hardware_concurrency());
+    }
+
+  // Only synthesizes the noise octaves again if one of the parameters they depend on changed.
+  void update_noise(std::unique_ptr<image_perlin_noise>& noise, image_noise_generator generator, int32_t xs, int32_t ys, int32_t freq, int32_t oct, float fadeoff, int32_t seed, image_perlin_mode mode, int32_t nr_of_threads)
+    {
+    if (noise && noise->matches(default_perlin_context(), generator, xs, ys, freq, oct, fadeoff, seed, mode))
+      return;
+    noise.reset(); // release the old field before allocating the new one
+    noise = image_noise_synthesize(default_perlin_context(), generator, xs, ys, freq, oct, fadeoff, seed, mode, nr_of_threads);
+    }
+
+  // Reads the heightmap that replaces the noise. Raw files (.r16 and .raw hold unsigned 16 bit heights, .r32 floats) have no header,
+  // their size is raw_width x raw_height of the settings, where a size of 0 is derived from the file size, and both 0 means square.
+  // Returns nullptr if a raw file doesn't hold exactly that many heights. Other files go through image_import.
+  std::unique_ptr<image> import_heightmap_file(const std::string& filename, const settings& s)
+    {
+    std::string ext = filename.substr(std::min(filename.size(), filename.find_last_of('.')));
+    std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    if (ext != ".r16" && ext != ".raw" && ext != ".r32")
+      return image_import(filename.c_str(), image_format::gray16);
+    const image_raw_format raw = ext == ".r32" ? image_raw_format::r32f : image_raw_format::r16;
+    std::ifstream f(filename, std::ios::binary | std::ios::ate);
+    if (!f)
+      return nullptr;
+    const int64_t pixels = (int64_t)f.tellg() / (raw == image_raw_format::r16 ? 2 : 4);
+    int64_t w = s.raw_width;
+    int64_t h = s.raw_height;
+    if (w <= 0 && h <= 0)
+      {
+      w = std::llround(std::sqrt((double)pixels));
+      h = w;
+      }
+    else if (w <= 0)
+      w = pixels / h;
+    else if (h <= 0)
+      h = pixels / w;
+    if (w < 1 || h < 1 || w > INT32_MAX || h > INT32_MAX || w * h != pixels)
+      return nullptr;
+    return image_import_raw(filename.c_str(), (int32_t)w, (int32_t)h, raw, image_format::gray16);
+    }
+
+  // Every 2^level-th pixel of the gray16 image im, like the noise of a scaled down map
+  std::unique_ptr<image> subsample(const image& im, int32_t level)
+    {
+    const int32_t w = (im.width() + (1 << level) - 1) >> level;
+    const int32_t h = (im.height() + (1 << level) - 1) >> level;
+    std::unique_ptr<image> out = std::make_unique<image>();
+    out->init(w, h, image_format::gray16);
+    const uint16_t* s = (const uint16_t*)im.data();
+    uint16_t* d = (uint16_t*)out->data();
+    for (int32_t y = 0; y < h; ++y)
+      {
+      const uint16_t* row = s + ((int64_t)y << level) * im.width();
+      for (int32_t x = 0; x < w; ++x)
+        *d++ = row[(int64_t)x << level];
+      }
+    return out;
+    }
+
+  SDL_Surface* create_sdl_surface(const image& im)
+    {
+    SDL_Surface* surf = SDL_CreateRGBSurface(0, im.width(), im.height(), 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000);
     return surf;
     }
 
-  void fill_sdl_surface(SDL_Surface* surf, const std::unique_ptr<image>& im)
+  void fill_sdl_surface(SDL_Surface* surf, const image& im)
     {
-    assert(surf->w == im->width());
-    assert(surf->h == im->height());
+    assert(surf->w == im.width());
+    assert(surf->h == im.height());
     SDL_LockSurface(surf);
-    fill_rgba_buffer_with_image(surf->pixels, surf->pitch, im);
+    fill_rgba_buffer_with_image(surf->pixels, surf->pitch, image_view((void*)im.data(), im.width(), im.height(), im.width(), im.format()));
     SDL_UnlockSurface(surf);
     }
 
+  // The export format of a map in the settings, png if the settings file holds an unknown one
+  image_export_filetype export_filetype(int32_t format)
+    {
+    if (format < (int32_t)image_export_filetype::png || format > (int32_t)image_export_filetype::qoi16)
+      return image_export_filetype::png;
+    return (image_export_filetype)format;
+    }
+
+  const char* export_extension(image_export_filetype filetype)
+    {
+    switch (filetype)
+      {
+      case image_export_filetype::jpg: return ".jpg";
+      case image_export_filetype::bmp: return ".bmp";
+      case image_export_filetype::tga: return ".tga";
+      case image_export_filetype::r16: return ".r16";
+      case image_export_filetype::r32f: return ".r32";
+      case image_export_filetype::pfm: return ".pfm";
+      case image_export_filetype::qoi: return ".qoi";
+      case image_export_filetype::qoi16: return ".qoi16";
+      default: return ".png";
+      }
+    }
+
   struct map_color
     {
     map_color(int32_t r, int32_t g, int32_t b, int32_t a, double h) : height(h)
@@ -108,96 +202,90 @@ namespace
     return clrs;
     }
 
-  template <class T>
-  inline T clamp(T a, T minimum, T maximum)
+  std::vector<map_color> sorted_map_colors(const std::vector<uint32_t>& colors, const std::vector<double>& heights)
     {
-    return a < minimum ? minimum : a > maximum ? maximum : a;
+    std::vector<map_color> clrs = build_map_colors(colors, heights);
+    std::sort(clrs.begin(), clrs.end(), [](const auto& left, const auto& right)
+      {
+      return left.height < right.height;
+      });
+    return clrs;
     }
 
-  uint64_t vary_color(uint64_t clr, uint64_t variation, int32_t strength)
+  // The color of the sorted palette clrs at height h in [0, 1], the range of heights of its stops scaled to [0, 1].
+  // Both the height table and the biome table are built with it.
+  uint32_t palette_color(const std::vector<map_color>& clrs, double h)
     {
-    int64_t red = clr & 0x7fff;
-    int64_t green = (clr >> 16) & 0x7fff;
-    int64_t blue = (clr >> 32) & 0x7fff;
-    int64_t alpha = (clr >> 48) & 0x7fff;
-
-    int64_t var = ((variation & 0x7fff) >> strength) - (0x7fff >> (1 + strength));
-
-    red += var;
-    green += var;
-    blue += var;
-
-    red = clamp<int64_t>(red, 0, 0x7fff);
-    green = clamp<int64_t>(green, 0, 0x7fff);
-    blue = clamp<int64_t>(blue, 0, 0x7fff);
-
-    return alpha << 48 | blue << 32 | green << 16 | red;
+    if (clrs.empty())
+      return 0xff000000;
+    double scale = h * (clrs.back().height - clrs.front().height) + clrs.front().height;
+    if (scale <= clrs.front().height)
+      return clrs.front().clr;
+    if (scale >= clrs.back().height)
+      return clrs.back().clr;
+    size_t k = 1;
+    while (clrs[k].height < scale)
+      ++k;
+    double alpha = (scale - clrs[k - 1].height) / (clrs[k].height - clrs[k - 1].height);
+    return (rgba(clrs[k - 1].clr) * (1 - alpha) + rgba(clrs[k].clr) * alpha).color();
     }
 
-  std::unique_ptr<image> image_height_to_color(const std::unique_ptr<image>& im_height, const std::unique_ptr<image>& im_variation, std::vector<map_color> colors, int32_t variation_strength)
+  // Only builds the table again if the palette changed.
+  const view_color_lut& update_color_lut(view_color_lut& lut, const std::vector<uint32_t>& colors, const std::vector<double>& heights)
     {
-    if (colors.empty())
+    if (!lut.colors.empty() && lut.colors == colors && lut.heights == heights)
+      return lut;
+    lut.colors = colors;
+    lut.heights = heights;
+    lut.table.clear();
+
+    const std::vector<map_color> clrs = sorted_map_colors(colors, heights);
+    if (clrs.size() < 2)
       {
-      return image_flat(im_height->width(), im_height->height(), 0xff000000);
+      lut.flat_color = clrs.empty() ? 0xff000000 : clrs.front().clr;
+      return lut;
       }
-    if (colors.size() == 1)
-      {
-      return image_flat(im_height->width(), im_height->height(), colors.front().clr);
-      }
-
-    std::sort(colors.begin(), colors.end(), [](const auto& left, const auto& right)
-      {
-      return left.height < right.height;
-      });
-
-    std::unique_ptr<image> im_out = std::make_unique<image>();
-    im_out->init(im_height->width(), im_height->height());
+    lut.table.resize(0x8000);
+    for (int32_t h = 0; h < 0x8000; ++h)
+      lut.table[h] = get_color_64(palette_color(clrs, (double)h / 0x7fff));
+    return lut;
+    }
 
-    double scale_range = colors.back().height - colors.front().height;
+  // The biome table has 1 << (biome_height_bits + biome_moisture_bits) entries, small enough to stay in the cache like the height table.
+  const int32_t biome_height_bits = 10;
+  const int32_t biome_moisture_bits = 5;
 
-    uint64_t* dest = im_out->data();
-    const uint64_t* height = im_height->data();
-    uint32_t count = im_out->size();
-    uint64_t default_variation = 0;
-    const uint64_t* variation = &default_variation;
-    if (im_variation.get())
-      variation = im_variation->data();
-    for (uint32_t i = 0; i < count; ++i)
+  // Only builds the biome table again if one of the palettes changed.
+  const view_color_lut& update_biome_lut(view_color_lut& lut, const settings& s)
+    {
+    update_color_lut(lut, s.colors, s.heights);
+    if (!lut.biome_table.empty() && lut.wet_colors == s.wet_colors && lut.wet_heights == s.wet_heights && lut.biome_colors == s.colors && lut.biome_heights == s.heights)
+      return lut;
+    lut.wet_colors = s.wet_colors;
+    lut.wet_heights = s.wet_heights;
+    lut.biome_colors = s.colors;
+    lut.biome_heights = s.heights;
+
+    const std::vector<map_color> dry = sorted_map_colors(s.colors, s.heights);
+    const std::vector<map_color> wet = sorted_map_colors(s.wet_colors, s.wet_heights);
+    const int32_t heights = 1 << biome_height_bits;
+    const int32_t moistures = 1 << biome_moisture_bits;
+    std::vector<rgba> dry_row(heights), wet_row(heights);
+    for (int32_t i = 0; i < heights; ++i)
       {
-      double scale = (double)(*height & 0x7fff) / 0x7fff;
-      scale *= scale_range;
-      scale += colors.front().height;
-      if (scale <= colors.front().height)
-        {
-        uint32_t target_color = colors.front().clr;
-        *dest = get_color_64(target_color);
-        }
-      else if (scale >= colors.back().height)
-        {
-        uint32_t target_color = colors.back().clr;
-        *dest = get_color_64(target_color);
-        }
-      else
-        {
-        int k = 1;
-        while (colors[k].height < scale)
-          ++k;
-        uint32_t blend_color_1 = colors[k - 1].clr;
-        uint32_t blend_color_2 = colors[k].clr;
-        rgba c1(blend_color_1);
-        rgba c2(blend_color_2);
-        double alpha = (scale - colors[k - 1].height) / (colors[k].height - colors[k - 1].height);
-        rgba c3 = c1 * (1 - alpha) + c2 * alpha;
-        *dest = get_color_64(c3.color());
-        }
-      if (*variation)
-        *dest = vary_color(*dest, *variation, variation_strength);
-      ++height;
-      ++dest;
-      if (im_variation.get())
-        ++variation;
+      // the center of the range of 15 bit heights that maps to entry i
+      const double h = (double)((i << (15 - biome_height_bits)) + (1 << (14 - biome_height_bits))) / 0x7fff;
+      dry_row[i] = rgba(palette_color(dry, h));
+      wet_row[i] = rgba(palette_color(wet, h));
       }
-    return im_out;
+    lut.biome_table.resize((size_t)heights * moistures);
+    for (int32_t m = 0; m < moistures; ++m)
+      {
+      const double t = (double)m / (moistures - 1);
+      for (int32_t i = 0; i < heights; ++i)
+        lut.biome_table[(size_t)m * heights + i] = get_color_64((dry_row[i] * (1 - t) + wet_row[i] * t).color());
+      }
+    return lut;
     }
 
   void make_color_set1(settings& s)
@@ -256,9 +344,260 @@ namespace
     s.colors.push_back(rgba(254, 254, 254, 255).color()); s.heights.push_back(1.0);
     }
 
+  // One row with a color, a height and a delete button per stop of the palette. Returns true if the palette changed.
+  bool edit_color_stops(const char* id, std::vector<uint32_t>& colors, std::vector<double>& heights)
+    {
+    bool dirty = false;
+    uint32_t colors_size = (uint32_t)colors.size();
+    if (heights.size() < colors_size)
+      colors_size = (uint32_t)heights.size();
+    std::vector<uint32_t> points_to_delete;
+    for (uint32_t i = 0; i < colors_size; ++i)
+      {
+      ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
+      std::stringstream str;
+      str << "##color_" << id << i;
+      float clr[4] = { (colors[i] & 255) / 255.f, ((colors[i] >> 8) & 255) / 255.f, ((colors[i] >> 16) & 255) / 255.f, ((colors[i] >> 24) & 255) / 255.f };
+      if (ImGui::ColorEdit4(str.str().c_str(), clr))
+        {
+        uint32_t red = (uint32_t)(clr[0] * 255.f);
+        uint32_t green = (uint32_t)(clr[1] * 255.f);
+        uint32_t blue = (uint32_t)(clr[2] * 255.f);
+        uint32_t alpha = (uint32_t)(clr[3] * 255.f);
+        colors[i] = alpha << 24 | blue << 16 | green << 8 | red;
+        dirty = true;
+        }
+      ImGui::PopItemWidth();
+
+      ImGui::SameLine();
+      ImGui::PushItemWidth(-30);
+      str.str("");
+      str.clear();
+      str << "##point_" << id << i;
+      float value = (float)heights[i];
+      if (ImGui::SliderFloat(str.str().c_str(), &value, 0.f, 1.f))
+        {
+        heights[i] = (double)value;
+        dirty = true;
+        }
+      ImGui::PopItemWidth();
+      ImGui::SameLine();
+
+      str.str("");
+      str.clear();
+      str << "X##_" << id << i;
+      if (ImGui::Button(str.str().c_str(), ImVec2(ImGui::GetContentRegionAvail().x, 0)))
+        {
+        points_to_delete.push_back(i);
+        }
+      }
+    if (!points_to_delete.empty())
+      {
+      delete_items(colors, points_to_delete);
+      delete_items(heights, points_to_delete);
+      dirty = true;
+      }
+    return dirty;
+    }
+
+  // The preview rectangle in view::loop is this many pixels wide.
+  const int32_t preview_size = 800;
+
+  // Maps with a width or height of at least this many pixels are shown as a preview first, and refined in the background.
+  const int32_t progressive_min_size = 2048;
+
+  // The preview is the map scaled down by 2^level, the largest level that still covers the preview rectangle.
+  // Level 0 means the full resolution map is computed right away.
+  int32_t get_preview_level(const settings& s, int32_t width, int32_t height)
+    {
+    const int32_t size = std::max(width, height);
+    if (!s.progressive_preview || size < progressive_min_size)
+      return 0;
+    int32_t level = 0;
+    while ((size >> (level + 1)) >= preview_size)
+      ++level;
+    return level;
+    }
+
+  // The island gradient of the map described by s, as an expression that is only evaluated where it is used
+  image_expression island_gradient(const settings& s, int32_t width, int32_t height)
+    {
+    image_expression gradient = image_expression::flat(width, height, 0xff000000, image_format::gray16).glow_rect(
+      s.island_center_x,
+      s.island_center_y,
+      s.island_radius_x,
+      s.island_radius_y,
+      s.island_size_x,
+      s.island_size_y,
+      0xffffffff,
+      s.island_blend,
+      s.island_power,
+      static_cast<image_glow_rect_wrap>(s.island_wrap),
+      static_cast<image_glow_rect_flags>(s.island_flags));
+    if (s.island_invert)
+      gradient = gradient.color(image_color_mode::mul, 0x00ffffff).color(image_color_mode::invert, 0);
+    return gradient;
+    }
+
+  // Merges the island gradient into the heightmap with the merge mode of s, in a single pass over the heightmap
+  void merge_island(std::unique_ptr<image>& heightmap, const image_expression& grad, const settings& s, int32_t nr_of_threads)
+    {
+    image_merge_mode mode = static_cast<image_merge_mode>(s.island_merge_mode);
+    image_expression h = image_expression::source(heightmap);
+    switch (mode)
+      {
+      case image_merge_mode::sub:
+        h = h.merge(mode, grad.color(image_color_mode::mul, 0x00ffffff).merge(image_merge_mode::min, h));
+        break;
+      case image_merge_mode::mul:
+        h = h.merge(mode, grad);
+        break;
+      default:
+        h = h.merge(mode, grad.color(image_color_mode::mul, 0x00ffffff));
+        break;
+      }
+    h.evaluate(heightmap, nr_of_threads);
+    }
+
+  // The colormap is varied by the variation map, which is also made when it is shown
+  bool uses_variation(const settings& s)
+    {
+    return s.auto_vary_colors || s.biomes || s.render_target == 4;
+    }
+
+  // Runs the whole pipeline (noise, island, normals, colors) for the map described by s, scaled down by 2^level.
+  // The noise of a map that is scaled down this way is the noise of the full map at every 2^level-th pixel, up to the
+  // rounding of the fixed point perlin steps. If source is not null, it is the gray16 heightmap that replaces the noise.
+  // Returns false if cancelled() returned true in between two stages, or if the noise can't be made for these settings.
+  template <class TCancelled>
+  bool build_maps(view_maps& maps, const settings& s, const image* source, int32_t level, std::unique_ptr<image_perlin_noise>& heightmap_noise, std::unique_ptr<image_perlin_noise>& variation_noise, view_color_lut& color_lut, int32_t nr_of_threads, TCancelled cancelled)
+    {
+    const int32_t map_width = source ? source->width() : s.width;
+    const int32_t map_height = source ? source->height() : s.height;
+    const int32_t width = (map_width + (1 << level) - 1) >> level;
+    const int32_t height = (map_height + (1 << level) - 1) >> level;
+    const image_noise_generator generator = static_cast<image_noise_generator>(s.generator);
+    std::unique_ptr<image> heightmap;
+    if (source)
+      {
+      heightmap_noise.reset();
+      heightmap = level > 0 ? subsample(*source, level) : source->copy();
+      }
+    else
+      {
+      update_noise(heightmap_noise, generator, width, height, s.frequency, s.octaves, s.fadeoff, s.seed, static_cast<image_perlin_mode>(s.mode), nr_of_threads);
+      if (!heightmap_noise || cancelled())
+        return false;
+      heightmap = image_perlin_resolve(*heightmap_noise, s.amplify, s.gamma, 0xff000000, 0xffffffff, image_format::gray16, nr_of_threads);
+      }
+    // The island gradient and the merge into the heightmap are each evaluated in a single pass, without intermediate images.
+    std::unique_ptr<image> islandgradient = island_gradient(s, width, height).evaluate(nr_of_threads);
+    if (s.make_island)
+      merge_island(heightmap, image_expression::source(islandgradient), s, nr_of_threads);
+    if (cancelled())
+      return false;
+    std::unique_ptr<image> normalmap = image_normals(heightmap, s.normalmap_strength, static_cast<image_normals_mode>(s.normalmap_mode));
+    if (cancelled())
+      return false;
+
+    std::unique_ptr<image> variation;
+    if (uses_variation(s))
+      {
+      update_noise(variation_noise, generator, width, height, s.variation_frequency, s.octaves, s.variation_fadeoff, s.seed + 1, static_cast<image_perlin_mode>(s.variation_mode), nr_of_threads);
+      if (!variation_noise || cancelled())
+        return false;
+      variation = image_perlin_resolve(*variation_noise, s.amplify, s.gamma, 0xff000000, 0xffffffff, image_format::gray16, nr_of_threads);
+      }
+    if (s.biomes)
+      maps.colormap = image_lookup(heightmap, variation, update_biome_lut(color_lut, s).biome_table.data(), biome_height_bits, biome_moisture_bits, nr_of_threads);
+    else
+      {
+      const view_color_lut& lut = update_color_lut(color_lut, s.colors, s.heights);
+      maps.colormap = lut.table.empty() ? image_flat(width, height, lut.flat_color) : image_colormap(heightmap, variation, lut.table.data(), s.variation_strength, nr_of_threads);
+      }
+    maps.heightmap = std::move(heightmap);
+    maps.normalmap = std::move(normalmap);
+    maps.islandgradient = std::move(islandgradient);
+    maps.variation = std::move(variation);
+    return true;
+    }
+
+  // Maps of at least this many pixels wide or high are exported from files that the pipeline streams its bands into,
+  // instead of from the maps in memory, so that their size is only limited by the disk.
+  const int32_t streamed_export_min_size = 16384;
+
+  // The bands of the streamed pipeline hold about this many bytes of rgba16 pixels.
+  const int64_t streamed_band_bytes = 64 << 20;
+
+  // The file in folder that the map called name is mapped to by build_mapped_maps
+  std::string mapped_map_file(const std::string& folder, const char* name)
+    {
+    return folder + "/" + name + ".map";
+    }
+
+  void remove_mapped_map_files(const std::string& folder)
+    {
+    for (const char* name : { "heightmap", "normalmap", "variation", "colormap" })
+      std::remove(mapped_map_file(folder, name).c_str());
+    }
+
+  // Runs the pipeline of build_maps for the full map in bands of rows, into images that are mapped to files in folder, so that
+  // only a band of each stage is in memory. Only the heightmap, normalmap and colormap are made. The variation file is
+  // removed again, the other files are left to the caller. Returns false if a file can't be mapped or the noise can't be made.
+  bool build_mapped_maps(view_maps& maps, const settings& s, const image* source, const std::string& folder, int32_t nr_of_threads)
+    {
+    const int32_t width = source ? source->width() : s.width;
+    const int32_t height = source ? source->height() : s.height;
+    const int32_t band_height = (int32_t)std::max<int64_t>(1, streamed_band_bytes / ((int64_t)width * 8));
+    const image_noise_generator generator = static_cast<image_noise_generator>(s.generator);
+    std::unique_ptr<image> heightmap = image_mapped(mapped_map_file(folder, "heightmap").c_str(), width, height, image_format::gray16);
+    if (!heightmap)
+      return false;
+    if (source)
+      memcpy(heightmap->data(), source->data(), (size_t)source->size() * source->bytes_per_pixel());
+    else if (!image_noise_stream(default_perlin_context(), generator, heightmap, s.frequency, s.octaves, s.fadeoff, s.seed, static_cast<image_perlin_mode>(s.mode), s.amplify, s.gamma, 0xff000000, 0xffffffff, band_height, nr_of_threads))
+      return false;
+    // the gradient is evaluated per tile within the merge, it never exists as a whole
+    if (s.make_island)
+      merge_island(heightmap, island_gradient(s, width, height), s, nr_of_threads);
+
+    std::unique_ptr<image> normalmap = image_mapped(mapped_map_file(folder, "normalmap").c_str(), width, height, image_format::rgba16);
+    if (!normalmap || !image_normals_stream(heightmap, normalmap, s.normalmap_strength, static_cast<image_normals_mode>(s.normalmap_mode), band_height))
+      return false;
+
+    std::unique_ptr<image> variation;
+    if (uses_variation(s))
+      {
+      variation = image_mapped(mapped_map_file(folder, "variation").c_str(), width, height, image_format::gray16);
+      if (!variation || !image_noise_stream(default_perlin_context(), generator, variation, s.variation_frequency, s.octaves, s.variation_fadeoff, s.seed + 1, static_cast<image_perlin_mode>(s.variation_mode), s.amplify, s.gamma, 0xff000000, 0xffffffff, band_height, nr_of_threads))
+        return false;
+      }
+    std::unique_ptr<image> colormap = image_mapped(mapped_map_file(folder, "colormap").c_str(), width, height, image_format::rgba16);
+    if (!colormap)
+      return false;
+    view_color_lut lut;
+    if (s.biomes)
+      {
+      if (!image_lookup_stream(heightmap, variation, update_biome_lut(lut, s).biome_table.data(), biome_height_bits, biome_moisture_bits, colormap, band_height, nr_of_threads))
+        return false;
+      }
+    else if (update_color_lut(lut, s.colors, s.heights).table.empty())
+      image_expression::flat(width, height, lut.flat_color, image_format::rgba16).evaluate(colormap, nr_of_threads);
+    else if (!image_colormap_stream(heightmap, variation, lut.table.data(), s.variation_strength, colormap, band_height, nr_of_threads))
+      return false;
+    variation.reset();
+    std::remove(mapped_map_file(folder, "variation").c_str());
+
+    maps.heightmap = std::move(heightmap);
+    maps.normalmap = std::move(normalmap);
+    maps.colormap = std::move(colormap);
+    return true;
+    }
+
   }
 
-view::view() : _w(1600), _h(900), _quit(false)
+view::view() : _w(1600), _h(900), _quit(false), _heightmap_source_raw_width(0), _heightmap_source_raw_height(0), _showing_preview(false),
+  _refine_requested(0), _refine_started(0), _refined_generation(0), _refine_quit(false)
   {
   image_init();
   _window = SDL_CreateWindow("HeightMap",
@@ -283,9 +622,11 @@ view::view() : _w(1600), _h(900), _quit(false)
   ImGui::GetStyle().Colors[ImGuiCol_TitleBg] = ImGui::GetStyle().Colors[ImGuiCol_TitleBgActive];
 
   _settings = read_settings("heightmapsettings.json");
+  _map_width = _settings.width;
+  _map_height = _settings.height;
   _heightmap = image_flat(_settings.width, _settings.height, 0xff00ff00);
-  _heightmap_surface = create_sdl_surface(_heightmap);
-  fill_sdl_surface(_heightmap_surface, _heightmap);
+  _heightmap_surface = create_sdl_surface(*_heightmap);
+  fill_sdl_surface(_heightmap_surface, *_heightmap);
   _heightmap_texture = SDL_CreateTextureFromSurface(_renderer, _heightmap_surface);
 
   if (_settings.colors.empty() || _settings.heights.empty())
@@ -294,10 +635,28 @@ view::view() : _w(1600), _h(900), _quit(false)
     }
 
   _dirty = true;
+  _refine_thread = std::thread(&view::_refine_loop, this);
   }
 
 view::~view()
   {
+  {
+  std::lock_guard<std::mutex> lock(_refine_mutex);
+  _refine_quit = true;
+  ++_refine_requested; // cancels the maps that are being built
+  }
+  _refine_cv.notify_all();
+  _refine_thread.join();
+  for (auto& job : _export_jobs)
+    {
+    job->thread.join();
+    if (!job->mapped_file.empty())
+      {
+      job->map.reset();
+      std::remove(job->mapped_file.c_str());
+      }
+    }
+
   write_settings(_settings, "heightmapsettings.json");
   ImGui_ImplSDLRenderer_Shutdown();
   ImGui_ImplSDL2_Shutdown();
@@ -320,18 +679,41 @@ void view::_imgui_ui()
 
   if (ImGui::Begin("Parameters", 0, ImGuiWindowFlags_NoDecoration))
     {
-    ImGui::BeginChild("Heightmap", ImVec2(0.0, 200.0f), true);
+    ImGui::BeginChild("Heightmap", ImVec2(0.0, 320.0f), true);
     ImGui::BeginGroup();
     int size[2] = { (int)_settings.width, (int)_settings.height };
     if (ImGui::InputInt2("Heightmap size", size))
       {
-      if (size[0] > 0 && size[1] > 0)
+      if (size[0] > 0 && size[1] > 0 && size[0] <= 65536 && size[1] <= 65536)
         {
         _settings.width = size[0];
         _settings.height = size[1];
         _dirty = true;
         }
       }
+    static bool open_heightmap_file = false;
+    if (ImGui::Button("...##2"))
+      {
+      open_heightmap_file = true;
+      }
+    ImGui::SameLine();
+    static char heightmap_file[1024];
+    for (size_t i = 0; i <= _settings.heightmap_file.length(); ++i)
+      heightmap_file[i] = _settings.heightmap_file[i];
+    if (ImGui::InputText("Heightmap file (empty for noise)", heightmap_file, IM_ARRAYSIZE(heightmap_file)))
+      {
+      _settings.heightmap_file = std::string(heightmap_file);
+      _dirty = true;
+      }
+    int raw_size[2] = { (int)_settings.raw_width, (int)_settings.raw_height };
+    if (ImGui::InputInt2("Raw file size (0 from the file)", raw_size))
+      {
+      _settings.raw_width = std::max(raw_size[0], 0);
+      _settings.raw_height = std::max(raw_size[1], 0);
+      _dirty = true;
+      }
+    if (_heightmap_source)
+      ImGui::Text("Heightmap file size: %d x %d", _heightmap_source->width(), _heightmap_source->height());
     if (ImGui::InputInt("Heightmap frequency", &_settings.frequency))
       {
       _dirty = true;
@@ -348,6 +730,15 @@ void view::_imgui_ui()
       {
       _dirty = true;
       }
+    if (ImGui::Checkbox("Progressive preview", &_settings.progressive_preview))
+      {
+      _dirty = true;
+      }
+    const char* height_generator[] = { "perlin", "simplex" };
+    if (ImGui::Combo("Heightmap generator", &_settings.generator, height_generator, IM_ARRAYSIZE(height_generator)))
+      {
+      _dirty = true;
+      }
     const char* height_mode[] = { "norm", "abs", "sin", "abs+sin" };
     if (ImGui::Combo("Heightmap mode", &_settings.mode, height_mode, IM_ARRAYSIZE(height_mode)))
       {
@@ -428,7 +819,7 @@ void view::_imgui_ui()
       {
       _dirty = true;
       }
-    const char* island_merge_mode[] = { "add", "sub", "mul", "min", "max" };
+    const char* island_merge_mode[] = { "add", "sub", "mul", "min", "max", "add (saturate)", "sub (saturate)" };
     if (ImGui::Combo("Island merge mode", &_settings.island_merge_mode, island_merge_mode, IM_ARRAYSIZE(island_merge_mode)))
       {
       _dirty = true;
@@ -456,55 +847,8 @@ void view::_imgui_ui()
       {
       _dirty = true;
       }
-    uint32_t colors_size = (uint32_t)_settings.colors.size();
-    if (_settings.heights.size() < colors_size)
-      colors_size = (uint32_t)_settings.heights.size();
-    std::vector<uint32_t> points_to_delete;
-    for (uint32_t i = 0; i < colors_size; ++i)
-      {
-      ImGui::PushItemWidth(ImGui::GetContentRegionAvail().x * 0.5f);
-      std::stringstream str;
-      str << "##color_" << i;
-      float clr[4] = { (_settings.colors[i] & 255) / 255.f, ((_settings.colors[i] >> 8) & 255) / 255.f, ((_settings.colors[i] >> 16) & 255) / 255.f, ((_settings.colors[i] >> 24) & 255) / 255.f };
-      if (ImGui::ColorEdit4(str.str().c_str(), clr))
-        {
-        uint32_t red = (uint32_t)(clr[0] * 255.f);
-        uint32_t green = (uint32_t)(clr[1] * 255.f);
-        uint32_t blue = (uint32_t)(clr[2] * 255.f);
-        uint32_t alpha = (uint32_t)(clr[3] * 255.f);
-        _settings.colors[i] = alpha << 24 | blue << 16 | green << 8 | red;
-        _dirty = true;
-        }
-      ImGui::PopItemWidth();
-
-      ImGui::SameLine();
-      ImGui::PushItemWidth(-30);
-      str.str("");
-      str.clear();
-      str << "##point_" << i;
-      float value = (float)_settings.heights[i];
-      if (ImGui::SliderFloat(str.str().c_str(), &value, 0.f, 1.f))
-        {
-        _settings.heights[i] = (double)value;
-        _dirty = true;
-        }
-      ImGui::PopItemWidth();
-      ImGui::SameLine();
-
-      str.str("");
-      str.clear();
-      str << "X##_" << i;
-      if (ImGui::Button(str.str().c_str(), ImVec2(ImGui::GetContentRegionAvail().x, 0)))
-        {
-        points_to_delete.push_back(i);
-        }
-      }
-    if (!points_to_delete.empty())
-      {
-      delete_items(_settings.colors, points_to_delete);
-      delete_items(_settings.heights, points_to_delete);
+    if (edit_color_stops("", _settings.colors, _settings.heights))
       _dirty = true;
-      }
     if (ImGui::Button("Set1"))
       {
       make_color_set1(_settings);
@@ -538,10 +882,45 @@ void view::_imgui_ui()
       {
       _dirty = true;
       }
+    if (ImGui::Checkbox("Biomes (the variation is the moisture)", &_settings.biomes))
+      {
+      if (_settings.wet_colors.empty() || _settings.wet_heights.empty())
+        {
+        _settings.wet_colors = _settings.colors;
+        _settings.wet_heights = _settings.heights;
+        }
+      _dirty = true;
+      }
+    if (_settings.biomes)
+      {
+      ImGui::Text("Wet colors");
+      if (ImGui::Button("Add##wet", ImVec2(ImGui::GetContentRegionAvail().x * 0.3333f, 0)))
+        {
+        _settings.wet_heights.push_back(0.0);
+        _settings.wet_colors.push_back(0xff00ff00);
+        _dirty = true;
+        }
+      ImGui::SameLine();
+      if (ImGui::Button("Sort##wet", ImVec2(ImGui::GetContentRegionAvail().x * 0.5f, 0)))
+        {
+        auto p = sort_permutation(_settings.wet_heights, [](auto left, auto right) { return left < right; });
+        _settings.wet_heights = apply_permutation(_settings.wet_heights, p);
+        _settings.wet_colors = apply_permutation(_settings.wet_colors, p);
+        }
+      ImGui::SameLine();
+      if (ImGui::Button("Copy colors", ImVec2(ImGui::GetContentRegionAvail().x, 0)))
+        {
+        _settings.wet_colors = _settings.colors;
+        _settings.wet_heights = _settings.heights;
+        _dirty = true;
+        }
+      if (edit_color_stops("wet", _settings.wet_colors, _settings.wet_heights))
+        _dirty = true;
+      }
     ImGui::EndGroup();
     ImGui::EndChild();
 
-    ImGui::BeginChild("ImportExport", ImVec2(0.0, 90.0f), true);
+    ImGui::BeginChild("ImportExport", ImVec2(0.0, 250.0f), true);
     ImGui::BeginGroup();
     static bool open_export_settings_file = false;
     static bool open_import_settings_file = false;
@@ -565,13 +944,44 @@ void view::_imgui_ui()
       export_folder[i] = _settings.export_folder[i];
     ImGui::InputText("Export folder", export_folder, IM_ARRAYSIZE(export_folder));
     _settings.export_folder = std::string(export_folder);
-    if (ImGui::Button("Export images"))
+    const char* export_formats[] = { "png", "jpg", "bmp", "tga", "png 16 bit", "r16", "r32f", "pfm", "qoi", "qoi 16 bit" };
+    ImGui::Combo("Heightmap format", &_settings.heightmap_export_format, export_formats, IM_ARRAYSIZE(export_formats));
+    ImGui::SliderInt("Heightmap compression", &_settings.heightmap_export_level, 1, 9);
+    ImGui::Combo("Normalmap format", &_settings.normalmap_export_format, export_formats, IM_ARRAYSIZE(export_formats));
+    ImGui::SliderInt("Normalmap compression", &_settings.normalmap_export_level, 1, 9);
+    ImGui::Combo("Colormap format", &_settings.colormap_export_format, export_formats, IM_ARRAYSIZE(export_formats));
+    ImGui::SliderInt("Colormap compression", &_settings.colormap_export_level, 1, 9);
+    _check_exports();
+    if (_export_jobs.empty())
+      {
+      if (ImGui::Button("Export images"))
+        {
+        _export_images();
+        }
+      if (!_export_status.empty())
+        {
+        ImGui::SameLine();
+        ImGui::Text("%s", _export_status.c_str());
+        }
+      }
+    for (const auto& job : _export_jobs)
       {
-      _export_images();
+      // the rows are written once per strip, so the bar moves in steps for large maps
+      const float fraction = job->map->height() > 0 ? (float)job->rows / (float)job->map->height() : 1.f;
+      ImGui::ProgressBar(fraction, ImVec2(0.f, 0.f), job->filename.c_str());
       }
     ImGui::EndGroup();
     ImGui::EndChild();
 
+    static ImGuiFs::Dialog open_heightmap_file_dlg(false, true, true);
+    const char* openHeightmapFileChosenPath = open_heightmap_file_dlg.chooseFileDialog(open_heightmap_file, _settings.export_folder.c_str(), ".png;.qoi;.qoi16;.r16;.raw;.r32", "Open heightmap", ImVec2(-1, -1), ImVec2(50, 50));
+    open_heightmap_file = false;
+    if (strlen(openHeightmapFileChosenPath) > 0)
+      {
+      _settings.heightmap_file = open_heightmap_file_dlg.getChosenPath();
+      _dirty = true;
+      }
+
     static ImGuiFs::Dialog open_export_folder_dlg(false, true, true);
     const char* openExportFolderChosenPath = open_export_folder_dlg.chooseFolderDialog(open_export_folder, _settings.export_folder.c_str(), "Open export folder", ImVec2(-1, -1), ImVec2(50, 50));
     open_export_folder = false;
@@ -635,6 +1045,11 @@ void view::_imgui_ui()
       _settings.render_target = 4;
       _dirty = true;
       }
+    if (_showing_preview)
+      {
+      ImGui::SameLine();
+      ImGui::Text("Refining...");
+      }
     }
   ImGui::End();
 
@@ -644,105 +1059,219 @@ void view::_imgui_ui()
 
 void view::_export_images()
   {
-  std::string heightmap_filename = _settings.export_folder + "/heightmap.png";
-  std::string normalmap_filename = _settings.export_folder + "/normalmap.png";
-  std::string colormap_filename = _settings.export_folder + "/colormap.png";
-  image_export(_heightmap, heightmap_filename.c_str(), image_export_filetype::png, 100);
-  image_export(_normalmap, normalmap_filename.c_str(), image_export_filetype::png, 100);
-  image_export(_colormap, colormap_filename.c_str(), image_export_filetype::png, 100);
-  }
-
-void view::_check_image()
-  {
-  if (!_dirty)
+  if (!_export_jobs.empty()) // the previous export is still running
     return;
-  bool _reallocate_sdl_surface = (_settings.width != _heightmap->width() || _settings.height != _heightmap->height());
-  _heightmap = image_perlin(_settings.width, _settings.height, _settings.frequency, _settings.octaves, _settings.fadeoff, _settings.seed, static_cast<image_perlin_mode>(_settings.mode), _settings.amplify, _settings.gamma, 0xff000000, 0xffffffff);
-  _islandgradient = image_flat(_settings.width, _settings.height, 0xff000000);
-  image_glow_rect(_islandgradient,
-    _settings.island_center_x,
-    _settings.island_center_y,
-    _settings.island_radius_x,
-    _settings.island_radius_y,
-    _settings.island_size_x,
-    _settings.island_size_y,
-    0xffffffff,
-    _settings.island_blend,
-    _settings.island_power,
-    static_cast<image_glow_rect_wrap>(_settings.island_wrap),
-    static_cast<image_glow_rect_flags>(_settings.island_flags));
-
-  if (_settings.island_invert)
-    {
-    image_color(_islandgradient, image_color_mode::mul, 0x00ffffff);
-    image_color(_islandgradient, image_color_mode::invert, 0);
-    }
-  if (_settings.make_island)
-    {
-    image_merge_mode mode = static_cast<image_merge_mode>(_settings.island_merge_mode);
-    switch (mode)
-      {
-      case image_merge_mode::sub:
+  // the preview is never exported
+  _check_image();
+  _export_status.clear();
+  const bool streamed = std::max(_map_width, _map_height) >= streamed_export_min_size;
+  view_maps mapped;
+  if (streamed)
+    {
+    if (!build_mapped_maps(mapped, _settings, _heightmap_source.get(), _settings.export_folder, get_nr_of_threads(_settings)))
       {
-      std::unique_ptr<image> grad = _islandgradient->copy();
-      image_color(grad, image_color_mode::mul, 0x00ffffff);
-      grad = image_merge(image_merge_mode::min, 2, &_heightmap, &grad);
-      _heightmap = image_merge(mode, 2, &_heightmap, &grad);
-      break;
+      mapped = view_maps();
+      remove_mapped_map_files(_settings.export_folder);
+      _export_status = "Export failed: the maps can't be made in " + _settings.export_folder;
+      return;
       }
-      case image_merge_mode::mul:
+    }
+  else
+    _wait_for_refinement();
+  struct export_target
+    {
+    const char* name;
+    std::shared_ptr<image> map;
+    int32_t format;
+    int32_t level;
+    };
+  const export_target targets[] = {
+    {"heightmap", streamed ? std::shared_ptr<image>(std::move(mapped.heightmap)) : _heightmap, _settings.heightmap_export_format, _settings.heightmap_export_level},
+    {"normalmap", streamed ? std::shared_ptr<image>(std::move(mapped.normalmap)) : _normalmap, _settings.normalmap_export_format, _settings.normalmap_export_level},
+    {"colormap", streamed ? std::shared_ptr<image>(std::move(mapped.colormap)) : _colormap, _settings.colormap_export_format, _settings.colormap_export_level}
+    };
+  for (const export_target& target : targets)
+    {
+    std::unique_ptr<view_export_job> job = std::make_unique<view_export_job>();
+    job->options.filetype = export_filetype(target.format);
+    job->options.jpeg_quality = 100;
+    job->options.compression_level = target.level;
+    job->options.nr_of_threads = get_nr_of_threads(_settings);
+    job->filename = _settings.export_folder + "/" + target.name + export_extension(job->options.filetype);
+    job->map = target.map;
+    job->mapped_file = streamed ? mapped_map_file(_settings.export_folder, target.name) : std::string();
+    job->rows = 0;
+    job->done = false;
+    job->ok = false;
+    view_export_job* j = job.get();
+    job->thread = std::thread([j]()
       {
-      _heightmap = image_merge(mode, 2, &_heightmap, &_islandgradient);
-      break;
-      }
-      default:
+      j->ok = image_export(*j->map, j->filename.c_str(), j->options, &j->rows);
+      j->done = true;
+      });
+    _export_jobs.push_back(std::move(job));
+    }
+  }
+
+void view::_check_exports()
+  {
+  for (const auto& job : _export_jobs)
+    {
+    if (!job->done)
+      return;
+    }
+  for (auto& job : _export_jobs)
+    {
+    job->thread.join();
+    if (!job->ok)
+      _export_status += "Export failed: " + job->filename + "\n";
+    if (!job->mapped_file.empty())
       {
-      std::unique_ptr<image> grad = _islandgradient->copy();
-      image_color(grad, image_color_mode::mul, 0x00ffffff);
-      _heightmap = image_merge(mode, 2, &_heightmap, &grad);
-      break;
-      }
+      job->map.reset(); // unmaps the file before it is removed
+      std::remove(job->mapped_file.c_str());
       }
     }
-  _normalmap = image_normals(_heightmap, _settings.normalmap_strength, static_cast<image_normals_mode>(_settings.normalmap_mode));
+  if (!_export_jobs.empty() && _export_status.empty())
+    _export_status = "Exported";
+  _export_jobs.clear();
+  }
+
+void view::_check_image()
+  {
+  if (!_dirty)
+    return;
+  _update_heightmap_source();
+  {
+  std::lock_guard<std::mutex> lock(_refine_mutex);
+  _refine_settings = _settings;
+  _refine_source = _heightmap_source;
+  ++_refine_requested;
+  }
+  _refine_cv.notify_all();
+
+  const int32_t level = get_preview_level(_settings, _map_width, _map_height);
+  if (level > 0)
+    {
+    view_maps preview;
+    if (build_maps(preview, _settings, _heightmap_source.get(), level, _preview_heightmap_noise, _preview_variation_noise, _preview_color_lut, get_nr_of_threads(_settings), [] { return false; }))
+      _show_maps(preview, true);
+    }
+  else
+    {
+    _preview_heightmap_noise.reset();
+    _preview_variation_noise.reset();
+    _wait_for_refinement();
+    }
+  _dirty = false;
+  }
+
+void view::_update_heightmap_source()
+  {
+  if (_settings.heightmap_file != _heightmap_source_file || _settings.raw_width != _heightmap_source_raw_width || _settings.raw_height != _heightmap_source_raw_height)
+    {
+    _heightmap_source_file = _settings.heightmap_file;
+    _heightmap_source_raw_width = _settings.raw_width;
+    _heightmap_source_raw_height = _settings.raw_height;
+    _heightmap_source.reset();
+    if (!_heightmap_source_file.empty())
+      _heightmap_source = import_heightmap_file(_heightmap_source_file, _settings); // null if it can't be read, then the noise is used
+    }
+  // the map has the size of the heightmap, also for the preview level, the noise size in the settings is kept for when the file is cleared
+  _map_width = _heightmap_source ? _heightmap_source->width() : _settings.width;
+  _map_height = _heightmap_source ? _heightmap_source->height() : _settings.height;
+  }
 
-  std::vector<map_color> colors = build_map_colors(_settings.colors, _settings.heights);
-  std::unique_ptr<image> _variation;
-  if (_settings.auto_vary_colors || _settings.render_target == 4)
+void view::_check_refinement()
+  {
+  std::unique_ptr<view_maps> maps;
+  {
+  std::lock_guard<std::mutex> lock(_refine_mutex);
+  if (_refined && _refined_generation == _refine_requested)
+    maps = std::move(_refined);
+  }
+  if (maps)
+    _show_maps(*maps, false);
+  }
+
+void view::_wait_for_refinement()
+  {
+  std::unique_ptr<view_maps> maps;
+  {
+  std::unique_lock<std::mutex> lock(_refine_mutex);
+  _refine_cv.wait(lock, [&] { return _refined_generation == _refine_requested; });
+  maps = std::move(_refined);
+  }
+  if (maps) // otherwise the full resolution maps are shown already
+    _show_maps(*maps, false);
+  }
+
+void view::_refine_loop()
+  {
+  std::unique_lock<std::mutex> lock(_refine_mutex);
+  for (;;)
     {
-    _variation = image_perlin(_settings.width, _settings.height, _settings.variation_frequency, _settings.octaves, _settings.variation_fadeoff, _settings.seed + 1, static_cast<image_perlin_mode>(_settings.variation_mode), _settings.amplify, _settings.gamma, 0xff000000, 0xffffffff);
+    _refine_cv.wait(lock, [&] { return _refine_quit || _refine_started != _refine_requested; });
+    if (_refine_quit)
+      return;
+    const uint64_t generation = _refine_requested;
+    const settings s = _refine_settings;
+    const std::shared_ptr<const image> source = _refine_source;
+    _refine_started = generation;
+    lock.unlock();
+
+    std::unique_ptr<view_maps> maps = std::make_unique<view_maps>();
+    // a newer request makes this one obsolete, so it is abandoned at the next stage
+    const bool done = build_maps(*maps, s, source.get(), 0, _heightmap_noise, _variation_noise, _color_lut, get_nr_of_threads(s), [&] { return _refine_requested != generation; });
+
+    lock.lock();
+    if (generation == _refine_requested)
+      {
+      // not done without a newer request means the settings gave no maps, the maps that are shown stay
+      _refined = done ? std::move(maps) : nullptr;
+      _refined_generation = generation;
+      _refine_cv.notify_all();
+      }
     }
-  _colormap = image_height_to_color(_heightmap, _variation, colors, _settings.variation_strength);
-  if (_reallocate_sdl_surface)
+  }
+
+void view::_show_maps(view_maps& maps, bool preview)
+  {
+  _heightmap = std::move(maps.heightmap);
+  _normalmap = std::move(maps.normalmap);
+  _colormap = std::move(maps.colormap);
+  _islandgradient = std::move(maps.islandgradient);
+  _variation = std::move(maps.variation);
+  _showing_preview = preview;
+
+  if (_heightmap_surface->w != _heightmap->width() || _heightmap_surface->h != _heightmap->height())
     {
     SDL_FreeSurface(_heightmap_surface);
-    _heightmap_surface = create_sdl_surface(_heightmap);
+    _heightmap_surface = create_sdl_surface(*_heightmap);
     }
   switch (_settings.render_target)
     {
     case 0:
-      fill_sdl_surface(_heightmap_surface, _heightmap);
+      fill_sdl_surface(_heightmap_surface, *_heightmap);
       break;
     case 1:
-      fill_sdl_surface(_heightmap_surface, _normalmap);
+      fill_sdl_surface(_heightmap_surface, *_normalmap);
       break;
     case 2:
-      fill_sdl_surface(_heightmap_surface, _colormap);
+      fill_sdl_surface(_heightmap_surface, *_colormap);
       break;
     case 3:
-      fill_sdl_surface(_heightmap_surface, _islandgradient);
+      fill_sdl_surface(_heightmap_surface, *_islandgradient);
       break;
     case 4:
       if (_variation.get())
-        fill_sdl_surface(_heightmap_surface, _variation);
+        fill_sdl_surface(_heightmap_surface, *_variation);
       break;
     default:
-      fill_sdl_surface(_heightmap_surface, _heightmap);
+      fill_sdl_surface(_heightmap_surface, *_heightmap);
       break;
     }
   SDL_DestroyTexture(_heightmap_texture);
   _heightmap_texture = SDL_CreateTextureFromSurface(_renderer, _heightmap_surface);
-  _dirty = false;
   }
 
 void view::loop()
@@ -753,6 +1282,7 @@ void view::loop()
     _poll_for_events();
     _imgui_ui();
     _check_image();
+    _check_refinement();
 
     SDL_RenderSetScale(_renderer, io.DisplayFramebufferScale.x, io.DisplayFramebufferScale.y);
     SDL_SetRenderDrawColor(_renderer, 10, 40, 80, 255);
@@ -761,9 +1291,9 @@ void view::loop()
     SDL_Rect destination;
     destination.x = 50;
     destination.y = 50;
-    destination.w = 800;
-    double scale = (double)_heightmap->height() / (double)_heightmap->width();
-    destination.h = (int)(800 * scale);
+    destination.w = preview_size;
+    double scale = (double)_map_height / (double)_map_width;
+    destination.h = (int)(preview_size * scale);
     SDL_RenderCopy(_renderer, _heightmap_texture, NULL, &destination);
 
     ImGui_ImplSDLRenderer_RenderDrawData(ImGui::GetDrawData());
@@ -5,6 +5,50 @@
 #include "image.h"
 #include "settings.h"
 
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// All the maps that the pipeline of the view produces
+struct view_maps
+  {
+  std::unique_ptr<image> heightmap;
+  std::unique_ptr<image> normalmap;
+  std::unique_ptr<image> colormap;
+  std::unique_ptr<image> islandgradient;
+  std::unique_ptr<image> variation;
+  };
+
+// The colormap of every 15 bit height for the palette given by colors and heights
+struct view_color_lut
+  {
+  std::vector<uint32_t> colors;
+  std::vector<double> heights;
+  std::vector<uint64_t> table; // empty if the palette has less than 2 colors
+  uint32_t flat_color; // the color of the whole map if the table is empty
+
+  // The biome colormap by height and moisture, blending the palette above with the wet palette
+  std::vector<uint32_t> wet_colors;
+  std::vector<double> wet_heights;
+  std::vector<uint32_t> biome_colors; // the palette above when biome_table was built, colors is already updated by then
+  std::vector<double> biome_heights;
+  std::vector<uint64_t> biome_table;
+  };
+
+// A map that is written to a file on its own thread
+struct view_export_job
+  {
+  std::string filename;
+  std::shared_ptr<image> map; // shared, so the view can move on to new maps during the export
+  std::string mapped_file; // the file that map is mapped to, removed after the export, empty for a map in memory
+  image_export_options options;
+  std::atomic<int32_t> rows; // written so far
+  std::atomic<bool> done;
+  bool ok; // only valid once done
+  std::thread thread;
+  };
+
 class view
   {
   public:
@@ -18,7 +62,13 @@ class view
     void _poll_for_events();
     void _imgui_ui();    
     void _check_image();
+    void _check_refinement();
+    void _wait_for_refinement();
+    void _refine_loop();
+    void _show_maps(view_maps& maps, bool preview);
     void _export_images();
+    void _check_exports();
+    void _update_heightmap_source();
 
   private:
     uint32_t _w, _h;
@@ -27,10 +77,36 @@ class view
     SDL_Surface* _heightmap_surface;
     SDL_Texture* _heightmap_texture;
     bool _quit;
-    std::unique_ptr<image> _heightmap;    
-    std::unique_ptr<image> _normalmap;
-    std::unique_ptr<image> _colormap;
+    std::shared_ptr<image> _heightmap;    
+    std::shared_ptr<image> _normalmap;
+    std::shared_ptr<image> _colormap;
     std::unique_ptr<image> _islandgradient;
+    std::unique_ptr<image> _variation;
+    std::unique_ptr<image_perlin_noise> _preview_heightmap_noise;
+    std::unique_ptr<image_perlin_noise> _preview_variation_noise;
+    view_color_lut _preview_color_lut;
+    std::shared_ptr<const image> _heightmap_source; // the imported heightmap file, null if the noise is used
+    std::string _heightmap_source_file; // the file that _heightmap_source was read from
+    int32_t _heightmap_source_raw_width, _heightmap_source_raw_height; // the raw size in the settings when it was read
+    int32_t _map_width, _map_height; // of the imported heightmap file, or the noise size in the settings
     settings _settings;
-    bool _dirty;    
+    bool _dirty;
+    bool _showing_preview;
+    std::vector<std::unique_ptr<view_export_job>> _export_jobs; // of the last export
+    std::string _export_status; // the result of the last finished export
+
+    // The full resolution maps are computed by _refine_thread, the members below are guarded by _refine_mutex.
+    std::thread _refine_thread;
+    std::mutex _refine_mutex;
+    std::condition_variable _refine_cv;
+    settings _refine_settings; // of the last request
+    std::shared_ptr<const image> _refine_source; // of the last request
+    std::atomic<uint64_t> _refine_requested; // generation of the last request
+    uint64_t _refine_started; // generation the refine thread is working on
+    uint64_t _refined_generation; // generation of _refined
+    std::unique_ptr<view_maps> _refined; // finished maps that were not shown yet
+    bool _refine_quit;
+    std::unique_ptr<image_perlin_noise> _heightmap_noise; // only used by the refine thread
+    std::unique_ptr<image_perlin_noise> _variation_noise; // only used by the refine thread
+    view_color_lut _color_lut; // only used by the refine thread
   };
\ No newline at end of file